@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "mysh.h"
+#ifndef THREADS
+#define THREADS 4
+#endif
+#ifndef ROUNDS
+#define ROUNDS 20
+#endif
+
+/*
+ * Tests the embedding interface (libmysh.a): ./libtest
+ * Each thread runs its own context in a directory of its own, all at the same time, and checks what its commands printed.
+ * Also checks that the program's working directory is left alone, the exit builtin, scripts and mysh_tokenize()
+ */
+
+char base[] = "/tmp/mysh-lib-XXXXXX";
+int failures = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void check(const char *name, int passed, const char *got){
+    pthread_mutex_lock(&lock);
+    if(passed) printf("PASS: %s\n", name);
+    else {printf("FAIL: %s, got: %s\n", name, got); failures ++;}
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Returns what the commands of a context wrote to the memfd out since the last call, in an allocated string
+ */
+char* takeOutput(int out){
+    off_t size = lseek(out, 0, SEEK_CUR);
+    char *text = calloc(size + 1, 1);
+    pread(out, text, size, 0);
+    ftruncate(out, 0);
+    lseek(out, 0, SEEK_SET);
+    return text;
+}
+
+void* runThread(void *arg){
+    int id = (int)(long)arg, out = memfd_create("out", 0);
+    mysh_ctx *ctx = mysh_ctx_new(STDIN_FILENO, out, out);
+    char line[128], name[64], *text;
+    //variables, $?, cd, external commands, the cat builtin and parallel, all in this context only
+    snprintf(line, sizeof(line), "cd d%d; N=%d", id, id);
+    mysh_run_line(ctx, line);
+    char expected[ROUNDS * (PATH_MAX + 16) + 1];
+    int used = 0, status = 0;
+    for(int i = 0; i < ROUNDS; i ++){
+        status |= mysh_run_line(ctx, "echo $N $(/bin/pwd)");
+        used += snprintf(expected + used, sizeof(expected) - used, "%d %s/d%d\n", id, base, id);
+    }
+    text = takeOutput(out);
+    snprintf(name, sizeof(name), "thread %d: variables and working directory", id);
+    check(name, status == 0 && strcmp(text, expected) == 0, text);
+    free(text);
+    status = mysh_run_line(ctx, "false");
+    mysh_run_line(ctx, "echo status $?; echo file > f; cat f; parallel -k echo ::: a b c");
+    text = takeOutput(out);
+    snprintf(name, sizeof(name), "thread %d: status, cat and parallel", id);
+    check(name, status == 1 && strcmp(text, "status 1\nfile\na\nb\nc\n") == 0, text);
+    free(text);
+    status = mysh_run_line(ctx, "echo before; exit; echo after");
+    mysh_run_line(ctx, "echo next");
+    text = takeOutput(out);
+    snprintf(name, sizeof(name), "thread %d: exit ends the line only", id);
+    check(name, status == 0 && strcmp(text, "before\nnext\n") == 0, text);
+    free(text);
+    mysh_ctx_free(ctx);
+    close(out);
+    return NULL;
+}
+
+int main(){
+    char cwd[PATH_MAX], after[PATH_MAX], path[PATH_MAX + 16];
+    if(mkdtemp(base) == NULL || chdir(base) == -1) {perror("mkdtemp"); return EXIT_FAILURE;}
+    for(int i = 0; i < THREADS; i ++){
+        snprintf(path, sizeof(path), "d%d", i);
+        mkdir(path, 0755);
+    }
+    getcwd(cwd, PATH_MAX);
+    pthread_t threads[THREADS];
+    for(int i = 0; i < THREADS; i ++) pthread_create(&threads[i], NULL, runThread, (void *)(long)i);
+    for(int i = 0; i < THREADS; i ++) pthread_join(threads[i], NULL);
+    check("working directory of the program", getcwd(after, PATH_MAX) != NULL && strcmp(cwd, after) == 0, after);
+
+    int out = memfd_create("out", 0);
+    mysh_ctx *ctx = mysh_ctx_new(STDIN_FILENO, out, out);
+    FILE *script = fopen("script.sh", "w");
+    fputs("for x in 1 2; do\necho line $x\ndone\nfalse\n", script);
+    fclose(script);
+    int status = mysh_run_file(ctx, "script.sh");
+    char *text = takeOutput(out);
+    check("mysh_run_file", status == 1 && strcmp(text, "line 1\nline 2\n") == 0, text);
+    free(text);
+    int count;
+    char **words = mysh_tokenize(ctx, "echo a\\ b|wc -l\n\nls > out && echo $HOME;", &count);
+    char joined[256] = "";
+    for(int i = 0; i < count; i ++) {strcat(joined, words[i]); strcat(joined, ",");}
+    check("mysh_tokenize", count == 12 && words[count] == NULL && strcmp(joined, "echo,a b,|,wc,-l,;,ls,>,out,&&,echo,$HOME,") == 0, joined);
+    free(words);
+    check("mysh_tokenize open substitution", mysh_tokenize(ctx, "echo $(ls", &count) == NULL, "a result");
+    mysh_ctx_free(ctx);
+    close(out);
+
+    snprintf(path, sizeof(path), "rm -rf %s", base);
+    system(path);
+    printf("%d failures\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
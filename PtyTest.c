@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#ifndef BIG_ENTRIES
+#define BIG_ENTRIES 100000
+#endif
+#ifndef TIMING_RUNS
+#define TIMING_RUNS 50
+#endif
+
+/*
+ * Drives mysh through a pseudo terminal to test line editing and Tab completion: ./ptytest [path to mysh]
+ * Keystrokes are written to the terminal and the screen output is searched for what should appear.
+ * Also times the completion of a path in a directory of 100k entries
+ */
+
+int terminal;
+char output[1 << 20];
+int output_length = 0, output_seen = 0, failures = 0;
+
+unsigned long long monotonicNs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void sendKeys(const char *keys){
+    write(terminal, keys, strlen(keys));
+}
+
+/*
+ * Reads the screen output until text shows up after what earlier checks have seen, for at most timeout_ms
+ * Returns 1 if it showed up
+ */
+int expect(const char *text, int timeout_ms){
+    unsigned long long deadline = monotonicNs() + timeout_ms * 1000000ULL;
+    for(;;){
+        char *found = memmem(output + output_seen, output_length - output_seen, text, strlen(text));
+        if(found != NULL) {output_seen = found - output + strlen(text); return 1;}
+        unsigned long long now = monotonicNs();
+        if(now >= deadline || output_length == sizeof(output)) return 0;
+        struct pollfd pfd = {terminal, POLLIN, 0};
+        if(poll(&pfd, 1, (deadline - now) / 1000000 + 1) <= 0) continue;
+        ssize_t n = read(terminal, output + output_length, sizeof(output) - output_length);
+        if(n <= 0) return 0;
+        output_length += n;
+    }
+}
+
+void check(const char *name, const char *keys, const char *text){
+    sendKeys(keys);
+    if(expect(text, 5000)) printf("PASS: %s\n", name);
+    else{
+        int shown = output_length - output_seen < 200 ? output_length - output_seen : 200;
+        printf("FAIL: %s, expected \"%s\" after: %.*s\n", name, text, shown, output + output_seen);
+        failures ++;
+    }
+}
+
+int compareNs(const void *a, const void *b){
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+void makeFile(const char *path, const char *contents){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {perror(path); exit(EXIT_FAILURE);}
+    write(fd, contents, strlen(contents));
+    close(fd);
+}
+
+int main(int argc, char **argv){
+    char shell[PATH_MAX];
+    if(realpath(argc > 1 ? argv[1] : "./mysh", shell) == NULL) {perror("mysh"); return EXIT_FAILURE;}
+    char dir[] = "/tmp/mysh-pty-XXXXXX";
+    if(mkdtemp(dir) == NULL || chdir(dir) == -1) {perror("mkdtemp"); return EXIT_FAILURE;}
+    makeFile("alpha.txt", "hello from alpha\n");
+    makeFile("beta", "");
+    mkdir("alpine dir", 0755);
+    mkdir("big", 0755);
+    char name[64];
+    for(int i = 0; i < BIG_ENTRIES; i ++){
+        snprintf(name, sizeof(name), "big/f%06d", i);
+        makeFile(name, "");
+    }
+    makeFile("big/unique_target", "");
+    //a directory changed in the last two seconds is read again on every Tab, wait so the timing uses the cached listing
+    sleep(2);
+
+    terminal = posix_openpt(O_RDWR | O_NOCTTY);
+    if(terminal == -1 || grantpt(terminal) == -1 || unlockpt(terminal) == -1) {perror("pty"); return EXIT_FAILURE;}
+    pid_t pid = fork();
+    if(pid == 0){
+        setsid();
+        int slave = open(ptsname(terminal), O_RDWR);
+        if(slave == -1) {perror("pty"); _exit(EXIT_FAILURE);}
+        dup2(slave, 0);
+        dup2(slave, 1);
+        dup2(slave, 2);
+        close(slave);
+        close(terminal);
+        execl(shell, "mysh", NULL);
+        perror(shell);
+        _exit(EXIT_FAILURE);
+    }
+
+    check("prompt", "", "mysh> ");
+    check("command name", "ech\t", "echo ");
+    check("run completed command", "hi\r", "\r\nhi\r\n");
+    check("builtin name", "paral\t", "parallel ");
+    check("list matches", "\x15" "cat alp\t", "alpha.txt  alpine dir");
+    check("unique file", "\x15" "cat alph\t", "a.txt ");
+    check("run completed path", "\r", "hello from alpha");
+    check("escaped directory", "cd alpi\t", "ne\\ dir/");
+    check("cursor editing", "\x15" "ho hi\x01" "ec\r", "\r\nhi\r\n");
+    check("first completion in big directory", "ls big/unique\t", "_target ");
+    check("list in big directory", "\x15" "ls big/f09999\t", "f099990  f099991");
+
+    //time Tab on the cached listing, from writing the key to seeing the completed text
+    unsigned long long samples[TIMING_RUNS];
+    int timed = 0;
+    for(int i = 0; i < TIMING_RUNS; i ++){
+        sendKeys("\x15" "ls big/uniq");
+        if(!expect("uniq", 5000)) break;
+        unsigned long long started = monotonicNs();
+        sendKeys("\t");
+        if(!expect("ue_target ", 5000)) break;
+        samples[timed ++] = monotonicNs() - started;
+    }
+    if(timed == TIMING_RUNS){
+        qsort(samples, timed, sizeof(samples[0]), compareNs);
+        unsigned long long median = samples[timed / 2];
+        printf("%s: Tab in a directory of %d entries, median %.3f ms, max %.3f ms (including the pty round trip)\n",
+            median < 1000000 ? "PASS" : "FAIL", BIG_ENTRIES + 1, median / 1e6, samples[timed - 1] / 1e6);
+        if(median >= 1000000) failures ++;
+    }
+    else {printf("FAIL: timing\n"); failures ++;}
+
+    check("exit", "\x15" "exit\r", "\n");
+    int status;
+    waitpid(pid, &status, 0);
+    close(terminal);
+    char cleanup[64];
+    snprintf(cleanup, sizeof(cleanup), "rm -rf %s", dir);
+    system(cleanup);
+    printf("%d failures\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+#include <linux/perf_event.h>
+#ifndef REPLAY_TIMEOUT_MS
+#define REPLAY_TIMEOUT_MS 60000 //a script still running after this is killed and fails
+#endif
+#define COUNTERS 5
+
+/*
+ * Replays a corpus of batch scripts through mysh and compares what they print with golden files:
+ *   ./replaytest [-u] [-s path to mysh] [-c corpus] [-t thresholds] [names...]
+ * Every script runs in a freshly generated fixture tree (see makeFixture()) with a fixed environment, and its stdout, stderr
+ * and exit status are compared with replay/golden/NAME.out, NAME.err and NAME.status, -u writes them instead.
+ * The fixture's path is replaced by $FIXTURE in the output, so the golden files do not depend on where it was made.
+ * Cycles, instructions and cache misses of the shell and everything it starts are counted with perf_event_open(), along with
+ * context switches and the wall time. A counter the machine does not have shows as n/a. A counter over its limit in the
+ * thresholds file fails the script like wrong output does. The wall time is only reported, it depends on the load of the machine.
+ * -u also writes the instruction limits of the scripts it ran into the thresholds file, twice the measured values (see
+ * setThreshold()), the other counters vary from run to run and only get hand written limits
+ */
+
+typedef struct{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int checked;              //the thresholds file may set limits for it
+    int recorded;             //-u writes per-script limits from the measured values, only for counters that do not depend on the load
+} counter_kind;
+
+//the wall time is counter 0, measured with the clock
+counter_kind kinds[COUNTERS] = {
+    {"time-ms", 0, 0, 0, 0},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1, 0},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 1, 1},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1, 0},
+    {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, 1, 0},
+};
+
+//one line of the thresholds file, script "*" applies to every script without a line of its own for that counter
+typedef struct{
+    char script[64];
+    int counter;
+    unsigned long long max;
+} threshold;
+
+threshold thresholds[256];
+int threshold_count = 0;
+char work[] = "/tmp/mysh-replay-XXXXXX";
+char fixture[PATH_MAX];
+
+unsigned long long monotonicNs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void makeFile(const char *path, const char *contents){
+    char full[PATH_MAX * 2];
+    snprintf(full, sizeof(full), "%s/%s", fixture, path);
+    int fd = open(full, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {perror(full); exit(EXIT_FAILURE);}
+    write(fd, contents, strlen(contents));
+    close(fd);
+}
+
+void makeDir(const char *path){
+    char full[PATH_MAX * 2];
+    snprintf(full, sizeof(full), "%s/%s", fixture, path);
+    if(mkdir(full, 0755) == -1) {perror(full); exit(EXIT_FAILURE);}
+}
+
+/*
+ * Creates the tree every script starts in: files for wildcards (foo*bar, *.c...), a directory with a space,
+ * 1000 files in many/, input for pipelines in data/, and a home directory with Desktop and Downloads for the tilde scripts.
+ * Wildcard matches come in directory order, which depends on the filesystem, so a pattern that is echoed rather than passed
+ * to ls should match one name (*.txt does)
+ */
+void makeFixture(){
+    char command[PATH_MAX + 16], name[64];
+    snprintf(command, sizeof(command), "rm -rf %s", fixture);
+    system(command);
+    if(mkdir(fixture, 0755) == -1) {perror(fixture); exit(EXIT_FAILURE);}
+    makeFile("notes.txt", "# notes\n");
+    makeFile("foo", "");
+    makeFile("foobar", "");
+    makeFile("foo_bar.md", "");
+    makeFile("math.c", "int main(){return 0;}\n");
+    makeDir("data");
+    makeFile("data/a.txt", "first file\n");
+    makeFile("data/b.txt", "second file\n");
+    makeFile("data/input.txt", "cherry\napple\nbanana\napple\n");
+    makeDir("src");
+    makeFile("src/main.c", "#include \"util.h\"\n");
+    makeFile("src/util.c", "");
+    makeFile("src/util.h", "");
+    makeDir("dir with space");
+    makeFile("dir with space/inside.txt", "inside\n");
+    makeDir("many");
+    for(int i = 0; i < 1000; i ++){
+        snprintf(name, sizeof(name), "many/item%04d.dat", i);
+        makeFile(name, "");
+    }
+    makeDir("home");
+    makeFile("home/.profile", "");
+    makeDir("home/Desktop");
+    makeFile("home/Desktop/todo.txt", "water the plants\n");
+    makeFile("home/Desktop/photo.png", "");
+    makeDir("home/Downloads");
+    makeFile("home/Downloads/paper.txt", "");
+    makeFile("home/Downloads/setup.sh", "");
+}
+
+/*
+ * Reads the thresholds file, lines of "script counter max" where # starts a comment
+ * Returns 1 on success or 0 if a line is invalid, a missing file means no thresholds
+ */
+int readThresholds(const char *path){
+    FILE *file = fopen(path, "r");
+    if(file == NULL) return 1;
+    char line[256], counter[64];
+    int number = 0;
+    while(fgets(line, sizeof(line), file) != NULL){
+        number ++;
+        char *comment = strchr(line, '#');
+        if(comment != NULL) *comment = '\0';
+        threshold *t = &thresholds[threshold_count];
+        int fields = sscanf(line, "%63s %63s %llu", t->script, counter, &t->max);
+        if(fields <= 0) continue;
+        for(t->counter = 0; t->counter < COUNTERS && strcmp(kinds[t->counter].name, counter) != 0; t->counter ++);
+        if(fields != 3 || t->counter == COUNTERS || !kinds[t->counter].checked || threshold_count + 1 == sizeof(thresholds) / sizeof(thresholds[0])){
+            fprintf(stderr, "%s:%d: invalid threshold\n", path, number);
+            fclose(file);
+            return 0;
+        }
+        threshold_count ++;
+    }
+    fclose(file);
+    return 1;
+}
+
+/*
+ * Returns the limit of counter for script, or 0 for none
+ */
+unsigned long long limitFor(const char *script, int counter){
+    unsigned long long limit = 0;
+    for(int i = 0; i < threshold_count; i ++){
+        if(thresholds[i].counter != counter) continue;
+        if(strcmp(thresholds[i].script, script) == 0) return thresholds[i].max;
+        if(strcmp(thresholds[i].script, "*") == 0) limit = thresholds[i].max;
+    }
+    return limit;
+}
+
+/*
+ * Sets the limit of counter for script (not "*") from a value measured with -u, twice the value
+ * Replaces the script's earlier limit for that counter
+ */
+void setThreshold(const char *script, int counter, unsigned long long value){
+    unsigned long long max = value * 2;
+    int i = 0;
+    while(i < threshold_count && (thresholds[i].counter != counter || strcmp(thresholds[i].script, script) != 0)) i ++;
+    if(i == sizeof(thresholds) / sizeof(thresholds[0])) {fprintf(stderr, "too many thresholds\n"); return;}
+    if(i == threshold_count){
+        snprintf(thresholds[i].script, sizeof(thresholds[i].script), "%s", script);
+        thresholds[i].counter = counter;
+        threshold_count ++;
+    }
+    thresholds[i].max = max;
+}
+
+/*
+ * Writes the thresholds back after -u, the lines for every script ("*") first
+ * Returns 1 on success or 0 if the file cannot be written
+ */
+int writeThresholds(const char *path){
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {perror(path); return 0;}
+    fputs("# Performance limits of the replayed scripts: script counter max, \"*\" for every script without a line of its own.\n"
+          "# Counters: cycles, instructions, cache-misses, context-switches, the wall time is only reported. A counter the\n"
+          "# machine does not have is not checked. ./replaytest -u rewrites this file with the instruction limits of the\n"
+          "# scripts it ran set to twice the measured values (with the default build, sanitizers included), the other lines\n"
+          "# are kept as they are.\n", file);
+    for(int pass = 0; pass < 2; pass ++){
+        for(int i = 0; i < threshold_count; i ++){
+            if((strcmp(thresholds[i].script, "*") == 0) != (pass == 0)) continue;
+            fprintf(file, "%-24s  %-17s %llu\n", thresholds[i].script, kinds[thresholds[i].counter].name, thresholds[i].max);
+        }
+    }
+    return fclose(file) == 0;
+}
+
+/*
+ * Opens a counter of the process pid and of the children it starts, counting from its next execve()
+ * Without permission to count in the kernel (perf_event_paranoid 2 and not root) hardware counters count user space only,
+ * context switches happen in the kernel so they are not available then
+ * Returns the descriptor, or -1 if the machine or the permissions do not allow it
+ */
+int openCounter(pid_t pid, counter_kind *kind){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = kind->type;
+    attr.config = kind->config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if(fd == -1 && errno == EACCES && kind->type == PERF_TYPE_HARDWARE){
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/*
+ * Returns everything written to the memfd fd, with the fixture's path replaced by $FIXTURE, in an allocated string
+ */
+char* readOutput(int fd, size_t *length){
+    off_t size = lseek(fd, 0, SEEK_END);
+    char *raw = calloc(size + 1, 1), *text = calloc(size + 1, 1);
+    pread(fd, raw, size, 0);
+    size_t fixture_length = strlen(fixture), used = 0;
+    for(off_t i = 0; i < size;){
+        if(strncmp(raw + i, fixture, fixture_length) == 0){
+            used += sprintf(text + used, "$FIXTURE");
+            i += fixture_length;
+        }
+        else text[used ++] = raw[i ++];
+    }
+    free(raw);
+    *length = used;
+    return text;
+}
+
+/*
+ * Returns the contents of path in an allocated string, or NULL if it cannot be read
+ */
+char* readFile(const char *path, size_t *length){
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) return NULL;
+    struct stat st;
+    fstat(fd, &st);
+    char *text = calloc(st.st_size + 1, 1);
+    *length = read(fd, text, st.st_size);
+    close(fd);
+    return text;
+}
+
+void writeFile(const char *path, const char *text, size_t length){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || write(fd, text, length) != (ssize_t)length) perror(path);
+    if(fd != -1) close(fd);
+}
+
+/*
+ * Compares the output of a script with its golden file, or writes the golden file with -u
+ * A difference is shown with diff -u against a copy of the output in the work directory
+ * Returns 1 if they are the same
+ */
+int compareGolden(const char *name, const char *suffix, const char *text, size_t length, int update){
+    char golden[PATH_MAX], actual[PATH_MAX], command[PATH_MAX * 2 + 32];
+    snprintf(golden, sizeof(golden), "replay/golden/%s.%s", name, suffix);
+    if(update) {writeFile(golden, text, length); return 1;}
+    size_t golden_length = 0;
+    char *expected = readFile(golden, &golden_length);
+    int same = expected != NULL && golden_length == length && memcmp(expected, text, length) == 0;
+    free(expected);
+    if(!same){
+        snprintf(actual, sizeof(actual), "%s/%s.%s", work, name, suffix);
+        writeFile(actual, text, length);
+        printf("%s: %s differs from %s\n", name, suffix, golden);
+        snprintf(command, sizeof(command), "diff -u %s %s | head -n 40", golden, actual);
+        fflush(stdout);
+        system(command);
+    }
+    return same;
+}
+
+/*
+ * Runs one script of the corpus in a new fixture, checks its output and counters and prints a line for it
+ * Returns 1 if the script passed
+ */
+int replay(const char *shell, const char *script, int update){
+    char name[64], path[PATH_MAX], home[PATH_MAX + 16], cache[PATH_MAX + 32];
+    const char *base = strrchr(script, '/') != NULL ? strrchr(script, '/') + 1 : script;
+    snprintf(name, sizeof(name), "%.*s", (int)(strstr(base, ".txt") != NULL ? strstr(base, ".txt") - base : (long)strlen(base)), base);
+    if(realpath(script, path) == NULL) {perror(script); return 0;}
+    makeFixture();
+    snprintf(home, sizeof(home), "HOME=%s/home", fixture);
+    snprintf(cache, sizeof(cache), "XDG_CACHE_HOME=%s/.cache", fixture);
+    char *envp[] = {"PATH=/usr/local/bin:/usr/bin:/bin", home, cache, "LC_ALL=C", "TZ=UTC", "ASAN_OPTIONS=detect_leaks=0", NULL};
+    char *argv[] = {"mysh", "--no-cache", path, NULL};
+    int out = memfd_create("stdout", 0), err = memfd_create("stderr", 0), go[2];
+    if(out == -1 || err == -1 || pipe2(go, O_CLOEXEC) == -1) {perror("replay"); exit(EXIT_FAILURE);}
+    pid_t pid = fork();
+    if(pid == 0){
+        //waits for the counters to be attached, they start counting at execve()
+        int null = open("/dev/null", O_RDONLY);
+        char c;
+        close(go[1]);
+        if(chdir(fixture) == -1 || null == -1) _exit(126);
+        dup2(null, 0);
+        dup2(out, 1);
+        dup2(err, 2);
+        read(go[0], &c, 1);
+        execve(shell, argv, envp);
+        _exit(127);
+    }
+    close(go[0]);
+    int counters[COUNTERS];
+    counters[0] = -1;
+    for(int i = 1; i < COUNTERS; i ++) counters[i] = openCounter(pid, &kinds[i]);
+    unsigned long long started = monotonicNs();
+    close(go[1]);
+    //waits on a pidfd so a hung script is killed after REPLAY_TIMEOUT_MS instead of stalling the run
+    int pidfd = syscall(SYS_pidfd_open, pid, 0), wstatus = 0, timed_out = 0;
+    struct pollfd pfd = {pidfd, POLLIN, 0};
+    if(pidfd != -1 && poll(&pfd, 1, REPLAY_TIMEOUT_MS) == 0) {kill(pid, SIGKILL); timed_out = 1;}
+    waitpid(pid, &wstatus, 0);
+    unsigned long long values[COUNTERS];
+    int available[COUNTERS];
+    values[0] = (monotonicNs() - started) / 1000000;
+    available[0] = 1;
+    for(int i = 1; i < COUNTERS; i ++){
+        available[i] = counters[i] != -1 && read(counters[i], &values[i], sizeof(values[i])) == sizeof(values[i]);
+        if(counters[i] != -1) close(counters[i]);
+    }
+    if(pidfd != -1) close(pidfd);
+
+    size_t out_length, err_length;
+    char *out_text = readOutput(out, &out_length), *err_text = readOutput(err, &err_length), status[32];
+    int status_length = snprintf(status, sizeof(status), "%d\n", WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus));
+    close(out);
+    close(err);
+    int passed = !timed_out;
+    if(timed_out) printf("%s: killed after %d ms\n", name, REPLAY_TIMEOUT_MS);
+    passed &= compareGolden(name, "out", out_text, out_length, update);
+    passed &= compareGolden(name, "err", err_text, err_length, update);
+    passed &= compareGolden(name, "status", status, status_length, update);
+    free(out_text);
+    free(err_text);
+
+    char line[512];
+    int used = snprintf(line, sizeof(line), "%-24s", name);
+    for(int i = 0; i < COUNTERS; i ++){
+        unsigned long long limit = limitFor(name, i);
+        int over = available[i] && kinds[i].checked && limit != 0 && values[i] > limit;
+        if(!available[i]) used += snprintf(line + used, sizeof(line) - used, "  %s n/a", kinds[i].name);
+        else used += snprintf(line + used, sizeof(line) - used, "  %s %llu%s", kinds[i].name, values[i], over ? " (over)" : "");
+        if(over && !update) {passed = 0; printf("%s: %s %llu is over the threshold of %llu\n", name, kinds[i].name, values[i], limit);}
+        if(update && available[i] && kinds[i].recorded) setThreshold(name, i, values[i]);
+    }
+    printf("%s: %s\n", update ? "UPDATED" : passed ? "PASS" : "FAIL", line);
+    fflush(stdout);
+    return passed;
+}
+
+int main(int argc, char **argv){
+    const char *shell = "./mysh", *corpus = "replay/corpus.txt", *threshold_path = "replay/thresholds.txt";
+    int update = 0, first_name = argc;
+    for(int i = 1; i < argc; i ++){
+        if(strcmp(argv[i], "-u") == 0) update = 1;
+        else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc) shell = argv[++ i];
+        else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) corpus = argv[++ i];
+        else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) threshold_path = argv[++ i];
+        else {first_name = i; break;}
+    }
+    char shell_path[PATH_MAX];
+    if(realpath(shell, shell_path) == NULL) {perror(shell); return EXIT_FAILURE;}
+    if(!readThresholds(threshold_path)) return EXIT_FAILURE;
+    FILE *list = fopen(corpus, "r");
+    if(list == NULL) {perror(corpus); return EXIT_FAILURE;}
+    if(mkdtemp(work) == NULL) {perror("mkdtemp"); return EXIT_FAILURE;}
+    snprintf(fixture, sizeof(fixture), "%s/fixture", work);
+    if(update) mkdir("replay/golden", 0755);
+
+    //runs every script of the corpus, or only those named on the command line
+    char line[PATH_MAX];
+    int scripts = 0, failures = 0;
+    while(fgets(line, sizeof(line), list) != NULL){
+        line[strcspn(line, "#\n")] = '\0';
+        char *script = line + strspn(line, " \t");
+        script[strcspn(script, " \t")] = '\0';
+        if(script[0] == '\0') continue;
+        int wanted = first_name == argc;
+        for(int i = first_name; i < argc && !wanted; i ++) wanted = strstr(script, argv[i]) != NULL;
+        if(!wanted) continue;
+        scripts ++;
+        if(!replay(shell_path, script, update)) failures ++;
+    }
+    fclose(list);
+    if(update && !writeThresholds(threshold_path)) failures ++;
+    char cleanup[64];
+    snprintf(cleanup, sizeof(cleanup), "rm -rf %s", work);
+    if(failures == 0) system(cleanup);
+    else printf("outputs of the failed scripts are in %s\n", work);
+    printf("%d scripts, %d failures\n", scripts, failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ast.h"
+
+static const char *if_terminators[] = {"then", NULL};
+static const char *then_terminators[] = {"elif", "else", "fi", NULL};
+static const char *else_terminators[] = {"fi", NULL};
+static const char *while_terminators[] = {"do", NULL};
+static const char *do_terminators[] = {"done", NULL};
+//words that can only end a list, finding one where a command should start is a syntax error
+static const char *reserved[] = {"then", "elif", "else", "fi", "do", "done", NULL};
+
+static ast_node *parse_and_or(ast_parser *parser);
+
+static int at_end(ast_parser *parser){
+    return parser->pos >= parser->script->size;
+}
+
+static int at_separator(ast_parser *parser){
+    return !at_end(parser) && (parser->script->flags[parser->pos] & WORD_END);
+}
+
+/*
+ * Returns 1 if the current word is the given keyword, keywords are only recognized when written without expansions
+ */
+static int at_keyword(ast_parser *parser, const char *keyword){
+    return !at_end(parser) && parser->script->flags[parser->pos] == 0 && strcmp(script_word(parser->script, parser->pos), keyword) == 0;
+}
+
+static int at_keyword_in(ast_parser *parser, const char **keywords){
+    for(int i = 0; keywords[i] != NULL; i ++){
+        if(at_keyword(parser, keywords[i])) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns NODE_AND or NODE_OR if the current word is "&&" or "||", -1 otherwise
+ */
+static int at_and_or(ast_parser *parser){
+    if(at_end(parser) || !(parser->script->flags[parser->pos] & WORD_OPERATOR)) return -1;
+    const char *word = script_word(parser->script, parser->pos);
+    if(strcmp(word, "&&") == 0) return NODE_AND;
+    if(strcmp(word, "||") == 0) return NODE_OR;
+    return -1;
+}
+
+/*
+ * Records the first problem found, running out of words inside a construct means more input is needed
+ */
+static ast_node *fail(ast_parser *parser){
+    if(parser->status == PARSE_OK){
+        parser->status = at_end(parser) ? PARSE_INCOMPLETE : PARSE_ERROR;
+        parser->error_word = parser->pos;
+    }
+    return NULL;
+}
+
+/*
+ * Allocates a node of the given type
+ * Returns the node, or NULL with the parse failed as PARSE_ERROR if there is no memory
+ */
+static ast_node *new_node(ast_parser *parser, int type){
+    ast_node *node = calloc(1, sizeof(ast_node));
+    if(node == NULL){
+        if(parser->status == PARSE_OK) {parser->status = PARSE_ERROR; parser->error_word = parser->pos;}
+        return NULL;
+    }
+    node->type = type;
+    return node;
+}
+
+static void skip_separators(ast_parser *parser){
+    while(at_separator(parser)) parser->pos ++;
+}
+
+/*
+ * Consumes the expected keyword
+ * Returns 1 on success or 0 after recording the error
+ */
+static int expect(ast_parser *parser, const char *keyword){
+    if(!at_keyword(parser, keyword)) {fail(parser); return 0;}
+    parser->pos ++;
+    return 1;
+}
+
+/*
+ * Parses commands separated by newlines or ';' until one of the terminator keywords starts a command
+ * Returns the first command of the list, or NULL if the list is empty or on error
+ */
+static ast_node *parse_list(ast_parser *parser, const char **terminators){
+    ast_node *head = NULL, *tail = NULL;
+    for(;;){
+        skip_separators(parser);
+        if(at_end(parser) || at_keyword_in(parser, terminators)) break;
+        ast_node *node = parse_and_or(parser);
+        if(node == NULL) {ast_free(head); return NULL;}
+        if(tail == NULL) head = node;
+        else tail->next = node;
+        tail = node;
+    }
+    if(head == NULL) return fail(parser);
+    return head;
+}
+
+/*
+ * Parses "if"/"elif" through the closing "fi", an elif chain becomes nested NODE_IF alternatives sharing that "fi"
+ */
+static ast_node *parse_if(ast_parser *parser){
+    ast_node *node = new_node(parser, NODE_IF);
+    if(node == NULL) return NULL;
+    parser->pos ++;
+    if((node->cond = parse_list(parser, if_terminators)) == NULL || !expect(parser, "then")) {ast_free(node); return NULL;}
+    if((node->body = parse_list(parser, then_terminators)) == NULL) {ast_free(node); return NULL;}
+    if(at_keyword(parser, "elif")){
+        if((node->alt = parse_if(parser)) == NULL) {ast_free(node); return NULL;}
+        return node;
+    }
+    if(at_keyword(parser, "else")){
+        parser->pos ++;
+        if((node->alt = parse_list(parser, else_terminators)) == NULL) {ast_free(node); return NULL;}
+    }
+    if(!expect(parser, "fi")) {ast_free(node); return NULL;}
+    return node;
+}
+
+static ast_node *parse_while(ast_parser *parser){
+    ast_node *node = new_node(parser, NODE_WHILE);
+    if(node == NULL) return NULL;
+    parser->pos ++;
+    if((node->cond = parse_list(parser, while_terminators)) == NULL || !expect(parser, "do")) {ast_free(node); return NULL;}
+    if((node->body = parse_list(parser, do_terminators)) == NULL || !expect(parser, "done")) {ast_free(node); return NULL;}
+    return node;
+}
+
+/*
+ * Parses "for NAME [in words...]; do list; done", the words are kept unexpanded until the loop runs
+ */
+static ast_node *parse_for(ast_parser *parser){
+    ast_node *node = new_node(parser, NODE_FOR);
+    if(node == NULL) return NULL;
+    parser->pos ++;
+    if(at_end(parser) || at_separator(parser) || parser->script->flags[parser->pos] != 0) {ast_free(node); return fail(parser);}
+    node->name = parser->pos ++;
+    skip_separators(parser);
+    node->first = node->last = parser->pos;
+    if(at_keyword(parser, "in")){
+        parser->pos ++;
+        node->first = parser->pos;
+        while(!at_end(parser) && !at_separator(parser)){
+            if(parser->script->flags[parser->pos] & WORD_OPERATOR) {ast_free(node); return fail(parser);}
+            parser->pos ++;
+        }
+        node->last = parser->pos;
+        skip_separators(parser);
+    }
+    if(!expect(parser, "do")) {ast_free(node); return NULL;}
+    if((node->body = parse_list(parser, do_terminators)) == NULL || !expect(parser, "done")) {ast_free(node); return NULL;}
+    return node;
+}
+
+/*
+ * Parses a compound command or a simple command, which runs until a separator, "&&" or "||"
+ */
+static ast_node *parse_command(ast_parser *parser){
+    ast_node *node;
+    if(at_keyword(parser, "if")) node = parse_if(parser);
+    else if(at_keyword(parser, "while")) node = parse_while(parser);
+    else if(at_keyword(parser, "for")) node = parse_for(parser);
+    else{
+        if(at_end(parser) || at_separator(parser) || at_and_or(parser) != -1 || at_keyword_in(parser, reserved)) return fail(parser);
+        node = new_node(parser, NODE_COMMAND);
+        if(node == NULL) return NULL;
+        node->first = parser->pos;
+        while(!at_end(parser) && !at_separator(parser) && at_and_or(parser) == -1) parser->pos ++;
+        node->last = parser->pos;
+        return node;
+    }
+    //redirecting or piping a compound command is not supported
+    if(node != NULL && !at_end(parser) && !at_separator(parser) && at_and_or(parser) == -1){
+        ast_free(node);
+        return fail(parser);
+    }
+    return node;
+}
+
+/*
+ * Parses commands joined by "&&" and "||", which group from the left, newlines may follow either operator
+ */
+static ast_node *parse_and_or(ast_parser *parser){
+    ast_node *left = parse_command(parser);
+    int type;
+    while(left != NULL && (type = at_and_or(parser)) != -1){
+        parser->pos ++;
+        skip_separators(parser);
+        ast_node *right = parse_command(parser);
+        if(right == NULL) {ast_free(left); return NULL;}
+        ast_node *node = new_node(parser, type);
+        if(node == NULL) {ast_free(left); ast_free(right); return NULL;}
+        node->cond = left;
+        node->body = right;
+        left = node;
+    }
+    return left;
+}
+
+/*
+ * Prepares to parse the words of a compiled script from the beginning
+ */
+void ast_parser_init(ast_parser *parser, compiled_script *script){
+    parser->script = script;
+    parser->pos = 0;
+    parser->status = PARSE_OK;
+    parser->error_word = 0;
+}
+
+/*
+ * Parses the next complete top level command so it can run before the rest of the input is parsed
+ * Returns the command, or NULL at the end of the script or when parser->status reports an error or incomplete input
+ */
+ast_node *ast_parse_next(ast_parser *parser){
+    skip_separators(parser);
+    if(at_end(parser) || parser->status != PARSE_OK) return NULL;
+    return parse_and_or(parser);
+}
+
+/*
+ * Returns 1 if nothing but separators is left after the commands parsed so far
+ */
+int ast_parse_done(ast_parser *parser){
+    skip_separators(parser);
+    return at_end(parser);
+}
+
+/*
+ * Frees a node along with its children and the rest of its list
+ */
+void ast_free(ast_node *node){
+    while(node != NULL){
+        ast_node *next = node->next;
+        ast_free(node->cond);
+        ast_free(node->body);
+        ast_free(node->alt);
+        free(node);
+        node = next;
+    }
+}
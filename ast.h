@@ -0,0 +1,45 @@
+#ifndef _AST_H
+#define _AST_H
+
+#include <stdint.h>
+#include "script.h"
+
+#define NODE_COMMAND 0  //simple command (possibly with pipes and redirections): words [first, last)
+#define NODE_AND 1      //cond && body
+#define NODE_OR 2       //cond || body
+#define NODE_IF 3       //if cond; then body; else alt; fi (alt may be another NODE_IF for elif)
+#define NODE_WHILE 4    //while cond; do body; done
+#define NODE_FOR 5      //for <word name> in words [first, last); do body; done
+
+#define PARSE_OK 0
+#define PARSE_INCOMPLETE 1
+#define PARSE_ERROR 2
+
+/*
+ * Node of a parsed command, the words are referenced by index into the compiled script
+ * Commands of a list are chained through next
+ */
+typedef struct ast_node{
+    int type;
+    uint32_t first;
+    uint32_t last;
+    uint32_t name;
+    struct ast_node *cond;
+    struct ast_node *body;
+    struct ast_node *alt;
+    struct ast_node *next;
+} ast_node;
+
+typedef struct{
+    compiled_script *script;
+    uint32_t pos;
+    int status;
+    uint32_t error_word;
+} ast_parser;
+
+void ast_parser_init(ast_parser *parser, compiled_script *script);
+ast_node *ast_parse_next(ast_parser *parser);
+int ast_parse_done(ast_parser *parser);
+void ast_free(ast_node *node);
+
+#endif
@@ -0,0 +1,134 @@
+#!/bin/sh
+# Benchmarks for mysh. Usage: ./bench.sh [section...]   (default: all sections)
+# MYSH selects the binary to measure, build it without sanitizers for meaningful numbers:
+#   make clean && make CFLAGS="-std=c99 -O2" mysh
+MYSH=${MYSH:-./mysh}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+now_ns() { date +%s%N; }
+
+# Cold vs warm start of a 50k line batch script through the compiled script cache
+script_cache() {
+    LINES=${LINES:-50000}
+    i=0
+    while [ $i -lt $LINES ]; do
+        echo "A$((i % 100))=value$i B=two\\ words C=\$A$((i % 100)) D=~/x E=plain F=token G=list"
+        i=$((i + 1))
+    done > "$WORK/script.txt"
+    export XDG_CACHE_HOME="$WORK/cache"
+    t0=$(now_ns); $MYSH --no-cache "$WORK/script.txt"; t1=$(now_ns)
+    $MYSH --no-cache "$WORK/script.txt"; t2=$(now_ns)
+    rm -rf "$WORK/cache"
+    t3=$(now_ns); $MYSH "$WORK/script.txt"; t4=$(now_ns)
+    $MYSH "$WORK/script.txt"; t5=$(now_ns)
+    echo "script cache ($LINES lines)"
+    echo "  no cache:           $(( (t2 - t1) / 1000000 )) ms"
+    echo "  cold (compile+save): $(( (t4 - t3) / 1000000 )) ms"
+    echo "  warm (load):         $(( (t5 - t4) / 1000000 )) ms"
+}
+
+# Fresh shell per batch vs a session of a running server (mysh --server), RUNS short batches each
+# Both include starting a process from sh, a client connecting to the socket directly only pays for the session
+server() {
+    RUNS=${RUNS:-200}
+    printf 'X=1\npwd\n' > "$WORK/batch.txt"
+    $MYSH --server "$WORK/sock" 2>/dev/null &
+    server_pid=$!
+    while [ ! -S "$WORK/sock" ]; do sleep 0.01; done
+    i=0; t0=$(now_ns)
+    while [ $i -lt $RUNS ]; do $MYSH "$WORK/batch.txt" 2>/dev/null; i=$((i + 1)); done
+    i=0; t1=$(now_ns)
+    while [ $i -lt $RUNS ]; do $MYSH --client "$WORK/sock" "$WORK/batch.txt" 2>/dev/null; i=$((i + 1)); done
+    t2=$(now_ns)
+    kill $server_pid; wait $server_pid 2>/dev/null
+    echo "server ($RUNS batches)"
+    echo "  fresh shell:    $(( (t1 - t0) / RUNS / 1000 )) us/batch"
+    echo "  client+session: $(( (t2 - t1) / RUNS / 1000 )) us/batch"
+}
+
+# Spawn latency with and without --zygote after the shell has grown by VARS variables, SPAWNS commands each
+spawn() {
+    VARS=${VARS:-200000}
+    SPAWNS=${SPAWNS:-300}
+    {
+        i=0
+        while [ $i -lt $VARS ]; do echo "V$i=some_value_to_make_the_shell_grow_$i"; i=$((i + 1)); done
+        i=0
+        while [ $i -lt $SPAWNS ]; do echo "/bin/true"; i=$((i + 1)); done
+        echo stats
+    } > "$WORK/spawn.txt"
+    echo "spawn latency ($VARS variables, $SPAWNS commands)"
+    echo "  fork:"
+    $MYSH "$WORK/spawn.txt" | grep -A 3 '^command spawns' | tail -n 3
+    echo "  zygote:"
+    $MYSH --zygote "$WORK/spawn.txt" | grep -A 3 '^command spawns' | tail -n 3
+}
+
+# Writing one stream to two files: multios (cmd > a > b, relayed with tee/splice) vs | tee, MB megabytes into OUT
+multios() {
+    MB=${MB:-1024}
+    OUT=${OUT:-$WORK}
+    bytes=$((MB * 1048576))
+    echo "head -c ${MB}M /dev/zero > $OUT/a > $OUT/b" > "$WORK/multios.txt"
+    echo "head -c ${MB}M /dev/zero | tee $OUT/a > $OUT/b" > "$WORK/tee.txt"
+    t0=$(now_ns); $MYSH "$WORK/multios.txt"; t1=$(now_ns)
+    $MYSH "$WORK/tee.txt"; t2=$(now_ns)
+    rm -f "$OUT/a" "$OUT/b"
+    echo "multios (${MB} MB to 2 files in $OUT)"
+    printf "  > a > b: %d.%02d GB/s\n" $((bytes * 100 / (t1 - t0) / 100)) $((bytes * 100 / (t1 - t0) % 100))
+    printf "  | tee:   %d.%02d GB/s\n" $((bytes * 100 / (t2 - t1) / 100)) $((bytes * 100 / (t2 - t1) % 100))
+}
+
+# builtin cat against /bin/cat, file to file and file into a pipe
+cat_builtin() {
+    MB=${MB:-1024}
+    OUT=${OUT:-$WORK}
+    bytes=$((MB * 1048576))
+    head -c ${MB}M /dev/zero > "$OUT/in"
+    echo "cat $OUT/in > $OUT/out" > "$WORK/cat.txt"
+    echo "/bin/cat $OUT/in > $OUT/out" > "$WORK/bincat.txt"
+    echo "cat $OUT/in | wc -c" > "$WORK/catpipe.txt"
+    echo "/bin/cat $OUT/in | wc -c" > "$WORK/bincatpipe.txt"
+    echo "cat (${MB} MB in $OUT)"
+    # the first run pays for allocating the output file
+    $MYSH "$WORK/cat.txt"
+    for script in cat bincat catpipe bincatpipe; do
+        t0=$(now_ns); $MYSH "$WORK/$script.txt" > /dev/null; t1=$(now_ns)
+        printf "  %-11s %d.%02d GB/s\n" "$script:" $((bytes * 100 / (t1 - t0) / 100)) $((bytes * 100 / (t1 - t0) % 100))
+    done
+    rm -f "$OUT/in" "$OUT/out"
+}
+
+# Argument checks of "/bin/true dir/*" over FILES files (batched statx, see statbatch.c) against --no-validate
+validate() {
+    FILES=${FILES:-5000}
+    RUNS=${RUNS:-20}
+    mkdir "$WORK/files"
+    i=0
+    while [ $i -lt $FILES ]; do : > "$WORK/files/f$i"; i=$((i + 1)); done
+    i=0
+    while [ $i -lt $RUNS ]; do echo "/bin/true $WORK/files/*"; i=$((i + 1)); done > "$WORK/validate.txt"
+    t0=$(now_ns); $MYSH "$WORK/validate.txt"; t1=$(now_ns)
+    $MYSH --no-validate "$WORK/validate.txt"; t2=$(now_ns)
+    echo "validate ($RUNS commands with $FILES arguments)"
+    echo "  checked:       $(( (t1 - t0) / RUNS / 1000 )) us per command"
+    echo "  --no-validate: $(( (t2 - t1) / RUNS / 1000 )) us per command"
+}
+
+# ITEMS runs of /bin/true through the parallel builtin against xargs -P started by the shell, JOBS at a time
+parallel_map() {
+    ITEMS=${ITEMS:-2000}
+    JOBS=${JOBS:-4}
+    seq $ITEMS > "$WORK/items"
+    echo "parallel -j $JOBS /bin/true :::: $WORK/items" > "$WORK/parallel.txt"
+    echo "xargs -P $JOBS -n 1 /bin/true < $WORK/items" > "$WORK/xargs.txt"
+    t0=$(now_ns); $MYSH "$WORK/parallel.txt"; t1=$(now_ns)
+    $MYSH "$WORK/xargs.txt"; t2=$(now_ns)
+    echo "parallel ($ITEMS items, $JOBS jobs)"
+    echo "  parallel builtin: $(( (t1 - t0) / ITEMS / 1000 )) us per item"
+    echo "  xargs -P:         $(( (t2 - t1) / ITEMS / 1000 )) us per item"
+}
+
+SECTIONS=${*:-script_cache server spawn multios cat_builtin validate parallel_map}
+for section in $SECTIONS; do $section; done
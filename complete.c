@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "complete.h"
+
+//words after which the next word is a command again
+static const char *command_keywords[] = {"if", "then", "elif", "else", "while", "do", NULL};
+//characters escaped with '\' when a name is inserted, the ones the shell splits words on or expands
+static const char *escaped_characters = " \\|;<>&$`*?";
+
+/*
+ * Returns the child of node for character c, adding it in order when create is set, or NULL
+ */
+static trie_node *trie_child(trie_node *node, char c, int create){
+    trie_node **link = &node->child;
+    while(*link != NULL && (unsigned char)(*link)->c < (unsigned char)c) link = &(*link)->sibling;
+    if(*link != NULL && (*link)->c == c) return *link;
+    if(!create) return NULL;
+    trie_node *child = calloc(1, sizeof(trie_node));
+    child->c = c;
+    child->sibling = *link;
+    *link = child;
+    return child;
+}
+
+/*
+ * Adds a name to the trie, counting it in every node on its path unless it is already there
+ */
+static void trie_insert(trie_node *root, const char *name){
+    trie_node *node = root;
+    for(const char *p = name; *p != '\0'; p ++) node = trie_child(node, *p, 1);
+    if(node->terminal) return;
+    node->terminal = 1;
+    root->count ++;
+    node = root;
+    for(const char *p = name; *p != '\0'; p ++){
+        node = trie_child(node, *p, 0);
+        node->count ++;
+    }
+}
+
+static void trie_free(trie_node *node){
+    while(node != NULL){
+        trie_node *sibling = node->sibling;
+        trie_free(node->child);
+        free(node);
+        node = sibling;
+    }
+}
+
+/*
+ * Adds the names below node to out in order, name holds the first length characters of each of them
+ */
+static void trie_list(trie_node *node, char *name, int length, completion *out){
+    if(node->terminal && out->listed < COMPLETE_LIST_MAX) out->names[out->listed ++] = strndup(name, length);
+    for(trie_node *child = node->child; child != NULL && out->listed < COMPLETE_LIST_MAX && length < NAME_MAX; child = child->sibling){
+        name[length] = child->c;
+        trie_list(child, name, length + 1, out);
+    }
+}
+
+/*
+ * Builds the trie from the builtins and the executable files of the search directories, remembering the directories' mtimes
+ */
+static void commands_build(completer *c){
+    trie_free(c->commands);
+    c->commands = calloc(1, sizeof(trie_node));
+    for(int i = 0; c->builtins[i] != NULL; i ++) trie_insert(c->commands, c->builtins[i]);
+    for(int i = 0; i < c->dir_count; i ++){
+        DIR *dir = opendir(c->dirs[i]);
+        struct stat st;
+        memset(&c->dir_mtimes[i], 0, sizeof(struct timespec));
+        if(dir == NULL) continue;
+        if(fstat(dirfd(dir), &st) == 0) c->dir_mtimes[i] = st.st_mtim;
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL){
+            if(entry->d_name[0] == '.') continue;
+            if(fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) trie_insert(c->commands, entry->d_name);
+        }
+        closedir(dir);
+    }
+}
+
+/*
+ * Returns 1 if the trie has not been built yet or one of the search directories changed since
+ */
+static int commands_stale(completer *c){
+    if(c->commands == NULL) return 1;
+    for(int i = 0; i < c->dir_count; i ++){
+        struct stat st;
+        struct timespec mtime = {0, 0};
+        if(stat(c->dirs[i], &st) == 0) mtime = st.st_mtim;
+        if(mtime.tv_sec != c->dir_mtimes[i].tv_sec || mtime.tv_nsec != c->dir_mtimes[i].tv_nsec) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Completes a command name from the trie, common receives the longest name all the matches start with
+ */
+static void complete_command(completer *c, const char *prefix, int length, completion *out, char *common){
+    if(length > NAME_MAX) return;
+    if(commands_stale(c)) commands_build(c);
+    trie_node *node = c->commands;
+    for(int i = 0; i < length && node != NULL; i ++) node = trie_child(node, prefix[i], 0);
+    if(node == NULL) return;
+    out->count = node->count;
+    memcpy(common, prefix, length);
+    //a chain of single children is the part every match shares
+    while(!node->terminal && node->child != NULL && node->child->sibling == NULL && length < NAME_MAX){
+        node = node->child;
+        common[length ++] = node->c;
+    }
+    common[length] = '\0';
+    if(out->count > 1){
+        char name[NAME_MAX + 1];
+        memcpy(name, common, length);
+        trie_list(node, name, length, out);
+    }
+}
+
+static int compare_names(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void listing_free(dir_listing *listing){
+    free(listing->names);
+    free(listing->storage);
+    free(listing);
+}
+
+/*
+ * Reads and sorts the names of a directory
+ * Returns the listing or NULL if the directory cannot be read
+ */
+static dir_listing *listing_load(const char *path, struct stat *st){
+    DIR *dir = opendir(path);
+    if(dir == NULL) return NULL;
+    size_t used = 0, size = 64 * 1024;
+    int count = 0, slots = 1024;
+    char *storage = malloc(size);
+    size_t *offsets = malloc(sizeof(size_t) * slots);
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL){
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        size_t length = strlen(entry->d_name) + 1;
+        if(used + length > size) storage = realloc(storage, size *= 2);
+        if(count == slots) offsets = realloc(offsets, sizeof(size_t) * (slots *= 2));
+        memcpy(storage + used, entry->d_name, length);
+        offsets[count ++] = used;
+        used += length;
+    }
+    closedir(dir);
+    dir_listing *listing = malloc(sizeof(dir_listing));
+    listing->dev = st->st_dev;
+    listing->ino = st->st_ino;
+    listing->mtime = st->st_mtim;
+    //a directory changed in the last two seconds may change again without its mtime moving (timestamps are coarse), it is read again next time
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(now.tv_sec - st->st_mtim.tv_sec < 2) listing->mtime.tv_sec = -1;
+    listing->count = count;
+    listing->storage = storage;
+    listing->names = malloc(sizeof(char *) * (count > 0 ? count : 1));
+    for(int i = 0; i < count; i ++) listing->names[i] = storage + offsets[i];
+    free(offsets);
+    qsort(listing->names, count, sizeof(char *), compare_names);
+    return listing;
+}
+
+/*
+ * Returns the sorted listing of a directory, from the cache while the directory is unchanged
+ * The most recently used listing is kept first, and the oldest are dropped past COMPLETE_CACHE_DIRS
+ */
+static dir_listing *listing_get(completer *c, const char *path){
+    struct stat st;
+    if(stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) return NULL;
+    dir_listing *listing = NULL;
+    for(dir_listing **link = &c->listings; *link != NULL; link = &(*link)->next){
+        if((*link)->dev != st.st_dev || (*link)->ino != st.st_ino) continue;
+        listing = *link;
+        *link = listing->next;
+        if(listing->mtime.tv_sec != st.st_mtim.tv_sec || listing->mtime.tv_nsec != st.st_mtim.tv_nsec){
+            listing_free(listing);
+            listing = NULL;
+        }
+        break;
+    }
+    if(listing == NULL && (listing = listing_load(path, &st)) == NULL) return NULL;
+    listing->next = c->listings;
+    c->listings = listing;
+    int kept = 0;
+    for(dir_listing **link = &c->listings; *link != NULL; kept ++){
+        if(kept < COMPLETE_CACHE_DIRS) {link = &(*link)->next; continue;}
+        dir_listing *old = *link;
+        *link = old->next;
+        listing_free(old);
+    }
+    return listing;
+}
+
+/*
+ * Returns the index of the first name that does not sort before the names starting with prefix,
+ * or with after set, the first one that sorts after them
+ */
+static int listing_bound(dir_listing *listing, const char *prefix, int length, int after){
+    int low = 0, high = listing->count;
+    while(low < high){
+        int middle = low + (high - low) / 2;
+        int order = strncmp(listing->names[middle], prefix, length);
+        if(order < 0 || (after && order == 0)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/*
+ * Completes a path from the cached listing of its directory, common receives the longest name all the matches start with
+ * Names starting with '.' only match a prefix starting with '.'.
+ * Everything is found with binary searches on the sorted names, so the cost does not grow with the size of the directory
+ * Returns the length of the directory part of the word
+ */
+static int complete_path(completer *c, const char *word, int length, completion *out, char *common, int *is_dir){
+    const char *slash = memrchr(word, '/', length);
+    int dir_length = slash == NULL ? 0 : slash - word + 1;
+    char path[PATH_MAX];
+    if(dir_length == 0) strcpy(path, ".");
+    else if(word[0] == '~' && dir_length >= 2 && word[1] == '/' && c->home != NULL) snprintf(path, sizeof(path), "%s%.*s", c->home, dir_length - 1, word + 1);
+    else snprintf(path, sizeof(path), "%.*s", dir_length, word);
+    dir_listing *listing = listing_get(c, path);
+    if(listing == NULL) return dir_length;
+    const char *base = word + dir_length;
+    int base_length = length - dir_length;
+    int low = listing_bound(listing, base, base_length, 0), high = listing_bound(listing, base, base_length, 1);
+    //the hidden names sort together, with an empty prefix they are cut out of the range
+    int hidden_low = high, hidden_high = high;
+    if(base_length == 0){
+        hidden_low = listing_bound(listing, ".", 1, 0);
+        hidden_high = listing_bound(listing, ".", 1, 1);
+    }
+    out->count = high - low - (hidden_high - hidden_low);
+    if(out->count == 0) return dir_length;
+    //the names in between share whatever the first and last match share
+    const char *first = listing->names[low < hidden_low ? low : hidden_high];
+    const char *last = listing->names[high > hidden_high ? high - 1 : hidden_low - 1];
+    int shared = 0;
+    while(first[shared] != '\0' && first[shared] == last[shared] && shared < NAME_MAX) shared ++;
+    memcpy(common, first, shared);
+    common[shared] = '\0';
+    if(out->count == 1){
+        struct stat st;
+        char match[PATH_MAX + NAME_MAX + 2];
+        snprintf(match, sizeof(match), "%s/%s", path, first);
+        *is_dir = stat(match, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    else{
+        for(int i = low; i < high && out->listed < COMPLETE_LIST_MAX; i ++){
+            if(i == hidden_low) i = hidden_high;
+            if(i < high) out->names[out->listed ++] = strdup(listing->names[i]);
+        }
+    }
+    return dir_length;
+}
+
+/*
+ * Sets up completion of the commands in dirs (searched in order by the shell) and of builtins, a NULL terminated list,
+ * home is used for "~/" and may be NULL.
+ * Nothing is read until the first completion
+ */
+void completer_init(completer *c, char **dirs, int dir_count, const char **builtins, const char *home){
+    c->dirs = dirs;
+    c->dir_count = dir_count;
+    c->builtins = builtins;
+    c->home = home;
+    c->dir_mtimes = calloc(dir_count, sizeof(struct timespec));
+    c->commands = NULL;
+    c->listings = NULL;
+}
+
+void completer_free(completer *c){
+    trie_free(c->commands);
+    while(c->listings != NULL){
+        dir_listing *next = c->listings->next;
+        listing_free(c->listings);
+        c->listings = next;
+    }
+    free(c->dir_mtimes);
+}
+
+/*
+ * Completes the word before the cursor in line: a command name in command position (the first word, or the first after
+ * '|', ';', "&&", "||", '(' or a keyword such as "then") unless it contains a '/', otherwise a path.
+ * out->insert is the escaped text to insert at the cursor, ending with ' ' (or '/' for a directory) when there is one match
+ * Returns the number of matches
+ */
+int complete_line(completer *c, const char *line, int cursor, completion *out){
+    memset(out, 0, sizeof(completion));
+    int start = 0, command = 1;
+    for(int i = 0; i < cursor; i ++){
+        char ch = line[i];
+        if(ch == '\\') {i ++; continue;}
+        if(ch == ' ' || ch == '\t'){
+            if(i > start){
+                int keyword = 0;
+                for(int k = 0; command_keywords[k] != NULL; k ++){
+                    if((int)strlen(command_keywords[k]) == i - start && strncmp(line + start, command_keywords[k], i - start) == 0) keyword = 1;
+                }
+                //"NAME=value cmd" still has the command to come
+                command = keyword || (command && memchr(line + start, '=', i - start) != NULL);
+            }
+            start = i + 1;
+        }
+        else if(ch == '|' || ch == ';' || ch == '&' || ch == '(' || ch == '`') {command = 1; start = i + 1;}
+        else if(ch == '<' || ch == '>') {command = 0; start = i + 1;}
+    }
+    char word[PATH_MAX];
+    int length = 0;
+    for(int i = start; i < cursor && length < PATH_MAX - 1; i ++){
+        if(line[i] == '\\' && i + 1 < cursor) i ++;
+        word[length ++] = line[i];
+    }
+    word[length] = '\0';
+    if(memchr(word, '$', length) != NULL) return 0;
+    char common[NAME_MAX + 1];
+    int is_dir = 0, skip = 0;
+    if(command && memchr(word, '/', length) == NULL) complete_command(c, word, length, out, common);
+    else skip = complete_path(c, word, length, out, common, &is_dir);
+    if(out->count == 0) return 0;
+    const char *added = common + (length - skip);
+    out->insert = malloc(strlen(added) * 2 + 2);
+    char *p = out->insert;
+    for(; *added != '\0'; added ++){
+        if(strchr(escaped_characters, *added) != NULL) *p ++ = '\\';
+        *p ++ = *added;
+    }
+    if(out->count == 1) *p ++ = is_dir ? '/' : ' ';
+    *p = '\0';
+    return out->count;
+}
+
+void completion_free(completion *out){
+    free(out->insert);
+    for(int i = 0; i < out->listed; i ++) free(out->names[i]);
+    out->listed = 0;
+}
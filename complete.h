@@ -0,0 +1,69 @@
+#ifndef _COMPLETE_H
+#define _COMPLETE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#ifndef COMPLETE_LIST_MAX
+#define COMPLETE_LIST_MAX 100      //matches listed when Tab cannot choose one, the count of the rest is shown
+#endif
+#ifndef COMPLETE_CACHE_DIRS
+#define COMPLETE_CACHE_DIRS 32     //directory listings kept between completions
+#endif
+
+/*
+ * Node of the command name trie, children are sorted by character so a walk lists names in order
+ * count is the number of names below the node, which answers "how many commands start with this prefix" without a walk
+ */
+typedef struct trie_node{
+    char c;
+    unsigned char terminal;
+    unsigned int count;
+    struct trie_node *child;
+    struct trie_node *sibling;
+} trie_node;
+
+/*
+ * Sorted names of one directory (without "." and ".."), valid while the directory keeps the same mtime
+ */
+typedef struct dir_listing{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int count;
+    char **names;
+    char *storage;
+    struct dir_listing *next;
+} dir_listing;
+
+/*
+ * Completion state kept by the shell: the trie of the commands in dirs plus the builtins, rebuilt when one of
+ * the directories changes, and the most recently used directory listings
+ */
+typedef struct{
+    char **dirs;
+    int dir_count;
+    const char **builtins;
+    const char *home;
+    struct timespec *dir_mtimes;
+    trie_node *commands;
+    dir_listing *listings;
+} completer;
+
+/*
+ * Result of a completion: the number of matching names, the escaped text to insert at the cursor,
+ * and when it is not unique, the first matches to list
+ */
+typedef struct{
+    int count;
+    char *insert;
+    char *names[COMPLETE_LIST_MAX];
+    int listed;
+} completion;
+
+void completer_init(completer *c, char **dirs, int dir_count, const char **builtins, const char *home);
+void completer_free(completer *c);
+int complete_line(completer *c, const char *line, int cursor, completion *out);
+void completion_free(completion *out);
+
+#endif
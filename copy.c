@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "copy.h"
+
+#ifndef COPY_CHUNK
+#define COPY_CHUNK (1 << 30)
+#endif
+#ifndef COPY_BUFSIZE
+#define COPY_BUFSIZE (1024 * 1024)
+#endif
+
+/*
+ * Returns 1 if an error only means that this way of copying is not supported for the two descriptors
+ */
+static int unsupported(int error){
+    return error == EINVAL || error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+/*
+ * Copies everything from in to out at their current offsets, without passing the data through user space when possible:
+ * copy_file_range() between regular files, splice() when either side is a pipe, sendfile() from a regular file to anything else.
+ * Each method continues where the previous one stopped if it turns out not to be supported,
+ * the last resort is a read()/write() loop with a large buffer.
+ * Returns 1 on success or 0 with errno set on error
+ */
+int copy_fd(int in, int out){
+    struct stat in_st, out_st;
+    ssize_t n;
+    if(fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1) return 0;
+    if(S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)){
+        while((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0 || (n == -1 && errno == EINTR));
+        if(n == 0) return 1;
+        if(!unsupported(errno)) return 0;
+    }
+    if(S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)){
+        while((n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 || (n == -1 && errno == EINTR));
+        if(n == 0) return 1;
+        if(!unsupported(errno)) return 0;
+    }
+    if(S_ISREG(in_st.st_mode)){
+        while((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0 || (n == -1 && errno == EINTR));
+        if(n == 0) return 1;
+        if(!unsupported(errno)) return 0;
+    }
+    char *buffer = malloc(COPY_BUFSIZE);
+    if(buffer == NULL) return 0;
+    int ok = 1;
+    while(ok && ((n = read(in, buffer, COPY_BUFSIZE)) > 0 || (n == -1 && errno == EINTR))){
+        for(ssize_t written = 0, w; n > 0 && written < n; written += w){
+            w = write(out, buffer + written, n - written);
+            if(w == -1 && errno == EINTR) {w = 0; continue;}
+            if(w <= 0) {ok = 0; break;}
+        }
+    }
+    ok = ok && n == 0;
+    int error = errno;
+    free(buffer);
+    errno = error;
+    return ok;
+}
+
+/*
+ * Writes or reads exactly size bytes, retrying after short transfers and interrupts.
+ * send_all() writes to a socket without raising SIGPIPE if the peer has gone away
+ * Returns 1 on success or 0 on error or end of file
+ */
+int write_all(int fd, const void *data, size_t size){
+    const char *p = data;
+    while(size > 0){
+        ssize_t n = write(fd, p, size);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+int send_all(int sock, const void *data, size_t size){
+    const char *p = data;
+    while(size > 0){
+        ssize_t n = send(sock, p, size, MSG_NOSIGNAL);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+int read_all(int fd, void *data, size_t size){
+    char *p = data;
+    while(size > 0){
+        ssize_t n = read(fd, p, size);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/*
+ * Sends size bytes over a Unix socket with count descriptors attached as SCM_RIGHTS ancillary data
+ * The descriptors go with the first byte, the rest is plain data
+ * Returns 1 on success or 0 on error
+ */
+int send_fds(int sock, const void *data, size_t size, const int *fds, int count){
+    char control[CMSG_SPACE(sizeof(int) * count)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {(void *)data, size};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    ssize_t sent;
+    while((sent = sendmsg(sock, &message, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    return sent > 0 && send_all(sock, (const char *)data + sent, size - sent);
+}
+
+/*
+ * Receives exactly size bytes and count descriptors sent by send_fds(), the descriptors are close-on-exec
+ * Extra descriptors are closed, fds is filled with -1 on failure
+ * Returns 1 on success or 0 on error, end of file or a message without all the descriptors (none are left open)
+ */
+int recv_fds(int sock, void *data, size_t size, int *fds, int count){
+    char control[CMSG_SPACE(sizeof(int) * count)];
+    struct iovec iov = {data, size};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    for(int i = 0; i < count; i ++) fds[i] = -1;
+    ssize_t received;
+    while((received = recvmsg(sock, &message, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    if(received <= 0) return 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        int received_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i = 0; i < received_fds; i ++){
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+            if(i < count) fds[i] = fd;
+            else close(fd);
+        }
+    }
+    if(fds[count - 1] != -1 && !(message.msg_flags & MSG_CTRUNC)
+        && read_all(sock, (char *)data + received, size - received)) return 1;
+    for(int i = 0; i < count; i ++){
+        if(fds[i] != -1) close(fds[i]);
+        fds[i] = -1;
+    }
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef _COPY_H
+#define _COPY_H
+
+#include <stddef.h>
+
+int copy_fd(int in, int out);
+int write_all(int fd, const void *data, size_t size);
+int send_all(int sock, const void *data, size_t size);
+int read_all(int fd, void *data, size_t size);
+int send_fds(int sock, const void *data, size_t size, const int *fds, int count);
+int recv_fds(int sock, void *data, size_t size, int *fds, int count);
+
+#endif
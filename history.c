@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+#ifndef HISTORY_COMPACT_BYTES
+#define HISTORY_COMPACT_BYTES (64 * 1024 * 1024)
+#endif
+#ifndef HISTORY_COMPACT_INTERVAL
+#define HISTORY_COMPACT_INTERVAL 128
+#endif
+
+#ifndef HISTORY_GRAM_BUCKETS
+#define HISTORY_GRAM_BUCKETS 65536  //power of two
+#endif
+
+#define HISTORY_MAGIC "MYSHHST1"
+#define HISTORY_MAGIC_LEN 8
+
+/*
+ * Reads the u32 length stored at the given offset of the mapping
+ */
+static uint32_t read_length(history_log *h, size_t offset){
+    uint32_t length;
+    memcpy(&length, h->map + offset, sizeof(length));
+    return length;
+}
+
+/*
+ * Takes the end offset of a record and moves it to the start of that record
+ * Returns 1 and sets text/length if the record is intact, 0 at the beginning of the file or on a torn record
+ */
+static int prev_record(history_log *h, size_t *pos, const char **text, unsigned int *length){
+    if(*pos < HISTORY_MAGIC_LEN + 8) return 0;
+    uint32_t len = read_length(h, *pos - 4);
+    if((size_t)len + 8 > *pos - HISTORY_MAGIC_LEN) return 0;
+    size_t start = *pos - 8 - len;
+    if(read_length(h, start) != len) return 0;
+    *text = h->map + start + 4;
+    *length = len;
+    *pos = start;
+    return 1;
+}
+
+/*
+ * Takes the start offset of a record and moves it past that record
+ * Returns 1 and sets text/length if the record is intact, 0 at the end of the mapping or on a torn record
+ */
+static int next_record(history_log *h, size_t *pos, const char **text, unsigned int *length){
+    if(*pos + 8 > h->map_size) return 0;
+    uint32_t len = read_length(h, *pos);
+    if(*pos + 8 + (size_t)len > h->map_size) return 0;
+    if(read_length(h, *pos + 4 + len) != len) return 0;
+    *text = h->map + *pos + 4;
+    *length = len;
+    *pos += 8 + len;
+    return 1;
+}
+
+/*
+ * Maps the whole file read-only, replacing any previous mapping
+ * Returns 1 on success or 0 if the file is not a history file
+ */
+static int map_file(history_log *h){
+    struct stat st;
+    if(fstat(h->fd, &st) == -1) return 0;
+    if(h->map != NULL) munmap(h->map, h->map_size);
+    h->map = NULL;
+    h->map_size = 0;
+    h->ino = st.st_ino;
+    if(st.st_size < HISTORY_MAGIC_LEN) return 0;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, h->fd, 0);
+    if(map == MAP_FAILED) return 0;
+    h->map = map;
+    h->map_size = st.st_size;
+    return memcmp(h->map, HISTORY_MAGIC, HISTORY_MAGIC_LEN) == 0;
+}
+
+/*
+ * Opens the file at h->path for appending, writing the magic if the file is new
+ * Returns 1 on success or 0 on failure
+ */
+static int open_file(history_log *h){
+    h->fd = open(h->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(h->fd == -1) return 0;
+    flock(h->fd, LOCK_EX);
+    struct stat st;
+    if(fstat(h->fd, &st) == 0 && st.st_size == 0){
+        if(write(h->fd, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != HISTORY_MAGIC_LEN) {flock(h->fd, LOCK_UN); return 0;}
+    }
+    flock(h->fd, LOCK_UN);
+    return map_file(h);
+}
+
+/*
+ * Drops the open descriptor, mapping, prefix index and substring index
+ */
+static void close_file(history_log *h){
+    if(h->map != NULL) munmap(h->map, h->map_size);
+    if(h->fd != -1) close(h->fd);
+    free(h->index);
+    if(h->grams != NULL){
+        for(unsigned int i = 0; i < HISTORY_GRAM_BUCKETS; i ++) free(h->grams[i].items);
+        free(h->grams);
+    }
+    free(h->records);
+    h->grams = NULL;
+    h->grams_size = 0;
+    h->records = NULL;
+    h->record_count = 0;
+    h->record_capacity = 0;
+    h->map = NULL;
+    h->map_size = 0;
+    h->fd = -1;
+    h->index = NULL;
+    h->index_size = 0;
+    h->index_capacity = 0;
+    h->indexed_size = 0;
+}
+
+/*
+ * Opens (creating if necessary) and maps the history file at the given path
+ * Nothing is parsed here so startup cost does not depend on the number of entries
+ * Returns 1 on success or 0 on failure
+ */
+int history_open(history_log *h, const char *path){
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+    h->path = strdup(path);
+    if(h->path == NULL) return 0;
+    if(!open_file(h)){
+        close_file(h);
+        free(h->path);
+        h->path = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Unmaps and closes the history file
+ */
+void history_close(history_log *h){
+    close_file(h);
+    free(h->path);
+    h->path = NULL;
+}
+
+/*
+ * Picks up records appended by other shells and follows the file if it was replaced by a compaction
+ * Returns 1 if the mapping is usable or 0 otherwise
+ */
+int history_sync(history_log *h){
+    if(h->path == NULL) return 0;
+    struct stat st;
+    if(stat(h->path, &st) == -1 || st.st_ino != h->ino){
+        close_file(h);
+        return open_file(h);
+    }
+    if((size_t)st.st_size != h->map_size) return map_file(h);
+    return h->map != NULL;
+}
+
+/*
+ * Appends a record with a single O_APPEND write so concurrent shells never interleave partial entries
+ * Appenders hold a shared lock that a compaction takes exclusively before swapping the file
+ * Returns 1 on success or 0 on failure
+ */
+int history_append(history_log *h, const char *line, unsigned int length){
+    if(h->path == NULL) return 0;
+    char *record = malloc(length + 8);
+    if(record == NULL) return 0;
+    uint32_t len = length;
+    memcpy(record, &len, 4);
+    memcpy(record + 4, line, length);
+    memcpy(record + 4 + length, &len, 4);
+    int written = 0;
+    for(int attempt = 0; attempt < 2 && !written; attempt ++){
+        if(h->fd == -1 && !open_file(h)) break;
+        flock(h->fd, LOCK_SH);
+        struct stat st;
+        if(stat(h->path, &st) == -1 || st.st_ino != h->ino){
+            //file was compacted underneath us, reopen the replacement and retry
+            flock(h->fd, LOCK_UN);
+            close_file(h);
+            continue;
+        }
+        written = write(h->fd, record, length + 8) == (ssize_t)(length + 8);
+        flock(h->fd, LOCK_UN);
+    }
+    free(record);
+    if(written && ++h->appended % HISTORY_COMPACT_INTERVAL == 0){
+        struct stat st;
+        if(fstat(h->fd, &st) == 0 && st.st_size > HISTORY_COMPACT_BYTES) history_compact(h, HISTORY_KEEP);
+    }
+    return written;
+}
+
+/*
+ * Returns the newest entry and sets its length, or NULL if the history is empty
+ * The returned text is not NUL terminated and stays valid until the next history call
+ */
+const char *history_last(history_log *h, unsigned int *length){
+    if(!history_sync(h)) return NULL;
+    size_t pos = h->map_size;
+    const char *text;
+    if(!prev_record(h, &pos, &text, length)) return NULL;
+    return text;
+}
+
+/*
+ * Orders record offsets by text, then by age so the newest duplicate sorts last
+ */
+static int compare_records(const void *a, const void *b, void *arg){
+    history_log *h = arg;
+    unsigned int oa = *(const unsigned int *)a, ob = *(const unsigned int *)b;
+    uint32_t la = read_length(h, oa), lb = read_length(h, ob);
+    int cmp = memcmp(h->map + oa + 4, h->map + ob + 4, la < lb ? la : lb);
+    if(cmp != 0) return cmp;
+    if(la != lb) return la < lb ? -1 : 1;
+    return oa < ob ? -1 : (oa > ob);
+}
+
+/*
+ * Extends the sorted prefix index with records added since it was last built
+ * New offsets are sorted on their own and merged, so the cost is proportional to what was appended
+ * Returns 1 on success or 0 on failure
+ */
+static int update_index(history_log *h){
+    size_t pos = h->indexed_size ? h->indexed_size : HISTORY_MAGIC_LEN;
+    unsigned int added = 0, capacity = 16;
+    unsigned int *fresh = malloc(sizeof(unsigned int) * capacity);
+    if(fresh == NULL) return 0;
+    const char *text;
+    unsigned int length;
+    size_t record = pos;
+    while(next_record(h, &pos, &text, &length)){
+        if(added == capacity){
+            unsigned int *new = realloc(fresh, sizeof(unsigned int) * capacity * 2);
+            if(!new) {free(fresh); return 0;}
+            fresh = new;
+            capacity *= 2;
+        }
+        fresh[added ++] = record;
+        record = pos;
+    }
+    h->indexed_size = record;
+    if(added == 0) {free(fresh); return 1;}
+    qsort_r(fresh, added, sizeof(unsigned int), compare_records, h);
+    unsigned int total = h->index_size + added;
+    unsigned int *merged = malloc(sizeof(unsigned int) * total);
+    if(merged == NULL) {free(fresh); h->indexed_size = 0; return 0;}
+    unsigned int i = 0, j = 0, k = 0;
+    while(i < h->index_size && j < added){
+        if(compare_records(&h->index[i], &fresh[j], h) <= 0) merged[k ++] = h->index[i ++];
+        else merged[k ++] = fresh[j ++];
+    }
+    while(i < h->index_size) merged[k ++] = h->index[i ++];
+    while(j < added) merged[k ++] = fresh[j ++];
+    free(h->index);
+    free(fresh);
+    h->index = merged;
+    h->index_size = total;
+    h->index_capacity = total;
+    return 1;
+}
+
+/*
+ * Compares the start of a record against a prefix, ignoring the rest of the record
+ */
+static int compare_prefix(history_log *h, unsigned int offset, const char *prefix, size_t prefix_len){
+    uint32_t len = read_length(h, offset);
+    int cmp = memcmp(h->map + offset + 4, prefix, len < prefix_len ? len : prefix_len);
+    if(cmp != 0) return cmp;
+    return len < prefix_len ? -1 : 0;
+}
+
+/*
+ * Binary searches the prefix index for the newest entry starting with prefix
+ * Returns the entry and sets its length, or NULL if no entry matches
+ */
+const char *history_find_prefix(history_log *h, const char *prefix, unsigned int *length){
+    if(!history_sync(h) || !update_index(h)) return NULL;
+    size_t prefix_len = strlen(prefix);
+    unsigned int low = 0, high = h->index_size;
+    while(low < high){
+        unsigned int mid = low + (high - low) / 2;
+        if(compare_prefix(h, h->index[mid], prefix, prefix_len) < 0) low = mid + 1;
+        else high = mid;
+    }
+    unsigned int newest = 0;
+    int found = 0;
+    for(unsigned int i = low; i < h->index_size && compare_prefix(h, h->index[i], prefix, prefix_len) == 0; i ++){
+        if(!found || h->index[i] > newest) newest = h->index[i];
+        found = 1;
+    }
+    if(!found) return NULL;
+    *length = read_length(h, newest);
+    return h->map + newest + 4;
+}
+
+/*
+ * Returns the substring index bucket of the trigram at text
+ */
+static unsigned int gram_bucket(const char *text){
+    uint32_t gram = (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+    return (gram * 2654435761u) >> 16 & (HISTORY_GRAM_BUCKETS - 1);
+}
+
+/*
+ * Extends the substring index with records added since it was last built: the records in file order, and for every
+ * trigram bucket the numbers of the records with a trigram in it. Built on the first substring search only
+ * Returns 1 on success or 0 on failure
+ */
+static int update_grams(history_log *h){
+    if(h->grams == NULL){
+        h->grams = calloc(HISTORY_GRAM_BUCKETS, sizeof(history_postings));
+        if(h->grams == NULL) return 0;
+        h->grams_size = HISTORY_MAGIC_LEN;
+    }
+    size_t pos = h->grams_size;
+    const char *text;
+    unsigned int length;
+    while(next_record(h, &pos, &text, &length)){
+        if(h->record_count == h->record_capacity){
+            unsigned int capacity = h->record_capacity ? h->record_capacity * 2 : 1024;
+            size_t *records = realloc(h->records, sizeof(size_t) * capacity);
+            if(records == NULL) return 0;
+            h->records = records;
+            h->record_capacity = capacity;
+        }
+        unsigned int number = h->record_count;
+        for(unsigned int i = 0; i + 3 <= length; i ++){
+            history_postings *list = &h->grams[gram_bucket(text + i)];
+            //each record is listed once per bucket, and in order since records are added in file order
+            if(list->count > 0 && list->items[list->count - 1] == number) continue;
+            if(list->count == list->capacity){
+                unsigned int capacity = list->capacity ? list->capacity * 2 : 4;
+                unsigned int *items = realloc(list->items, sizeof(unsigned int) * capacity);
+                if(items == NULL) return 0;
+                list->items = items;
+                list->capacity = capacity;
+            }
+            list->items[list->count ++] = number;
+        }
+        h->records[h->record_count ++] = h->grams_size;
+        h->grams_size = pos;
+    }
+    return 1;
+}
+
+/*
+ * Checks if a record matches a history_list() pattern
+ */
+static int matches(const char *text, unsigned int length, const char *pattern, int mode){
+    if(mode == HISTORY_PREFIX) return strlen(pattern) <= length && memcmp(text, pattern, strlen(pattern)) == 0;
+    if(mode == HISTORY_SUBSTRING) return memmem(text, length, pattern, strlen(pattern)) != NULL;
+    return 1;
+}
+
+/*
+ * Lists the entries containing pattern (at least 3 bytes) with the substring index: only the records in the smallest bucket
+ * of the pattern's trigrams can match, and those are checked with memmem()
+ * Returns the number of entries reported
+ */
+static unsigned int list_substring(history_log *h, const char *pattern, unsigned int limit, void (*fn)(unsigned int, const char *, unsigned int)){
+    size_t pattern_len = strlen(pattern);
+    history_postings *candidates = &h->grams[gram_bucket(pattern)];
+    for(size_t i = 1; i + 3 <= pattern_len; i ++){
+        history_postings *list = &h->grams[gram_bucket(pattern + i)];
+        if(list->count < candidates->count) candidates = list;
+    }
+    unsigned int total = 0, seen = 0, reported = 0;
+    for(int pass = limit ? 0 : 1; pass < 2; pass ++){
+        for(unsigned int i = 0; i < candidates->count; i ++){
+            size_t offset = h->records[candidates->items[i]];
+            if(memmem(h->map + offset + 4, read_length(h, offset), pattern, pattern_len) == NULL) continue;
+            if(pass == 0) {total ++; continue;}
+            if(limit && total - seen ++ > limit) continue;
+            fn(candidates->items[i] + 1, h->map + offset + 4, read_length(h, offset));
+            reported ++;
+        }
+    }
+    return reported;
+}
+
+/*
+ * Calls fn with the entry number and text of every entry matching pattern (HISTORY_PREFIX or HISTORY_SUBSTRING),
+ * or of every entry with HISTORY_ALL. A non-zero limit only reports the newest limit matches
+ * Substring searches for patterns of 3 bytes or more use the trigram index (see update_grams()), the rest scan every entry
+ * Returns the number of entries reported
+ */
+unsigned int history_list(history_log *h, const char *pattern, int mode, unsigned int limit, void (*fn)(unsigned int, const char *, unsigned int)){
+    if(!history_sync(h)) return 0;
+    if(mode == HISTORY_SUBSTRING && strlen(pattern) >= 3 && update_grams(h)) return list_substring(h, pattern, limit, fn);
+    const char *text;
+    unsigned int length, total = 0, number = 0, reported = 0;
+    size_t pos = HISTORY_MAGIC_LEN;
+    if(limit){
+        while(next_record(h, &pos, &text, &length)) if(matches(text, length, pattern, mode)) total ++;
+        pos = HISTORY_MAGIC_LEN;
+    }
+    unsigned int seen = 0;
+    while(next_record(h, &pos, &text, &length)){
+        number ++;
+        if(!matches(text, length, pattern, mode)) continue;
+        if(limit && total - seen ++ > limit) continue;
+        fn(number, text, length);
+        reported ++;
+    }
+    return reported;
+}
+
+/*
+ * Hashes record text for duplicate detection during compaction
+ */
+static uint64_t hash_text(const char *text, unsigned int length){
+    uint64_t hash = 1469598103934665603ULL;
+    for(unsigned int i = 0; i < length; i ++){
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Rewrites the history file keeping the newest keep entries, dropping older duplicates of newer entries
+ * The replacement is written beside the file and renamed over it while holding the exclusive lock,
+ * other shells notice the new inode on their next sync or append
+ * Returns 1 if the file was compacted or 0 if it was busy or an error occurred
+ */
+int history_compact(history_log *h, unsigned int keep){
+    if(!history_sync(h)) return 0;
+    if(flock(h->fd, LOCK_EX | LOCK_NB) == -1) return 0;
+    if(!history_sync(h)) {flock(h->fd, LOCK_UN); return 0;}
+    unsigned int capacity = 1024, kept = 0, slots = 2048;
+    size_t *offsets = malloc(sizeof(size_t) * capacity);
+    size_t *seen = calloc(slots, sizeof(size_t));
+    int ok = offsets != NULL && seen != NULL;
+    size_t pos = h->map_size;
+    const char *text;
+    unsigned int length;
+    while(ok && kept < keep && prev_record(h, &pos, &text, &length)){
+        //open addressing set of kept record offsets (+1 so 0 marks an empty slot)
+        uint64_t hash = hash_text(text, length);
+        size_t slot = hash & (slots - 1);
+        int duplicate = 0;
+        while(seen[slot]){
+            size_t other = seen[slot] - 1;
+            if(read_length(h, other) == length && memcmp(h->map + other + 4, text, length) == 0) {duplicate = 1; break;}
+            slot = (slot + 1) & (slots - 1);
+        }
+        if(duplicate) continue;
+        seen[slot] = pos + 1;
+        if(kept == capacity){
+            size_t *new = realloc(offsets, sizeof(size_t) * capacity * 2);
+            if(!new) {ok = 0; break;}
+            offsets = new;
+            capacity *= 2;
+        }
+        offsets[kept ++] = pos;
+        if(kept * 2 > slots){
+            size_t *grown = calloc(slots * 2, sizeof(size_t));
+            if(!grown) {ok = 0; break;}
+            for(size_t i = 0; i < slots; i ++){
+                if(!seen[i]) continue;
+                size_t other = seen[i] - 1;
+                size_t s = hash_text(h->map + other + 4, read_length(h, other)) & (slots * 2 - 1);
+                while(grown[s]) s = (s + 1) & (slots * 2 - 1);
+                grown[s] = seen[i];
+            }
+            free(seen);
+            seen = grown;
+            slots *= 2;
+        }
+    }
+    free(seen);
+    char *tmp_path = NULL;
+    int tmp = -1;
+    if(ok){
+        tmp_path = malloc(strlen(h->path) + 32);
+        if(tmp_path != NULL){
+            sprintf(tmp_path, "%s.%d.tmp", h->path, (int)getpid());
+            tmp = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        }
+        ok = tmp != -1;
+    }
+    if(ok) ok = write(tmp, HISTORY_MAGIC, HISTORY_MAGIC_LEN) == HISTORY_MAGIC_LEN;
+    for(unsigned int i = kept; ok && i > 0; i --){
+        size_t size = read_length(h, offsets[i - 1]) + 8;
+        ok = write(tmp, h->map + offsets[i - 1], size) == (ssize_t)size;
+    }
+    if(tmp != -1){
+        if(ok) ok = fsync(tmp) == 0;
+        close(tmp);
+        if(ok) ok = rename(tmp_path, h->path) == 0;
+        if(!ok) unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(offsets);
+    flock(h->fd, LOCK_UN);
+    if(ok) history_sync(h);
+    return ok;
+}
@@ -0,0 +1,56 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef HISTORY_KEEP
+#define HISTORY_KEEP 1000000
+#endif
+
+/*
+ * Record numbers of the entries containing a trigram that hashes to one bucket of the substring index, oldest first
+ */
+typedef struct{
+    unsigned int *items;
+    unsigned int count;
+    unsigned int capacity;
+} history_postings;
+
+/*
+ * Append-only command history file
+ * Layout: 8 byte magic followed by records of [u32 length][text][u32 length]
+ * The trailing length lets the newest records be found by walking backwards from the end of the mapping
+ */
+typedef struct{
+    int fd;
+    char *path;
+    char *map;
+    size_t map_size;
+    ino_t ino;
+    unsigned int *index;
+    unsigned int index_size;
+    unsigned int index_capacity;
+    size_t indexed_size;
+    size_t *records;
+    unsigned int record_count;
+    unsigned int record_capacity;
+    history_postings *grams;
+    size_t grams_size;
+    unsigned int appended;
+} history_log;
+
+int history_open(history_log *h, const char *path);
+void history_close(history_log *h);
+int history_sync(history_log *h);
+int history_append(history_log *h, const char *line, unsigned int length);
+const char *history_last(history_log *h, unsigned int *length);
+const char *history_find_prefix(history_log *h, const char *prefix, unsigned int *length);
+unsigned int history_list(history_log *h, const char *pattern, int mode, unsigned int limit, void (*fn)(unsigned int, const char *, unsigned int));
+int history_compact(history_log *h, unsigned int keep);
+
+#define HISTORY_ALL 0
+#define HISTORY_PREFIX 1
+#define HISTORY_SUBSTRING 2
+
+#endif
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include "lineedit.h"
+
+/*
+ * Writes all of text to the terminal, on standard error like the prompt
+ */
+static void term_write(const char *text, size_t length){
+    while(length > 0){
+        ssize_t n = write(STDERR_FILENO, text, length);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) return;
+        text += n;
+        length -= n;
+    }
+}
+
+/*
+ * Returns the next keystroke byte, reading more from the terminal when none is left, or -1 at end of input
+ */
+static int next_byte(line_editor *ed){
+    if(ed->input_used == ed->input_length){
+        ssize_t n;
+        while((n = read(ed->fd, ed->input, sizeof(ed->input))) == -1 && errno == EINTR);
+        if(n <= 0) return -1;
+        ed->input_used = 0;
+        ed->input_length = n;
+    }
+    return (unsigned char)ed->input[ed->input_used ++];
+}
+
+/*
+ * Turns off echo, line buffering and the signal keys, the editor handles them itself
+ * Returns 1 on success or 0 if the terminal cannot be changed
+ */
+static int raw_mode(line_editor *ed){
+    if(tcgetattr(ed->fd, &ed->saved) == -1) return 0;
+    struct termios raw = ed->saved;
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL | INLCR);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    return tcsetattr(ed->fd, TCSANOW, &raw) == 0;
+}
+
+static void cooked_mode(line_editor *ed){
+    tcsetattr(ed->fd, TCSANOW, &ed->saved);
+}
+
+/*
+ * Redraws the prompt and the line, and puts the terminal cursor back on the editor's cursor
+ */
+static void redraw(line_editor *ed, const char *prompt){
+    size_t prompt_length = strlen(prompt);
+    char *out = malloc(prompt_length + ed->length + 32);
+    size_t used = 0;
+    out[used ++] = '\r';
+    memcpy(out + used, prompt, prompt_length);
+    used += prompt_length;
+    memcpy(out + used, ed->line, ed->length);
+    used += ed->length;
+    used += sprintf(out + used, "\x1b[K");
+    if(ed->cursor < ed->length) used += sprintf(out + used, "\x1b[%dD", ed->length - ed->cursor);
+    term_write(out, used);
+    free(out);
+}
+
+/*
+ * Inserts text at the cursor
+ */
+static void insert(line_editor *ed, const char *text, int length){
+    if(ed->length + length + 1 > ed->capacity){
+        while(ed->length + length + 1 > ed->capacity) ed->capacity *= 2;
+        ed->line = realloc(ed->line, ed->capacity);
+    }
+    memmove(ed->line + ed->cursor + length, ed->line + ed->cursor, ed->length - ed->cursor);
+    memcpy(ed->line + ed->cursor, text, length);
+    ed->length += length;
+    ed->cursor += length;
+}
+
+/*
+ * Removes count bytes starting at from
+ */
+static void erase(line_editor *ed, int from, int count){
+    memmove(ed->line + from, ed->line + from + count, ed->length - from - count);
+    ed->length -= count;
+    if(ed->cursor > from + count) ed->cursor -= count;
+    else if(ed->cursor > from) ed->cursor = from;
+}
+
+/*
+ * Completes the word before the cursor (see complete_line()), inserting what every match shares,
+ * or listing the matches below the line when that adds nothing
+ */
+static void tab(line_editor *ed, const char *prompt){
+    completion out;
+    ed->line[ed->length] = '\0';
+    if(complete_line(ed->completer, ed->line, ed->cursor, &out) == 0) {term_write("\a", 1); return;}
+    if(out.insert[0] != '\0'){
+        int at_end = ed->cursor == ed->length;
+        insert(ed, out.insert, strlen(out.insert));
+        if(at_end) term_write(out.insert, strlen(out.insert));
+        else redraw(ed, prompt);
+    }
+    else{
+        term_write("\r\n", 2);
+        for(int i = 0; i < out.listed; i ++){
+            term_write(out.names[i], strlen(out.names[i]));
+            term_write(i + 1 < out.listed ? "  " : "\r\n", 2);
+        }
+        if(out.count > out.listed){
+            char more[64];
+            term_write(more, snprintf(more, sizeof(more), "... and %d more\r\n", out.count - out.listed));
+        }
+        redraw(ed, prompt);
+    }
+    completion_free(&out);
+}
+
+/*
+ * Handles an escape sequence: the arrow keys, Home, End and Delete
+ */
+static void escape(line_editor *ed, const char *prompt){
+    if(next_byte(ed) != '[') return;
+    int key = next_byte(ed);
+    if(key >= '0' && key <= '9'){
+        if(next_byte(ed) != '~') return;
+        if(key == '3' && ed->cursor < ed->length) erase(ed, ed->cursor, 1);
+        else if(key == '1' || key == '7') ed->cursor = 0;
+        else if(key == '4' || key == '8') ed->cursor = ed->length;
+    }
+    else if(key == 'C' && ed->cursor < ed->length) ed->cursor ++;
+    else if(key == 'D' && ed->cursor > 0) ed->cursor --;
+    else if(key == 'H') ed->cursor = 0;
+    else if(key == 'F') ed->cursor = ed->length;
+    else return;
+    redraw(ed, prompt);
+}
+
+/*
+ * Edits one line in raw mode until Enter, the line keeps its '\n'
+ * Returns 1 with the line in ed->line, or 0 at end of input (Ctrl-D on an empty line)
+ */
+static int edit(line_editor *ed, const char *prompt){
+    ed->length = 0;
+    ed->cursor = 0;
+    int c;
+    while((c = next_byte(ed)) != -1){
+        if(c == '\r' || c == '\n'){
+            ed->cursor = ed->length;
+            insert(ed, "\n", 1);
+            term_write("\r\n", 2);
+            return 1;
+        }
+        else if(c == '\t') tab(ed, prompt);
+        else if(c == CTRL('D')){
+            if(ed->length == 0) {term_write("\r\n", 2); return 0;}
+            if(ed->cursor < ed->length) {erase(ed, ed->cursor, 1); redraw(ed, prompt);}
+        }
+        else if(c == CTRL('C')){
+            term_write("^C\r\n", 4);
+            ed->length = 0;
+            ed->cursor = 0;
+            redraw(ed, prompt);
+        }
+        else if(c == 0x7f || c == CTRL('H')){
+            if(ed->cursor > 0) {erase(ed, ed->cursor - 1, 1); redraw(ed, prompt);}
+        }
+        else if(c == CTRL('A')) {ed->cursor = 0; redraw(ed, prompt);}
+        else if(c == CTRL('E')) {ed->cursor = ed->length; redraw(ed, prompt);}
+        else if(c == CTRL('B') && ed->cursor > 0) {ed->cursor --; redraw(ed, prompt);}
+        else if(c == CTRL('F') && ed->cursor < ed->length) {ed->cursor ++; redraw(ed, prompt);}
+        else if(c == CTRL('U')) {erase(ed, 0, ed->cursor); redraw(ed, prompt);}
+        else if(c == CTRL('K')) {ed->length = ed->cursor; redraw(ed, prompt);}
+        else if(c == CTRL('L')) {term_write("\x1b[H\x1b[2J", 7); redraw(ed, prompt);}
+        else if(c == 0x1b) escape(ed, prompt);
+        else if(c >= 0x20){
+            char ch = c;
+            int at_end = ed->cursor == ed->length;
+            insert(ed, &ch, 1);
+            //typing at the end of the line, the common case, only echoes the character
+            if(at_end) term_write(&ch, 1);
+            else redraw(ed, prompt);
+        }
+    }
+    return ed->length > 0 ? (insert(ed, "\n", 1), 1) : 0;
+}
+
+/*
+ * Sets up editing of the lines read from fd, a terminal, with c for Tab completion
+ * When fd is not a terminal line_read() is a plain read()
+ */
+void line_init(line_editor *ed, int fd, completer *c){
+    memset(ed, 0, sizeof(line_editor));
+    ed->fd = fd;
+    ed->tty = isatty(fd);
+    ed->completer = c;
+    ed->capacity = 256;
+    ed->line = malloc(ed->capacity);
+}
+
+/*
+ * Reads input like read(): when nothing is left of the previous line, prompt has already been printed and
+ * a new line is edited in raw mode, then the line is copied out at most size bytes at a time.
+ * prompt is printed again when the line is redrawn.
+ * The terminal is back in its normal mode whenever this returns, so commands run with the settings they expect
+ * Returns the number of bytes copied, 0 at end of input or -1 on error
+ */
+ssize_t line_read(line_editor *ed, const char *prompt, char *buffer, size_t size){
+    if(!ed->tty) return read(ed->fd, buffer, size);
+    if(ed->pending == 0){
+        if(!raw_mode(ed)) return read(ed->fd, buffer, size);
+        int edited = edit(ed, prompt);
+        cooked_mode(ed);
+        if(!edited) return 0;
+        ed->pending = ed->length;
+    }
+    size_t n = (size_t)ed->pending < size ? (size_t)ed->pending : size;
+    memcpy(buffer, ed->line + ed->length - ed->pending, n);
+    ed->pending -= n;
+    return n;
+}
+
+void line_free(line_editor *ed){
+    free(ed->line);
+}
@@ -0,0 +1,31 @@
+#ifndef _LINEEDIT_H
+#define _LINEEDIT_H
+
+#include <termios.h>
+#include <sys/types.h>
+#include "complete.h"
+
+/*
+ * Line editor for a terminal, the edited line is handed to the caller in pieces like read() would (see line_read())
+ * Keystrokes read ahead of the end of a line (pasted text) are kept in input for the next line
+ */
+typedef struct{
+    int fd;
+    int tty;
+    struct termios saved;
+    completer *completer;
+    char *line;
+    int length;
+    int capacity;
+    int cursor;
+    int pending;        //bytes of the finished line not handed out yet, they end at length
+    char input[256];
+    int input_used;
+    int input_length;
+} line_editor;
+
+void line_init(line_editor *ed, int fd, completer *c);
+ssize_t line_read(line_editor *ed, const char *prompt, char *buffer, size_t size);
+void line_free(line_editor *ed);
+
+#endif
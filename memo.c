@@ -0,0 +1,288 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "memo.h"
+#include "copy.h"
+
+#define MEMO_MAGIC "MYSHMM01"
+#ifndef MEMO_MAX
+#define MEMO_MAX (256ULL * 1024 * 1024)    //size of the cache when memo_open() is given none
+#endif
+
+/*
+ * Entry of the cache directory, for eviction
+ */
+typedef struct{
+    char name[64];
+    unsigned long long size;
+    struct timespec used;
+} memo_file;
+
+/*
+ * FNV-1a hash of data, starting from basis, two bases give the 128 bit entry name
+ */
+static uint64_t hash_bytes(const char *data, size_t size, uint64_t basis){
+    uint64_t hash = basis;
+    for(size_t i = 0; i < size; i ++){
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Appends size bytes to the key, growing it as needed
+ */
+static void key_add(memo_entry *entry, size_t *capacity, const char *data, size_t size){
+    if(entry->key_length + size > *capacity){
+        while(entry->key_length + size > *capacity) *capacity *= 2;
+        entry->key = realloc(entry->key, *capacity);
+    }
+    memcpy(entry->key + entry->key_length, data, size);
+    entry->key_length += size;
+}
+
+/*
+ * Adds the identity of a file to the key: path, size, mtime, inode and device, nothing if it is not a regular file
+ */
+static void key_add_file(memo_entry *entry, size_t *capacity, const char *path){
+    struct stat st;
+    char identity[128];
+    if(stat(path, &st) == -1 || !S_ISREG(st.st_mode)) return;
+    int length = snprintf(identity, sizeof(identity), "%lld %lld.%09ld %llu %llu", (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+        st.st_mtim.tv_nsec, (unsigned long long)st.st_ino, (unsigned long long)st.st_dev);
+    key_add(entry, capacity, "file", 5);
+    key_add(entry, capacity, path, strlen(path) + 1);
+    key_add(entry, capacity, identity, length + 1);
+}
+
+/*
+ * Copies the file at from into a new file at to (truncated if it exists)
+ * Returns 1 on success or 0 with errno set
+ */
+static int copy_path(const char *from, const char *to){
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if(in == -1) return 0;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    int ok = out != -1 && copy_fd(in, out);
+    int error = errno;
+    close(in);
+    if(out != -1) close(out);
+    errno = error;
+    return ok;
+}
+
+/*
+ * Removes an entry directory with the files in it
+ */
+static void remove_entry(const char *path){
+    DIR *dir = opendir(path);
+    if(dir == NULL) return;
+    struct dirent *de;
+    while((de = readdir(dir)) != NULL){
+        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) unlinkat(dirfd(dir), de->d_name, 0);
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+static int compare_used(const void *a, const void *b){
+    const memo_file *x = a, *y = b;
+    if(x->used.tv_sec != y->used.tv_sec) return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : x->used.tv_nsec > y->used.tv_nsec;
+}
+
+/*
+ * Removes the least recently used entries (oldest directory mtime, refreshed by every hit) until the cache
+ * is not larger than limit bytes
+ * Returns the number of removed entries
+ */
+static unsigned long evict(const char *path, unsigned long long limit){
+    unsigned long long total = 0;
+    DIR *dir = opendir(path);
+    if(dir == NULL) return 0;
+    int count = 0, capacity = 64;
+    memo_file *files = malloc(sizeof(memo_file) * capacity);
+    struct dirent *de;
+    while(files != NULL && (de = readdir(dir)) != NULL){
+        struct stat st;
+        //entries still being written end in .tmp
+        if(strlen(de->d_name) != 32 || fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(st.st_mode)) continue;
+        if(count == capacity) files = realloc(files, sizeof(memo_file) * (capacity *= 2));
+        if(files == NULL) break;
+        memo_file *file = &files[count ++];
+        strcpy(file->name, de->d_name);
+        file->used = st.st_mtim;
+        file->size = 0;
+        int entry = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *contents = entry == -1 ? NULL : fdopendir(entry);
+        struct dirent *blob;
+        while(contents != NULL && (blob = readdir(contents)) != NULL){
+            if(blob->d_name[0] != '.' && fstatat(entry, blob->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) file->size += st.st_size;
+        }
+        if(contents != NULL) closedir(contents);
+        else if(entry != -1) close(entry);
+        total += file->size;
+    }
+    closedir(dir);
+    unsigned long evicted = 0;
+    if(files != NULL && total > limit){
+        qsort(files, count, sizeof(memo_file), compare_used);
+        for(int i = 0; i < count && total > limit; i ++){
+            char entry_path[PATH_MAX];
+            snprintf(entry_path, sizeof(entry_path), "%s/%s", path, files[i].name);
+            remove_entry(entry_path);
+            total -= files[i].size;
+            evicted ++;
+        }
+    }
+    free(files);
+    return evicted;
+}
+
+/*
+ * Computes the key of a command: the working directory, the identity of the program (command_path, NULL for a builtin),
+ * the words with their redirections, and the size, mtime, inode and device of every word naming a regular file, except the
+ * files after '>' which are outputs. The entry is named by a 128 bit hash of the key and lives in cache_home/mysh/memo
+ * (or home/.cache/mysh/memo when cache_home is NULL or empty), the caller passes the shell's $XDG_CACHE_HOME and $HOME.
+ * The key itself is stored in the entry, so a hash collision is a miss, not a wrong result.
+ * After a store the cache is cut down to max_size bytes, MEMO_MAX if it is 0
+ * Returns 1 on success or 0 if there is no cache location
+ */
+int memo_open(memo_entry *entry, const char *cache_home, const char *home, unsigned long long max_size, char **words, int count,
+              const char *command_path){
+    char dir[PATH_MAX], cwd[PATH_MAX];
+    memset(entry, 0, sizeof(*entry));
+    entry->out = -1;
+    entry->max_size = max_size != 0 ? max_size : MEMO_MAX;
+    if(cache_home != NULL && cache_home[0] != '\0') snprintf(dir, PATH_MAX, "%s", cache_home);
+    else if(home != NULL) snprintf(dir, PATH_MAX, "%s/.cache", home);
+    else return 0;
+    mkdir(dir, 0700);
+    strncat(dir, "/mysh", PATH_MAX - strlen(dir) - 1);
+    mkdir(dir, 0700);
+    strncat(dir, "/memo", PATH_MAX - strlen(dir) - 1);
+    if(mkdir(dir, 0700) == -1 && access(dir, W_OK) == -1) return 0;
+    if(getcwd(cwd, PATH_MAX) == NULL) return 0;
+    size_t capacity = 1024;
+    entry->dir = strdup(dir);
+    entry->key = malloc(capacity);
+    key_add(entry, &capacity, cwd, strlen(cwd) + 1);
+    if(command_path != NULL) key_add_file(entry, &capacity, command_path);
+    key_add(entry, &capacity, "words", 6);
+    for(int i = 0; i < count; i ++) key_add(entry, &capacity, words[i], strlen(words[i]) + 1);
+    for(int i = 1; i < count; i ++){
+        if(strcmp(words[i], ">") == 0) i ++;
+        else if(strcmp(words[i], "<") != 0 && strcmp(words[i], "|") != 0) key_add_file(entry, &capacity, words[i]);
+    }
+    snprintf(entry->name, sizeof(entry->name), "%016llx%016llx",
+        (unsigned long long)hash_bytes(entry->key, entry->key_length, 1469598103934665603ULL),
+        (unsigned long long)hash_bytes(entry->key, entry->key_length, 0x6c62272e07bb0142ULL));
+    return 1;
+}
+
+/*
+ * Looks the command up, and on a hit writes the cached output files and copies the cached standard output to out
+ * The entry's mtime is refreshed, it is the least recently used order for eviction.
+ * Returns 1 on a hit with *status set to the cached exit status, or 0 on a miss
+ */
+int memo_replay(memo_entry *entry, int *status, int out, FILE *err){
+    char path[PATH_MAX], target[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/meta", entry->dir, entry->name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return 0;
+    struct stat st;
+    char *meta = NULL;
+    int ok = fstat(fd, &st) == 0 && (meta = malloc(st.st_size + 1)) != NULL && read(fd, meta, st.st_size) == st.st_size;
+    close(fd);
+    int outputs = 0, header = 0;
+    size_t key_length = 0;
+    if(ok){
+        meta[st.st_size] = '\0';
+        ok = sscanf(meta, MEMO_MAGIC " %d %d %zu\n%n", status, &outputs, &key_length, &header) == 3 && header > 0
+            && header + key_length <= (size_t)st.st_size && key_length == entry->key_length
+            && memcmp(meta + header, entry->key, key_length) == 0;
+    }
+    //the output files are named after the key, each one followed by a 0 byte
+    char *name = ok ? meta + header + key_length : NULL;
+    for(int i = 0; ok && i < outputs; i ++){
+        if(name >= meta + st.st_size) {ok = 0; break;}
+        snprintf(path, sizeof(path), "%s/%s/%d", entry->dir, entry->name, i);
+        snprintf(target, sizeof(target), "%s", name);
+        if(!copy_path(path, target)) {fprintf(err, "%s: %s\n", target, strerror(errno)); *status = 1;}
+        name += strlen(name) + 1;
+    }
+    if(ok){
+        snprintf(path, sizeof(path), "%s/%s/stdout", entry->dir, entry->name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd == -1 || !copy_fd(fd, out)) fprintf(err, "memo: %s\n", strerror(errno));
+        if(fd != -1) close(fd);
+        snprintf(path, sizeof(path), "%s/%s", entry->dir, entry->name);
+        utimensat(AT_FDCWD, path, NULL, 0);
+    }
+    free(meta);
+    return ok;
+}
+
+/*
+ * Starts a new entry for a miss, entry->out is the file the command's standard output goes to
+ * Returns 1 on success or 0 with an error printed to err
+ */
+int memo_begin(memo_entry *entry, FILE *err){
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.%d.tmp", entry->dir, entry->name, (int)gettid());
+    remove_entry(path);
+    if(mkdir(path, 0700) == -1) {fprintf(err, "memo: %s\n", strerror(errno)); return 0;}
+    entry->tmp = strdup(path);
+    snprintf(path, sizeof(path), "%s/stdout", entry->tmp);
+    entry->out = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(entry->out == -1) {fprintf(err, "memo: %s\n", strerror(errno)); return 0;}
+    return 1;
+}
+
+/*
+ * Completes the entry started by memo_begin() with the exit status and copies of the output files, then makes it visible
+ * by renaming it and evicts old entries. *evicted is increased by the number of removed entries
+ * Returns 1 on success or 0 if the entry could not be stored, which leaves the cache unchanged
+ */
+int memo_commit(memo_entry *entry, int status, char **outputs, int output_count, unsigned long *evicted){
+    char path[PATH_MAX], header[64];
+    int ok = 1;
+    for(int i = 0; ok && i < output_count; i ++){
+        snprintf(path, sizeof(path), "%s/%d", entry->tmp, i);
+        ok = copy_path(outputs[i], path);
+    }
+    snprintf(path, sizeof(path), "%s/meta", entry->tmp);
+    int fd = ok ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    int length = snprintf(header, sizeof(header), MEMO_MAGIC " %d %d %zu\n", status, output_count, entry->key_length);
+    ok = fd != -1 && write_all(fd, header, length) && write_all(fd, entry->key, entry->key_length);
+    for(int i = 0; ok && i < output_count; i ++) ok = write_all(fd, outputs[i], strlen(outputs[i]) + 1);
+    if(fd != -1) close(fd);
+    snprintf(path, sizeof(path), "%s/%s", entry->dir, entry->name);
+    //an entry stored meanwhile by another shell is replaced
+    if(ok) remove_entry(path);
+    ok = ok && rename(entry->tmp, path) == 0;
+    if(!ok) remove_entry(entry->tmp);
+    free(entry->tmp);
+    entry->tmp = NULL;
+    if(ok) *evicted += evict(entry->dir, entry->max_size);
+    return ok;
+}
+
+/*
+ * Frees the entry, removing the temporary entry of a miss that was not committed
+ */
+void memo_close(memo_entry *entry){
+    if(entry->out != -1) close(entry->out);
+    if(entry->tmp != NULL) {remove_entry(entry->tmp); free(entry->tmp);}
+    free(entry->dir);
+    free(entry->key);
+}
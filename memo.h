@@ -0,0 +1,28 @@
+#ifndef _MEMO_H
+#define _MEMO_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * A command looked up in the result cache: its key (see memo_open()), the name of its entry,
+ * and while a miss runs, the temporary entry and the file its standard output goes to
+ */
+typedef struct{
+    char *dir;
+    char *key;
+    size_t key_length;
+    char name[33];
+    char *tmp;
+    int out;
+    unsigned long long max_size;
+} memo_entry;
+
+int memo_open(memo_entry *entry, const char *cache_home, const char *home, unsigned long long max_size, char **words, int count,
+              const char *command_path);
+int memo_replay(memo_entry *entry, int *status, int out, FILE *err);
+int memo_begin(memo_entry *entry, FILE *err);
+int memo_commit(memo_entry *entry, int status, char **outputs, int output_count, unsigned long *evicted);
+void memo_close(memo_entry *entry);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,8 +7,36 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <pwd.h>
+#include <errno.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include <linux/limits.h>
 #include "arraylist.h"
+#include "history.h"
+#include "vartable.h"
+#include "script.h"
+#include "ast.h"
+#include "session.h"
+#include "zygote.h"
+#include "relay.h"
+#include "copy.h"
+#include "statbatch.h"
+#include "rlimits.h"
+#include "pin.h"
+#include "trace.h"
+#include "memo.h"
+#include "watch.h"
+#include "complete.h"
+#include "lineedit.h"
+#include "mysh.h"
 #ifndef BUFSIZE
 #define BUFSIZE 512
 #endif
@@ -17,6 +46,27 @@
 #ifndef DEBUG
 #define DEBUG 0
 #endif
+#ifndef CAPTURE_CHUNK
+#define CAPTURE_CHUNK (64 * 1024)
+#endif
+#ifndef CAPTURE_PIPE_SIZE
+#define CAPTURE_PIPE_SIZE (1024 * 1024)
+#endif
+#ifndef SPAWN_SAMPLES
+#define SPAWN_SAMPLES 4096
+#endif
+#ifndef WATCH_DEBOUNCE_MS
+#define WATCH_DEBOUNCE_MS 100 //quiet time after a change before watch runs the command again
+#endif
+#ifndef PARALLEL_WINDOW
+#define PARALLEL_WINDOW 4 //with parallel -k, items started ahead of the oldest unprinted one, in multiples of -j
+#endif
+#ifndef TIMEOUT_GRACE_MS
+#define TIMEOUT_GRACE_MS 2000 //time a command gets between SIGTERM and SIGKILL once timeout expired, -k to change it
+#endif
+#ifndef TIMEOUT_STATUS
+#define TIMEOUT_STATUS 124 //$? of a command stopped by timeout, like coreutils timeout
+#endif
 
 /*
  * Personal implementation of a command line shell
@@ -24,6 +74,29 @@
  */
 
 void interpret(char *cmdline, array_list *al, array_list *wildcard_al);  
+int compileScript(compiled_script *script, char *cmdline, int size);
+void runScript(compiled_script *script, array_list *al, array_list *wildcard_al);
+void runNode(compiled_script *script, ast_node *node, array_list *al, array_list *wildcard_al);
+void runCommand(compiled_script *script, uint32_t first, uint32_t last, array_list *al, array_list *wildcard_al);
+void pushWord(compiled_script *script, uint32_t index, array_list *al, array_list *wildcard_al);
+int leaveLoop();
+void loopCommand(array_list *al);
+int commandComplete(char *cmdline, int size);
+void runScriptFile(char *path, int use_cache);
+int runShell(char *script_path, int use_cache);
+int runServer(char *socket_path, int use_cache);
+void runSession(session_request *request, int use_cache);
+int runClient(char *socket_path, char *script_path);
+int waitStatus(int wstatus);
+void printError(const char *what);
+void childStdio(int input, int output);
+void redirectContext(int fd, int target);
+mysh_ctx* newContext(int in, int out, int err);
+void freeContext(mysh_ctx *context);
+int enterContext(mysh_ctx *context, mysh_ctx **saved);
+char* expandHomeDir(char *cmdstring, int *literal);
+const char* tildeDirectory(char *prefix, int *length, int assignment);
+char* userHome(char *name, int length);
 void process_Custom_Executable(array_list *al);
 void processInput(array_list *list);
 int processWildcard(array_list *wildcard_al, char *wildcard_token);
@@ -31,9 +104,14 @@ void pwd();
 void changeDir(char *path);
 void cleanUp(char *cmdline);
 void IOLoop();
+ssize_t readInput();
 int searchCommands(array_list *al);
 void execute(char** args, int numArgs);
-void callExec(char** args);
+pid_t spawnCommand(char** args, int input, int output);
+int isBuiltinStage(char **args, int argc);
+pid_t spawnBuiltin(char **args, int input, int output);
+int catCommand(char **args, int input, int output);
+char* resolveCommand(char *name);
 char* getFileType(char *file_name);
 char* getFileEndPattern(char *file_name, int patternLength);
 char* getFileEnd(char *file_name, int patternLength);
@@ -42,38 +120,412 @@ char* getFileName(char *file_name);
 int isExecutable(char *file_name);
 void handleWildcardMatch(int absolutePath, char *file_name, char *path, array_list *wildcard_al);
 int containsWildcard(char *cmdstring);
-int containsHomeDirShortcut(char *cmdstring);
+int containsHomeDirShortcut(char *src, int size);
 char* specialHandlingMemCopy(char* src, int size);
+int openHistory();
+int expandHistory();
+void recordHistory();
+void historyCommand(array_list *al);
+void printHistoryEntry(unsigned int number, const char *text, unsigned int length);
+int containsExpansion(char *src, int size);
+char* expandToken(char *cmdstring, int *length);
+void pushToken(array_list *al, array_list *wildcard_al, char *token);
+int findSubstitutionEnd(char *src, int index);
+char* captureOutput(char *command, int length, int *size);
+void statsCommand();
+void recordSpawn(unsigned long long elapsed);
+int compareNs(const void *a, const void *b);
+unsigned long long monotonicNs();
+int isName(char *name, int length);
+int isAssignment(char *token);
+int assignVariables(array_list *al);
+void exportCommand(array_list *al);
+void unsetCommand(array_list *al);
+void ulimitCommand(array_list *al);
+void limitCommand(array_list *al);
+void pinCommand(array_list *al);
+void execCommand(array_list *al);
+void memoCommand(array_list *al);
+void watchCommand(array_list *al);
+pid_t watchRun(array_list *command, sigset_t *mask);
+void parallelCommand(array_list *al);
+char* parallelItem(FILE *source, char **items, int count, int *next);
+int pidfdOpen(pid_t pid);
+char** parallelArguments(char **command, int argc, char *path, char *item);
+int childSettings();
+void timeoutCommand(array_list *al);
+pid_t timeoutRun(array_list *command, sigset_t *mask);
+int parseDuration(char *text, long long *ns);
+void startJobControl();
+void childJob();
+void joinJob(pid_t pid);
+
+extern char **environ;
+
+typedef struct{
+    unsigned long captures;
+    unsigned long long capture_bytes;
+    unsigned long long capture_ns;
+    unsigned long long capture_max_ns;
+    unsigned long spawns;
+    unsigned long zygote_spawns;
+    unsigned long memo_hits;
+    unsigned long memo_misses;
+    unsigned long memo_evictions;
+    unsigned long long spawn_ns[SPAWN_SAMPLES]; //latency of the most recent spawns
+} shell_stats;
+
+/*
+ * One command of a pipeline, pointing into the argument array given to execute()
+ */
+typedef struct{
+    char **argv;
+    int argc;
+    char *input;
+    char **outputs;
+    int output_count;
+} pipeline_stage;
+void execInPlace(pipeline_stage *stage);
+
+/*
+ * One item of the parallel builtin, from the time it is started until it is reported
+ */
+typedef struct{
+    pid_t pid;          //0 for a free slot, -1 once the child has been reaped
+    unsigned long index;
+    char *item;
+    int output;         //with -k, the memfd holding the output of the child
+    int pidfd;          //to wait for the child, -1 where pidfds are not supported
+    int status;
+    unsigned long long started_ns; //for --trace
+} parallel_job;
+pid_t waitJobs(parallel_job *slots, long window, int *wstatus);
+//home directories of the users named in ~user, looked up once, NULL dir for unknown users
+typedef struct user_home{
+    char *name;
+    char *dir;
+    struct user_home *next;
+} user_home;
+
+/*
+ * State of one shell. The standalone shell runs one, a program linking libmysh.a as many as it likes (see mysh.h).
+ * The functions below work on the context of the calling thread (ctx), set by the mysh_* entry points,
+ * so contexts running on different threads never share anything but the process
+ */
+struct mysh_ctx{
+    //input and tokenizer
+    array_list al, wildcard_al;
+    int fin, bytes, start, end, cmdline_size, count, special_handling, special_handling_index;
+    char *cmdline;
+    char *cmdstring;
+    char buffer[BUFSIZE];
+    int subst_depth, in_backtick;
+    //status, variables and control flow
+    int exit_status;
+    int last_status;
+    char *prompt;
+    char *home_path;
+    var_table vars;
+    int loop_depth, loop_levels, loop_continue;
+    history_log hist;
+    int history_enabled;
+    user_home *user_homes;
+    char tilde_cwd[PATH_MAX];
+    //children
+    shell_stats stats;
+    zygote zyg;
+    int use_zygote;
+    int validate_paths;
+    limit_set child_limits;     //resource limits installed in every child, from ulimit and the limit prefix
+    pin_settings child_pin;     //cpus and scheduling settings installed in every child, from the pin prefix
+    int exec_last;              //the last command of the script this process runs may replace it: batch scripts, -c and substitutions
+    int exec_in_place;          //set while the command being run may replace the shell (see execInPlace())
+    int job_control;            //interactive shell on a terminal, foreground pipelines get a process group and the terminal
+    pid_t job_pgid;             //process group of the pipeline being started, 0 before its first child, -1 outside execute()
+    //interactive input
+    completer tab_completer;
+    line_editor editor;
+    //embedding
+    int owns_process;           //the standalone shell or a forked copy of it, which may exit or replace itself
+    int exited;                 //an embedded context ran exit, the rest of the input is skipped
+    int fds[3];                 //standard input, output and error of the context and its commands
+    FILE *out;                  //where builtins print, on fds[1] and fds[2]
+    FILE *err;
+    int cwd;                    //working directory of an embedded context, -1 for the process's own
+};
+static __thread mysh_ctx *ctx;
 
-array_list al, wildcard_al;
-int fin, bytes, start = 0, end = 0, validCommand = 1, cmdline_size = 0, count = 0, exit_status = 1, special_handling = 0, special_handling_index = 512;
-int saved_stdin, saved_stdout;
-char *cmdline;
-char *cmdstring;
-char *home_path;
-char buffer[BUFSIZE];
-char *prompt = "mysh> ";
 char *vanilla_paths[6] = {"/usr/local/sbin/", "/usr/local/bin/", "/usr/sbin/", "/usr/bin/", "/sbin/", "/bin/"};
+//names Tab completes besides the programs in vanilla_paths
+const char *builtin_names[] = {"cd", "pwd", "exit", "exec", "export", "unset", "history", "stats", "ulimit", "limit", "pin", "memo", "watch",
+                               "timeout", "parallel", "cat", "break", "continue", "if", "then", "elif", "else", "fi", "while", "for", "do", "done", NULL};
 
+#ifndef MYSH_LIBRARY
 int main(int argc, char **argv){
-    home_path = getenv("HOME");
+    ctx = newContext(STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    ctx->owns_process = 1;
+    char *script_path = NULL, *server_path = NULL, *client_path = NULL, *command = NULL;
+    int use_cache = 1;
+    for(int i = 1; i < argc; i ++) {
+        if(strcmp(argv[i], "--no-cache") == 0) use_cache = 0;
+        else if(strcmp(argv[i], "--server") == 0 && i + 1 < argc) server_path = argv[++ i];
+        else if(strcmp(argv[i], "--client") == 0 && i + 1 < argc) client_path = argv[++ i];
+        else if(strcmp(argv[i], "--zygote") == 0) ctx->use_zygote = 1;
+        else if(strcmp(argv[i], "--no-validate") == 0) ctx->validate_paths = 0;
+        else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {if(!trace_open(argv[++ i])) return EXIT_FAILURE;}
+        else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) command = argv[++ i];
+        else script_path = argv[i];
+    }
+    if(server_path != NULL) return runServer(server_path, use_cache) ? EXIT_SUCCESS : EXIT_FAILURE;
+    if(client_path != NULL) return runClient(client_path, script_path);
+    //a batch script or -c ends like a session, with the status of its last command, which may replace the shell
+    ctx->exec_last = script_path != NULL || command != NULL;
+    if(command != NULL){
+        ctx->fin = -1;
+        ctx->cmdline_size = strlen(command);
+        interpret(command, &ctx->al, &ctx->wildcard_al);
+        fflush(stdout);
+        return ctx->last_status;
+    }
+    if(!runShell(script_path, use_cache)) exit(EXIT_FAILURE);
+    return ctx->exec_last ? ctx->last_status : EXIT_SUCCESS;
+}
+#endif
+
+/*
+ * Allocates a context with the state of a new shell: variables from the environment, $? of 0 and the "mysh> " prompt
+ * in, out and err become its standard descriptors, out and err are also the streams of the builtins
+ * (stdout and stderr for the process's own)
+ */
+mysh_ctx* newContext(int in, int out, int err){
+    mysh_ctx *context = calloc(1, sizeof(mysh_ctx));
+    context->fds[0] = in;
+    context->fds[1] = out;
+    context->fds[2] = err;
+    context->out = out == STDOUT_FILENO ? stdout : fdopen(out, "w");
+    context->err = err == STDERR_FILENO ? stderr : fdopen(err, "w");
+    if(context->err != stderr) setvbuf(context->err, NULL, _IONBF, 0);
+    context->cwd = -1;
+    context->exit_status = 1;
+    context->special_handling_index = 512;
+    context->prompt = "mysh> ";
+    context->zyg.sock = -1;
+    context->zyg.pid = -1;
+    context->validate_paths = 1;
+    context->job_pgid = -1;
+    vars_init(&context->vars, ALSIZE);
+    vars_import(&context->vars, environ);
+    context->home_path = vars_get(&context->vars, "HOME");
+    pin_init(&context->child_pin);
+    return context;
+}
+
+/*
+ * Runs a batch script, or reads commands from standard input when script_path is NULL
+ * Returns 1 when the input has been run or 0 if the script cannot be opened
+ */
+int runShell(char *script_path, int use_cache){
+    if(ctx->use_zygote && !zygote_start(&ctx->zyg)) printError("zygote");
     //detects if input is from stdinput or textfile 
-    if (argc > 1) {
-        fin = open(argv[1], O_RDONLY);
-        if (fin == -1) {
-            perror(argv[1]);
-            exit(EXIT_FAILURE);
+    if (script_path != NULL) {
+        ctx->fin = open(script_path, O_RDONLY);
+        if (ctx->fin == -1) {
+            printError(script_path);
+            return 0;
         }
+        runScriptFile(script_path, use_cache);
+        return 1;
     } else {
-        fin = 0;
+        ctx->fin = 0;
     }
-    if(!fin){
-        printf("Welcome to Sean & Robbie's shell!\n");
-        fputs(prompt, stderr);
+    if(!ctx->fin){
+        //after the zygote has started, so it keeps the signal actions the shell started with
+        startJobControl();
+        openHistory();
+        completer_init(&ctx->tab_completer, vanilla_paths, 6, builtin_names, ctx->home_path);
+        line_init(&ctx->editor, 0, &ctx->tab_completer);
+        fprintf(ctx->out, "Welcome to Sean & Robbie's shell!\n");
+        fputs(ctx->prompt, ctx->err);
     }
-    memset(buffer, 0, BUFSIZE);
+    memset(ctx->buffer, 0, BUFSIZE);
     IOLoop();
-    return EXIT_SUCCESS;
+    return 1;
+}
+
+/*
+ * Runs the shell as a server (mysh --server path) so clients do not pay for starting a new shell for every batch of commands
+ * Each client gets a session running in a forked copy of the server, with the client's stdin/stdout/stderr, working directory
+ * and environment, so sessions never see each other's directory or variables. The session reads the client's request itself,
+ * so a client that connects and sends nothing never stalls the server or other clients.
+ * Finished sessions are reaped through a signalfd and their exit status is sent back to the client.
+ * SIGINT, SIGTERM or SIGHUP stop the server and remove its socket.
+ * Returns 1 after a clean shutdown or 0 if the server could not start
+ */
+int runServer(char *socket_path, int use_cache){
+    int sock = session_listen(socket_path);
+    if(sock == -1) {perror(socket_path); return 0;}
+    sigset_t mask, saved_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, &saved_mask);
+    int signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(signals == -1) {perror("signalfd"); close(sock); unlink(socket_path); return 0;}
+    //pids of running sessions with the connection to report their status on
+    int sessions = 0, capacity = 16;
+    pid_t *pids = malloc(sizeof(pid_t) * capacity);
+    int *connections = malloc(sizeof(int) * capacity);
+    struct pollfd fds[2] = {{sock, POLLIN, 0}, {signals, POLLIN, 0}};
+    int running = 1;
+    while(running){
+        if(poll(fds, 2, -1) == -1) {
+            if(errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if(fds[1].revents & POLLIN){
+            struct signalfd_siginfo info;
+            while(read(signals, &info, sizeof(info)) == sizeof(info)){
+                if(info.ssi_signo != SIGCHLD) running = 0;
+            }
+            int wstatus;
+            pid_t pid;
+            while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0){
+                for(int i = 0; i < sessions; i ++){
+                    if(pids[i] != pid) continue;
+                    session_send_status(connections[i], waitStatus(wstatus));
+                    close(connections[i]);
+                    sessions --;
+                    pids[i] = pids[sessions];
+                    connections[i] = connections[sessions];
+                    break;
+                }
+            }
+        }
+        if(running && (fds[0].revents & POLLIN)){
+            int connection = session_accept(sock);
+            if(connection == -1) continue;
+            //the request is read by the session, a client that is slow to send it only holds up itself
+            pid_t pid = fork();
+            if(pid == 0){
+                sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+                close(sock);
+                close(signals);
+                for(int i = 0; i < sessions; i ++) close(connections[i]);
+                free(pids);
+                free(connections);
+                session_request request;
+                int received = session_receive(connection, &request);
+                close(connection);
+                if(!received) _exit(126);
+                runSession(&request, use_cache);
+            }
+            if(pid == -1){
+                perror("fork");
+                session_send_status(connection, 126);
+                close(connection);
+                continue;
+            }
+            if(sessions == capacity){
+                capacity *= 2;
+                pids = realloc(pids, sizeof(pid_t) * capacity);
+                connections = realloc(connections, sizeof(int) * capacity);
+            }
+            pids[sessions] = pid;
+            connections[sessions ++] = connection;
+            if(DEBUG) fprintf(stderr, "session %d started\n", (int)pid);
+        }
+    }
+    //sessions still running keep going, their clients see the connection close
+    for(int i = 0; i < sessions; i ++) close(connections[i]);
+    free(pids);
+    free(connections);
+    close(signals);
+    close(sock);
+    unlink(socket_path);
+    sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    return 1;
+}
+
+/*
+ * Runs in the forked child of the server for one client session and never returns
+ * Installs the client's descriptors as stdin/stdout/stderr, moves to its working directory and replaces the variables with its environment
+ */
+void runSession(session_request *request, int use_cache){
+    //move the received descriptors above 2 first so none of them is overwritten before it is installed
+    int fds[SESSION_FDS];
+    for(int i = 0; i < SESSION_FDS; i ++) fds[i] = fcntl(request->fds[i], F_DUPFD_CLOEXEC, SESSION_FDS);
+    for(int i = 0; i < SESSION_FDS; i ++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if(chdir(request->cwd) == -1) {perror(request->cwd); _exit(1);}
+    environ = request->envp;
+    vars_destroy(&ctx->vars);
+    vars_init(&ctx->vars, ALSIZE);
+    vars_import(&ctx->vars, environ);
+    ctx->home_path = vars_get(&ctx->vars, "HOME");
+    int ran = runShell(request->script[0] != '\0' ? request->script : NULL, use_cache);
+    fflush(stdout);
+    _exit(ran ? ctx->last_status : 127);
+}
+
+/*
+ * Thin client for a shell server (mysh --client path [script])
+ * Passes its stdin/stdout/stderr, working directory and environment to a new session and waits for it to finish
+ * Returns the session's exit status
+ */
+int runClient(char *socket_path, char *script_path){
+    char cwd[PATH_MAX];
+    int status;
+    int sock = session_connect(socket_path);
+    if(sock == -1) {perror(socket_path); return EXIT_FAILURE;}
+    if(getcwd(cwd, PATH_MAX) == NULL || !session_send(sock, cwd, script_path != NULL ? script_path : "", environ)) {
+        perror("error: cannot start session");
+        close(sock);
+        return EXIT_FAILURE;
+    }
+    if(!session_wait_status(sock, &status)) {
+        fprintf(stderr, "error: connection to server closed\n");
+        status = EXIT_FAILURE;
+    }
+    close(sock);
+    return status;
+}
+
+/*
+ * Takes a status from waitpid()
+ * Returns the exit code of the process, or 128 plus the signal number if it was killed, as used for $?
+ */
+int waitStatus(int wstatus){
+    if(WIFEXITED(wstatus)) return WEXITSTATUS(wstatus);
+    if(WIFSIGNALED(wstatus)) return 128 + WTERMSIG(wstatus);
+    return 1;
+}
+
+/*
+ * Prints what and the error in errno like perror(), on the error output of the context
+ */
+void printError(const char *what){
+    fprintf(ctx->err, "%s: %s\n", what, strerror(errno));
+}
+
+/*
+ * Makes target, one of the standard descriptors of the context, a copy of fd, those of an embedded context stay close-on-exec
+ */
+void redirectContext(int fd, int target){
+    if(fd != target) dup3(fd, target, target > STDERR_FILENO ? O_CLOEXEC : 0);
+}
+
+/*
+ * In a child, installs input and output as its stdin and stdout and the error output of the context as its stderr
+ */
+void childStdio(int input, int output){
+    if(input != STDIN_FILENO) dup2(input, STDIN_FILENO);
+    if(output != STDOUT_FILENO) dup2(output, STDOUT_FILENO);
+    if(ctx->fds[2] != STDERR_FILENO) dup2(ctx->fds[2], STDERR_FILENO);
 }
 
 /*
@@ -89,20 +541,77 @@ void processInput(array_list *al) {
     if(DEBUG) {
         for(int i=0; i< get_length(al); i++) {
             if(strcmp("exit", al->data[i]) == 0) exit(EXIT_SUCCESS);
-            fprintf(stderr, "|%s| ", al->data[i]);
+            fprintf(ctx->err, "|%s| ", al->data[i]);
         }
         return;
     }
+    if(isAssignment(al->data[0]) && assignVariables(al)) {
+        return;
+    }
     if(strcmp(al->data[0], "exit") == 0) {
+        //an embedded context only stops running its input, the program is not the shell's to end
+        if(!ctx->owns_process) {ctx->exited = 1; return;}
         exit(EXIT_SUCCESS);
     }
+    else if(strcmp(al->data[0], "export") == 0) {
+        exportCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "unset") == 0) {
+        unsetCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "stats") == 0) {
+        statsCommand();
+        return;
+    }
+    else if(strcmp(al->data[0], "ulimit") == 0) {
+        ulimitCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "limit") == 0) {
+        limitCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "pin") == 0) {
+        pinCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "exec") == 0) {
+        execCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "memo") == 0) {
+        memoCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "watch") == 0) {
+        watchCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "timeout") == 0) {
+        timeoutCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "parallel") == 0) {
+        parallelCommand(al);
+        return;
+    }
+    else if(strcmp(al->data[0], "break") == 0 || strcmp(al->data[0], "continue") == 0) {
+        loopCommand(al);
+        return;
+    }
     else if(strcmp(al->data[0], "pwd") == 0) {
         if(get_length(al) == 1) {pwd(); return;}
-        else {fprintf(stderr, "error: too many arguments\n"); exit_status = 0; return;}
+        else {fprintf(ctx->err, "error: too many arguments\n"); ctx->exit_status = 0; return;}
+    }
+    else if(strcmp(al->data[0], "history") == 0) {
+        historyCommand(al);
+        return;
     }
     else if(strcmp(al->data[0], "cd") == 0) {
-        if(get_length(al) > 2) {fprintf(stderr, "error: too many arguments\n"); exit_status = 0; return;}
-        else if(get_length(al) < 2 || strcmp("", al->data[1]) == 0) {changeDir(home_path); return;}
+        if(get_length(al) > 2) {fprintf(ctx->err, "error: too many arguments\n"); ctx->exit_status = 0; return;}
+        else if(get_length(al) < 2 || strcmp("", al->data[1]) == 0) {changeDir(ctx->home_path); return;}
         else if(get_length(al) == 2) {
             changeDir(al->data[1]);
             return;
@@ -114,10 +623,10 @@ void processInput(array_list *al) {
         }
     }
     if(searchCommands(al)) return;
-    fprintf(stderr, "error: undefined command: "); 
-    for(int i=0; i<get_length(al); i++) {fprintf(stderr, "%s ", al->data[i]);} 
-    fprintf(stderr, "\n");
-    exit_status = 0;
+    fprintf(ctx->err, "error: undefined command: "); 
+    for(int i=0; i<get_length(al); i++) {fprintf(ctx->err, "%s ", al->data[i]);} 
+    fprintf(ctx->err, "\n");
+    ctx->exit_status = 0;
     return;
 }
 
@@ -126,16 +635,35 @@ void processInput(array_list *al) {
  */
 void pwd() {
     char path[PATH_MAX];
-    fprintf(stderr, "%s\n", getcwd(path, PATH_MAX));
+    fprintf(ctx->err, "%s\n", getcwd(path, PATH_MAX));
 }
 
 /*
  * Takes in a string that is the desired directory, and changes the working directory if path is a valid path
+ * "-" goes back to the previous directory and prints it. PWD and OLDPWD are kept up to date for ~+ and ~-
  */
 void changeDir(char *path) {
+    char old[PATH_MAX], cwd[PATH_MAX];
+    int print = strcmp(path, "-") == 0;
+    if(print && (path = vars_get(&ctx->vars, "OLDPWD")) == NULL) {
+        fprintf(ctx->err, "error: cd: OLDPWD not set\n");
+        ctx->exit_status = 0;
+        return;
+    }
+    int known = getcwd(old, PATH_MAX) != NULL;
     if(chdir(path) == -1) {
-        printf("No such file or directory\n");
-        exit_status = 0;
+        fprintf(ctx->out, "No such file or directory\n");
+        ctx->exit_status = 0;
+        return;
+    }
+    if(known) vars_set(&ctx->vars, "OLDPWD", old, 0);
+    if(ctx->cwd != -1){
+        close(ctx->cwd);
+        ctx->cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    if(getcwd(cwd, PATH_MAX) != NULL) {
+        vars_set(&ctx->vars, "PWD", cwd, 0);
+        if(print) fprintf(ctx->out, "%s\n", cwd);
     }
     return;
 }
@@ -147,110 +675,511 @@ void changeDir(char *path) {
  * Calls the function interpret() when the command line is fully parsed and ready to be tokenized
  */
 void IOLoop(){
-    while(((bytes = read(fin, buffer, BUFSIZE)) > 0)){
-        //if (DEBUG) fprintf(stderr, "read %d bytes\n", bytes);
-        if(count == 0){
-            cmdline_size = bytes;
-            cmdline = malloc(sizeof(char) * cmdline_size);
-            memcpy(cmdline, buffer, cmdline_size);
-            count ++;
+    while(((ctx->bytes = readInput()) > 0)){
+        //if (DEBUG) fprintf(ctx->err, "read %d bytes\n", bytes);
+        if(ctx->count == 0){
+            ctx->cmdline_size = ctx->bytes;
+            ctx->cmdline = malloc(sizeof(char) * ctx->cmdline_size);
+            memcpy(ctx->cmdline, ctx->buffer, ctx->cmdline_size);
+            ctx->count ++;
         }
         else{
-            int temp = cmdline_size;
-            cmdline_size += bytes;
-            cmdline = realloc(cmdline, cmdline_size);
-            memcpy(cmdline + temp, buffer, bytes);
-            count ++;
+            int temp = ctx->cmdline_size;
+            ctx->cmdline_size += ctx->bytes;
+            ctx->cmdline = realloc(ctx->cmdline, ctx->cmdline_size);
+            memcpy(ctx->cmdline + temp, ctx->buffer, ctx->bytes);
+            ctx->count ++;
         }
-        if(bytes < BUFSIZE){
-            interpret(cmdline, &al, &wildcard_al);
-            cleanUp(cmdline);
-        }
-        else if(bytes == BUFSIZE && buffer[BUFSIZE - 1] == '\n'){
-            interpret(cmdline, &al, &wildcard_al);
-            cleanUp(cmdline);
+        if(ctx->bytes < BUFSIZE || ctx->buffer[BUFSIZE - 1] == '\n'){
+            //keep reading lines until compound commands and substitutions are closed
+            if(!commandComplete(ctx->cmdline, ctx->cmdline_size)){
+                fputs("> ", ctx->err);
+                continue;
+            }
+            if(ctx->fin == 0 && !expandHistory()){
+                cleanUp(ctx->cmdline);
+                fputs(ctx->prompt, ctx->err);
+                continue;
+            }
+            if(ctx->fin == 0) recordHistory();
+            interpret(ctx->cmdline, &ctx->al, &ctx->wildcard_al);
+            cleanUp(ctx->cmdline);
+            if(!ctx->fin) fputs(ctx->prompt, ctx->err);
         }
     }
 }
 
+/*
+ * Reads the next piece of input into buffer, through the line editor (see lineedit.c) when standard input is a terminal,
+ * which gives Tab completion and redraws the line with the current prompt
+ * Returns the number of bytes read, 0 at end of input
+ */
+ssize_t readInput(){
+    if(ctx->fin != 0) return read(ctx->fin, ctx->buffer, BUFSIZE);
+    return line_read(&ctx->editor, ctx->count > 0 ? "> " : ctx->prompt, ctx->buffer, BUFSIZE);
+}
+
 /*
  * Input tokenizer
- * Iterates through buffer array which contains user input, characters of interest include spaces, newlines, pipes, redirects.
- * If any token containing a path contains the home directory shortcut "~", the "~" will be replaced with the user's home directory.
- * If any token is a wildcard (contains a "*"), wildcard expansion is performed and the wildcard arguments are added to the arraylist,
- * replacing the original token. If no matches were found during wildcard expansion, the token will be passed unchanged.
- * A token is pushed into an arraylist containing all previous tokens.
- * If a newline character is detected, processInput() is called to execute the command.
+ * Compiles the command line into words (see compileScript()) and runs them (see runScript())
  */
 void interpret(char *cmdline, array_list *al, array_list *wildcard_al){
-    init(al, ALSIZE);
-    for(int i = 0; i < cmdline_size; i ++){
-        if(((cmdline[i] == ' ' || cmdline[i] == '\n' || cmdline[i] == '|' || cmdline[i] == '<' || cmdline[i] == '>') && !special_handling) || (special_handling_index >= start && cmdline[i] == '\n')){
-            end = i;
-            if(special_handling_index < start || special_handling_index == 512) {
-                cmdstring = malloc(sizeof(char) * ((end - start) + 1));
-                memcpy(cmdstring, cmdline + start, end - start);
-                cmdstring[end - start] = '\0';
+    unsigned long long started = trace_enabled ? monotonicNs() : 0;
+    compiled_script script;
+    script_init(&script);
+    if(!compileScript(&script, cmdline, ctx->cmdline_size)){
+        fprintf(ctx->err, "error: unterminated command substitution\n");
+        ctx->exit_status = 0;
+    }
+    if(trace_enabled) {
+        //the first line of the input names the span
+        char line[81];
+        int length = 0;
+        while(length < 80 && length < ctx->cmdline_size && cmdline[length] != '\n') {line[length] = cmdline[length]; length ++;}
+        line[length] = '\0';
+        unsigned long long compiled = monotonicNs();
+        trace_span("compileScript", 0, started, compiled, line);
+        trace_begin("interpret", 0, started, line);
+        runScript(&script, al, wildcard_al);
+        trace_end(monotonicNs());
+    }
+    else runScript(&script, al, wildcard_al);
+    script_free(&script);
+    return;
+}
+
+/*
+ * Iterates through buffer array which contains user input, characters of interest include spaces, newlines, pipes, redirects.
+ * When a character of interest is reached, the input is copied into a temporary string using memcpy in the case of no escape characters
+ * and specialHandlingMemCopy() if there is a '\' detected.
+ * Each token is added to the compiled script with flags saying which runtime expansions it needs (home directory shortcut,
+ * variables/command substitution, wildcards), operators (including "&&" and "||") are added as their own words
+ * and a newline or ';' ends the command.
+ * Nothing is expanded or executed here, so the result can be cached and run again.
+ * Returns 1 on success or 0 if a command substitution is left open at the end of the input
+ */
+int compileScript(compiled_script *script, char *cmdline, int size){
+    ctx->start = 0;
+    for(int i = 0; i <= size; i ++){
+        //the end of the input ends the last command even without a trailing newline
+        char c = i == size ? '\n' : cmdline[i];
+        if(i == size && ctx->start == size) break;
+        int and_or = (c == '&' || c == '|') && i + 1 < size && cmdline[i+1] == c && !ctx->special_handling;
+        if(!ctx->subst_depth && !ctx->in_backtick && (((c == ' ' || c == '\n' || c == ';' || c == '|' || c == '<' || c == '>' || and_or) && !ctx->special_handling) || (ctx->special_handling_index >= ctx->start && c == '\n'))){
+            ctx->end = i;
+            if(ctx->special_handling_index < ctx->start || ctx->special_handling_index == 512) {
+                ctx->cmdstring = malloc(sizeof(char) * ((ctx->end - ctx->start) + 1));
+                memcpy(ctx->cmdstring, cmdline + ctx->start, ctx->end - ctx->start);
+                ctx->cmdstring[ctx->end - ctx->start] = '\0';
             } else {
-                cmdstring = specialHandlingMemCopy(cmdline + start, end - start);
+                ctx->cmdstring = specialHandlingMemCopy(cmdline + ctx->start, ctx->end - ctx->start);
             }
-            if(strcmp(cmdstring, "") != 0){
-                if(containsHomeDirShortcut(cmdstring)){
-                    char *path = malloc((strlen(home_path) + 1) * sizeof(char));
-                    path[strlen(home_path)] = '\0';
-                    strcpy(path, home_path);
-                    char *temp = malloc(sizeof(char));
-                    int current_size = 1;
-                    for(int j = 1; cmdstring[j] != '\0'; j ++){
-                        temp[j - 1] = cmdstring[j];
-                        temp = realloc(temp, ++current_size);
-                    }
-                    temp[current_size - 1] = '\0';
-                    path = realloc(path, (strlen(home_path) + 1 + strlen(temp)));
-                    strcat(path, temp);
-                    free(temp);
-                    free(cmdstring);
-                    cmdstring = path;
-                }
-                if(containsWildcard(cmdstring)){
-                    if(processWildcard(wildcard_al, cmdstring)){
-                        for(int j = 0; j < get_length(wildcard_al); j ++){
-                            push(al, wildcard_al->data[j]);
-                        }
-                        destroy(wildcard_al);
-                    }
-                    else{
-                        destroy(wildcard_al);
-                        push(al, cmdstring);
-                    }
-                }
-                else{
-                    push(al, cmdstring);
+            if(strcmp(ctx->cmdstring, "") != 0){
+                int flags = 0;
+                if(containsHomeDirShortcut(cmdline + ctx->start, ctx->end - ctx->start)) flags |= WORD_TILDE;
+                if(containsExpansion(cmdline + ctx->start, ctx->end - ctx->start)) flags |= WORD_EXPAND;
+                if(containsWildcard(ctx->cmdstring)) flags |= WORD_GLOB;
+                //words with expansions keep their escapes, so what was escaped is not expanded (see expandHomeDir() and expandToken())
+                if(flags & (WORD_TILDE | WORD_EXPAND)) {
+                    char *raw = strndup(cmdline + ctx->start, ctx->end - ctx->start);
+                    script_add(script, raw, flags);
+                    free(raw);
                 }
+                else script_add(script, ctx->cmdstring, flags);
+            }
+            ctx->start = i + 1;
+            if((c == '\n' || c == ';') && !ctx->special_handling) {
+                script_add(script, "", WORD_END);
+            }
+            else if(and_or) {
+                char cmdstring[3] = {c, c, '\0'};
+                script_add(script, cmdstring, WORD_OPERATOR);
+                i ++;
+                ctx->start = i + 1;
+            }
+            else if(c == '|' || c == '<' || c == '>') {
+                char cmdstring[2] = {c, '\0'};
+                script_add(script, cmdstring, WORD_OPERATOR);
+            }
+            free(ctx->cmdstring);
+        }
+        if(i == size) break;
+        if(!(ctx->special_handling && ctx->special_handling_index == i-1)){
+            //track $( ) and ` ` so their contents stay in one token
+            if(c == '(' && i > 0 && cmdline[i-1] == '$' && !ctx->in_backtick) ctx->subst_depth ++;
+            else if(c == ')' && ctx->subst_depth) ctx->subst_depth --;
+            else if(c == '`' && !ctx->subst_depth) ctx->in_backtick = !ctx->in_backtick;
+        }
+        if(c == '\\' && ctx->special_handling_index != i-1) {ctx->special_handling = 1; ctx->special_handling_index = i;}
+        if(ctx->special_handling_index == i-1) ctx->special_handling = 0;
+    }
+    int terminated = !ctx->subst_depth && !ctx->in_backtick;
+    ctx->subst_depth = 0;
+    ctx->in_backtick = 0;
+    ctx->special_handling = 0;
+    ctx->special_handling_index = 512;
+    return terminated;
+}
+
+/*
+ * Runs a compiled script one top level command at a time
+ * The words are parsed into a tree once (see ast.c) and each command runs as soon as it has been parsed,
+ * so a syntax error only stops the script at the command containing it.
+ */
+void runScript(compiled_script *script, array_list *al, array_list *wildcard_al){
+    ast_parser parser;
+    ast_parser_init(&parser, script);
+    ast_node *node;
+    while(!ctx->exited && (node = ast_parse_next(&parser)) != NULL){
+        //with nothing after it, the last simple command can take over the process instead of forking (see execInPlace())
+        ctx->exec_in_place = ctx->exec_last && node->type == NODE_COMMAND && ast_parse_done(&parser);
+        runNode(script, node, al, wildcard_al);
+        ctx->exec_in_place = 0;
+        ast_free(node);
+    }
+    if(parser.status == PARSE_INCOMPLETE){
+        fprintf(ctx->err, "error: syntax error: unexpected end of input\n");
+    }
+    else if(parser.status == PARSE_ERROR){
+        const char *word = script_word(script, parser.error_word);
+        fprintf(ctx->err, "error: syntax error near '%s'\n", word[0] == '\0' ? "newline" : word);
+    }
+    if(parser.status != PARSE_OK){
+        ctx->last_status = 2;
+        ctx->prompt = "!mysh> ";
+    }
+}
+
+/*
+ * Runs a parsed command and the rest of its list
+ * "&&" and "||" run their right side depending on $? after the left side, "if" and "while" test $? after their condition
+ * and "for" expands its words once before the loop, while the words of a loop body are expanded again on every iteration.
+ * Stops early when break or continue is leaving enclosing loops, or after exit in an embedded context
+ */
+void runNode(compiled_script *script, ast_node *node, array_list *al, array_list *wildcard_al){
+    for(; node != NULL && !ctx->loop_levels && !ctx->exited; node = node->next){
+        int status = 0;
+        switch(node->type){
+        case NODE_COMMAND:
+            runCommand(script, node->first, node->last, al, wildcard_al);
+            continue;
+        case NODE_AND:
+        case NODE_OR:
+            runNode(script, node->cond, al, wildcard_al);
+            if(!ctx->loop_levels && (ctx->last_status == 0) == (node->type == NODE_AND)) runNode(script, node->body, al, wildcard_al);
+            continue;
+        case NODE_IF:
+            runNode(script, node->cond, al, wildcard_al);
+            if(ctx->loop_levels) return;
+            if(ctx->last_status == 0) runNode(script, node->body, al, wildcard_al);
+            else if(node->alt != NULL) runNode(script, node->alt, al, wildcard_al);
+            else ctx->last_status = 0;
+            break;
+        case NODE_WHILE:
+            ctx->loop_depth ++;
+            for(;;){
+                runNode(script, node->cond, al, wildcard_al);
+                if(ctx->loop_levels) {if(leaveLoop()) break; continue;}
+                if(ctx->last_status != 0) break;
+                runNode(script, node->body, al, wildcard_al);
+                status = ctx->last_status;
+                if(leaveLoop()) break;
             }
-            start = i + 1;
-            if(cmdline[i] == '\n' && !special_handling) {
-                processInput(al); 
-                    if(exit_status) prompt = "mysh> ";
-                    else prompt = "!mysh> ";
-                    if(!fin) fputs(prompt, stderr);
-                    exit_status = 1;
-                destroy(al);
-                if(fin == 0) {free(cmdstring); return;}
-                init(al, ALSIZE);
+            ctx->loop_depth --;
+            ctx->last_status = status;
+            break;
+        case NODE_FOR:{
+            const char *name = script_word(script, node->name);
+            if(!isName((char *)name, strlen(name))){
+                fprintf(ctx->err, "error: for: invalid variable name: %s\n", name);
+                ctx->last_status = 1;
+                break;
             }
-            else if(cmdline[i] == '|' || cmdline[i] == '<' || cmdline[i] == '>') {
-                char cmdstring[2] = {cmdline[i], '\0'};
-                push(al, cmdstring);
+            array_list items;
+            init(&items, ALSIZE);
+            for(uint32_t i = node->first; i < node->last; i ++) pushWord(script, i, &items, wildcard_al);
+            ctx->loop_depth ++;
+            for(int i = 0; i < get_length(&items); i ++){
+                vars_set(&ctx->vars, name, items.data[i], 0);
+                ctx->home_path = vars_get(&ctx->vars, "HOME");
+                runNode(script, node->body, al, wildcard_al);
+                status = ctx->last_status;
+                if(leaveLoop()) break;
             }
-            free(cmdstring);
-            //if(cmdline[i+1] == 0) break;        this was causing problems
+            ctx->loop_depth --;
+            destroy(&items);
+            ctx->last_status = status;
+            break;
         }
-        if(cmdline[i] == '\\' && special_handling_index != i-1) {special_handling = 1; special_handling_index = i;}
-        if(special_handling_index == i-1) special_handling = 0;
+        }
+        ctx->prompt = ctx->last_status == 0 ? "mysh> " : "!mysh> ";
+    }
+}
+
+/*
+ * Runs the simple command made of words [first, last) of a compiled script
+ * Only words flagged by compileScript() are expanded (see pushWord()), the tokens are pushed into an arraylist
+ * and processInput() is called with them.
+ */
+void runCommand(compiled_script *script, uint32_t first, uint32_t last, array_list *al, array_list *wildcard_al){
+    unsigned long long started = trace_enabled ? monotonicNs() : 0;
+    if(trace_enabled) trace_begin("runCommand", 0, started, script_word(script, first));
+    int in_place = ctx->exec_in_place;
+    ctx->exec_in_place = 0;
+    init(al, ALSIZE);
+    for(uint32_t i = first; i < last; i ++){
+        pushWord(script, i, al, wildcard_al);
     }
+    if(trace_enabled) trace_span("expand", 0, started, monotonicNs(), script_word(script, first));
+    if(get_length(al) > 0) ctx->last_status = 0;
+    ctx->exec_in_place = in_place;
+    processInput(al); 
+        if(!ctx->exit_status && ctx->last_status == 0) ctx->last_status = 1;
+        if(ctx->exit_status) ctx->prompt = "mysh> ";
+        else ctx->prompt = "!mysh> ";
+        ctx->exit_status = 1;
     destroy(al);
-    return;
+    if(trace_enabled) trace_end(monotonicNs());
+}
+
+/*
+ * Pushes a word of a compiled script onto an arraylist, expanding it according to its flags:
+ * the home directory shortcut is replaced with the user's home directory, variable references and command substitutions
+ * are expanded (possibly into several tokens), and wildcard tokens are replaced by their matches, or passed unchanged if there are none.
+ */
+void pushWord(compiled_script *script, uint32_t index, array_list *al, array_list *wildcard_al){
+    int flags = script->flags[index];
+    char *word = (char *)script_word(script, index);
+    if(flags == 0 || (flags & WORD_OPERATOR)){
+        push(al, word);
+        return;
+    }
+    char *expanded_home = NULL;
+    int literal = 0;
+    if(flags & WORD_TILDE){
+        expanded_home = expandHomeDir(word, &literal);
+        word = expanded_home;
+        if(!(flags & WORD_EXPAND)){
+            //the rest of the word still has its escapes, expandToken() removes them otherwise
+            char *rest = specialHandlingMemCopy(word + literal, strlen(word + literal));
+            expanded_home = malloc(literal + strlen(rest) + 1);
+            memcpy(expanded_home, word, literal);
+            strcpy(expanded_home + literal, rest);
+            free(rest);
+            free(word);
+            word = expanded_home;
+        }
+    }
+    if(flags & WORD_EXPAND){
+        //expansion can split the token into several NUL separated fields, the inserted directories are not expanded again
+        int length;
+        char *fields = expandToken(word + literal, &length);
+        if(literal > 0){
+            char *joined = malloc(literal + length);
+            memcpy(joined, word, literal);
+            memcpy(joined + literal, fields, length);
+            free(fields);
+            fields = joined;
+            length += literal;
+        }
+        for(char *field = fields; field < fields + length; field += strlen(field) + 1){
+            if(*field != '\0') pushToken(al, wildcard_al, field);
+        }
+        free(fields);
+    }
+    else if(flags & WORD_GLOB){
+        pushToken(al, wildcard_al, word);
+    }
+    else{
+        push(al, word);
+    }
+    free(expanded_home);
+}
+
+/*
+ * Called by a loop after each iteration, consumes one level of a pending break or continue
+ * Returns 1 if the loop must stop, or 0 if it goes on with its next iteration (never after exit in an embedded context)
+ */
+int leaveLoop(){
+    if(ctx->exited) return 1;
+    if(ctx->loop_levels == 0) return 0;
+    ctx->loop_levels --;
+    if(ctx->loop_levels == 0 && ctx->loop_continue){
+        ctx->loop_continue = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Implements the break and continue builtins, "break N" leaves N enclosing loops
+ * and "continue N" goes on with the next iteration of the Nth enclosing loop
+ */
+void loopCommand(array_list *al) {
+    int levels = get_length(al) > 1 ? atoi(al->data[1]) : 1;
+    if(get_length(al) > 2 || levels < 1) {fprintf(ctx->err, "error: %s: invalid argument\n", al->data[0]); ctx->exit_status = 0; return;}
+    if(ctx->loop_depth == 0) {fprintf(ctx->err, "error: %s: only meaningful in a loop\n", al->data[0]); ctx->exit_status = 0; return;}
+    ctx->loop_levels = levels < ctx->loop_depth ? levels : ctx->loop_depth;
+    ctx->loop_continue = strcmp(al->data[0], "continue") == 0;
+}
+
+/*
+ * Takes pointer to the command line read so far and its size
+ * Returns 0 if it ends inside a command substitution or a compound command (or after "&&"/"||") and more lines are needed, 1 otherwise
+ */
+int commandComplete(char *cmdline, int size){
+    compiled_script script;
+    ast_parser parser;
+    ast_node *node;
+    script_init(&script);
+    int complete = compileScript(&script, cmdline, size);
+    ast_parser_init(&parser, &script);
+    while(complete && (node = ast_parse_next(&parser)) != NULL) ast_free(node);
+    complete = complete && parser.status != PARSE_INCOMPLETE;
+    script_free(&script);
+    return complete;
+}
+
+/*
+ * Takes pointer to the path of a batch script and whether the compiled script cache may be used
+ * Loads the compiled form of the script from the cache when its source is unchanged, otherwise reads and compiles
+ * the script and stores the result in the cache for the next run, then runs it
+ */
+void runScriptFile(char *path, int use_cache){
+    compiled_script script;
+    unsigned long long started = trace_enabled ? monotonicNs() : 0;
+    char *cache_path = use_cache ? script_cache_path(path) : NULL;
+    if(cache_path != NULL && script_load(&script, cache_path, path)){
+        if(DEBUG) fprintf(ctx->err, "loaded compiled script %s\n", cache_path);
+        if(trace_enabled) trace_span("script_load", 0, started, monotonicNs(), path);
+        free(cache_path);
+        if(trace_enabled) trace_begin("interpret", 0, started, path);
+        runScript(&script, &ctx->al, &ctx->wildcard_al);
+        if(trace_enabled) trace_end(monotonicNs());
+        script_free(&script);
+        return;
+    }
+    int size = 0, capacity = CAPTURE_CHUNK;
+    char *content = malloc(capacity);
+    while((ctx->bytes = read(ctx->fin, content + size, capacity - size)) > 0){
+        size += ctx->bytes;
+        if(size == capacity){
+            capacity *= 2;
+            content = realloc(content, capacity);
+        }
+    }
+    script_init(&script);
+    if(!compileScript(&script, content, size)){
+        fprintf(ctx->err, "error: unterminated command substitution\n");
+        ctx->exit_status = 0;
+    }
+    if(cache_path != NULL && !script_save(&script, cache_path, path, content, size) && DEBUG) fprintf(ctx->err, "could not cache %s\n", path);
+    free(cache_path);
+    free(content);
+    if(trace_enabled) {
+        trace_span("compileScript", 0, started, monotonicNs(), path);
+        trace_begin("interpret", 0, started, path);
+    }
+    runScript(&script, &ctx->al, &ctx->wildcard_al);
+    if(trace_enabled) trace_end(monotonicNs());
+    script_free(&script);
+}
+
+/*
+ * Takes pointer to a token containing tilde prefixes (see containsHomeDirShortcut()) and replaces each one with its directory
+ * (see tildeDirectory()). In a NAME=value assignment the prefixes after '=' and after each ':' are expanded too, up to the first
+ * variable reference or command substitution. The size of the result is computed first so it is built with one allocation.
+ * The token still has its escapes (see compileScript()), an escaped '~' is not a prefix.
+ * Sets *literal to the length of the result up to the end of the last inserted directory, which must not be expanded again
+ * Returns a new string, which the caller frees
+ */
+char* expandHomeDir(char *cmdstring, int *literal){
+    int assignment = isAssignment(cmdstring);
+    int equals = assignment ? strchr(cmdstring, '=') - cmdstring : -1, stop = 0;
+    while(cmdstring[stop] != '\0' && cmdstring[stop] != '$' && cmdstring[stop] != '`') stop += cmdstring[stop] == '\\' && cmdstring[stop + 1] != '\0' ? 2 : 1;
+    char *expanded = NULL;
+    int n = 0, last_end = 0;
+    for(int pass = 0; pass < 2; pass ++){
+        n = 0;
+        *literal = 0;
+        for(int i = 0; cmdstring[i] != '\0';){
+            const char *dir = NULL;
+            int length = 0;
+            if(cmdstring[i] == '~' && (i == 0 || (i > equals && i < stop && (i - 1 == equals || cmdstring[i - 1] == ':')))){
+                dir = tildeDirectory(cmdstring + i, &length, assignment);
+            }
+            if(dir == NULL){
+                //an escaped character before the last directory loses its '\' here, one after it keeps it for pushWord()
+                int copied = cmdstring[i] == '\\' && cmdstring[i + 1] != '\0' ? 2 : 1;
+                int skipped = copied == 2 && pass == 1 && i < last_end ? 1 + (cmdstring[i + 1] == '\n') : 0;
+                if(pass == 1) memcpy(expanded + n, cmdstring + i + skipped, copied - skipped);
+                n += copied - skipped;
+                i += copied;
+                continue;
+            }
+            int dir_length = strlen(dir);
+            if(pass == 1) memcpy(expanded + n, dir, dir_length);
+            n += dir_length;
+            i += length;
+            *literal = n;
+            if(pass == 0) last_end = i;
+        }
+        if(pass == 0) expanded = malloc(n + 1);
+    }
+    expanded[n] = '\0';
+    return expanded;
+}
+
+/*
+ * Takes pointer to a tilde prefix, which runs from the '~' up to the next '/' (or ':' in an assignment) or the end of the token
+ * "~" stands for the home directory, "~+" for the working directory, "~-" for the previous one (OLDPWD) and "~name" for the home
+ * directory of user name.
+ * Returns the directory and sets *length to the length of the prefix, or returns NULL if the prefix is left unchanged
+ */
+const char* tildeDirectory(char *prefix, int *length, int assignment){
+    *length = 1;
+    while(prefix[*length] != '\0' && prefix[*length] != '/' && !(assignment && prefix[*length] == ':')) (*length) ++;
+    if(*length == 1) return ctx->home_path;
+    if(*length == 2 && prefix[1] == '+') return getcwd(ctx->tilde_cwd, PATH_MAX);
+    if(*length == 2 && prefix[1] == '-') return vars_get(&ctx->vars, "OLDPWD");
+    for(int i = 1; i < *length; i ++){
+        char c = prefix[i];
+        if(!(c == '.' || c == '_' || c == '-' || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))) return NULL;
+    }
+    return userHome(prefix + 1, *length - 1);
+}
+
+/*
+ * Takes the name of a user and its length
+ * Returns the user's home directory from getpwnam_r(), or NULL if there is no such user
+ * Results are cached for the life of the shell, so a script naming the same user many times reads the password database once
+ */
+char* userHome(char *name, int length){
+    for(user_home *entry = ctx->user_homes; entry != NULL; entry = entry->next){
+        if(strncmp(entry->name, name, length) == 0 && entry->name[length] == '\0') return entry->dir;
+    }
+    char user[length + 1];
+    memcpy(user, name, length);
+    user[length] = '\0';
+    long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    if(size <= 0) size = 16384;
+    char *pw_buffer = malloc(size);
+    struct passwd pw, *result = NULL;
+    int error;
+    while((error = getpwnam_r(user, &pw, pw_buffer, size, &result)) == ERANGE){
+        size *= 2;
+        pw_buffer = realloc(pw_buffer, size);
+    }
+    char *dir = result == NULL ? NULL : strdup(pw.pw_dir);
+    free(pw_buffer);
+    //lookup failures other than an unknown user are not cached
+    if(result == NULL && error != 0) return NULL;
+    user_home *entry = malloc(sizeof(user_home));
+    entry->name = strdup(user);
+    entry->dir = dir;
+    entry->next = ctx->user_homes;
+    ctx->user_homes = entry;
+    return dir;
 }
 
 /*
@@ -260,65 +1189,80 @@ void interpret(char *cmdline, array_list *al, array_list *wildcard_al){
  * Returns false if nothing was executed and true if something was executed.
  */
 int searchCommands(array_list *al) {
-    int found = 0;
+    unsigned long long started = trace_enabled ? monotonicNs() : 0;
+    //builtins that can be a stage of a pipeline are run by execute()
+    char *path = isBuiltinStage(al->data, get_length(al)) ? strdup(al->data[0]) : resolveCommand(al->data[0]);
+    if(path == NULL) {
+        if(trace_enabled) trace_span("searchCommands", 0, started, monotonicNs(), al->data[0]);
+        return 0;
+    }
     //puts arguments into an array so it can be pass into execv
     int numArgs = get_length(al);
     char* arguments[numArgs+1];
     arguments[numArgs] = NULL;
-    for(int i=0; i<numArgs; i++) {
+    arguments[0] = path;
+    for(int i=1; i<numArgs; i++) {
         arguments[i] = malloc(strlen(al->data[i])+1);
         strcpy(arguments[i], al->data[i]);
     }
+    execute(arguments, numArgs);
+    if(trace_enabled) trace_span("searchCommands", 0, started, monotonicNs(), al->data[0]);
+    for(int i=0; i<numArgs; i++) {
+        free(arguments[i]);
+    }
+    return 1;
+}
 
+/*
+ * Takes the name of a command, names containing a '/' are used as they are and others are searched for
+ * in the same directories as searchCommands()
+ * Returns the path of the command, which the caller frees, or NULL if it does not exist
+ */
+char* resolveCommand(char *name) {
     struct stat pfile;
-    for(int i=0; i<6; i++) {
-        char* path = malloc(strlen(vanilla_paths[i]) + strlen(al->data[0]) + 2);
+    unsigned long long started = trace_enabled ? monotonicNs() : 0;
+    char *found = NULL;
+    if(strchr(name, '/') != NULL) found = stat(name, &pfile) == -1 ? NULL : strdup(name);
+    for(int i=0; i<6 && found == NULL && strchr(name, '/') == NULL; i++) {
+        char* path = malloc(strlen(vanilla_paths[i]) + strlen(name) + 1);
         strcpy(path, vanilla_paths[i]);
-        strcat(path, al->data[0]);
-        if(stat(path, &pfile) != -1) {
-            found = 1;
-            free(arguments[0]);
-            arguments[0] = path;
-            execute(arguments, numArgs);
-            for(int i=0; i<numArgs; i++) {
-                free(arguments[i]);
-            }
-            return found;
-        }
-        if(DEBUG) printf(" %s ", path);
+        strcat(path, name);
+        if(stat(path, &pfile) != -1) {found = path; break;}
+        if(DEBUG) fprintf(ctx->out, " %s ", path);
         free(path);
     }
-    for(int i=0; i<numArgs; i++) {
-        free(arguments[i]);
-    }
-    return 0;
+    if(trace_enabled) trace_span("resolveCommand", 0, started, monotonicNs(), found != NULL ? found : name);
+    return found;
 }
 
 /*
  * Checks executable using stat to verify existence of executable, 
  * returns failure and throws error if executable does not exist.
+ * The arguments containing a '/' (other than files after '>', which are created) are checked as well.
+ * All the checks are made at once with stat_batch() (see statbatch.c) before anything is started,
+ * "mysh --no-validate" skips them and leaves the errors to execve and the command itself.
  * Otherwise, argument array is populated and passed into execute function.
  */
 void process_Custom_Executable(array_list *al) {
     if(strcmp(al->data[0], "/") == 0) {
-        fprintf(stderr, "%s: no such file or directory\n", al->data[0]);
-        exit_status = 0;
+        fprintf(ctx->err, "%s: no such file or directory\n", al->data[0]);
+        ctx->exit_status = 0;
         return;
     }
-    struct stat pfile;
-    for(int i=0; i<get_length(al); i++) {
-        for(int j=0; j<strlen(al->data[i]); j++) {
-            if(al->data[i][j] == '/' || i == 0 || (i != 0 && strcmp(al->data[i-1], "|") == 0)) {
-                if(stat(al->data[i], &pfile) == -1) {
-                    fprintf(stderr, "%s: no such file or directory\n", al->data[i]);
-                    exit_status = 0;
-                    return;
-                }
-                else break;
-            }
+    int numArgs = get_length(al), checks = 0;
+    char *paths[numArgs];
+    int errors[numArgs];
+    for(int i = 0; ctx->validate_paths && i < numArgs; i ++) {
+        if(i == 0 || (strchr(al->data[i], '/') != NULL && strcmp(al->data[i - 1], ">") != 0)) paths[checks ++] = al->data[i];
+    }
+    stat_batch(paths, checks, errors);
+    for(int i = 0; i < checks; i ++) {
+        if(errors[i] != 0) {
+            fprintf(ctx->err, "%s: no such file or directory\n", paths[i]);
+            ctx->exit_status = 0;
+            return;
         }
     }
-    int numArgs = get_length(al);
     char* arguments[numArgs+1];
     arguments[numArgs] = NULL;
     for(int i=0; i<numArgs; i++) {
@@ -334,253 +1278,316 @@ void process_Custom_Executable(array_list *al) {
 
 /*
  * Main function to execute executables after setting input and output source.
- * I/O can be changed between calls depending on the user input (pipes/multiple redirects)
- * callExec is called when input and output is set appropriately and executable is executed.
- * When execution is finished, saved stdin and stdout is restored.
+ * The arguments are split at '|' into stages, each with its own arguments, an optional "< file" and any number of "> file".
+ * arguments[0] is already resolved by the caller, the commands of later stages are resolved here.
+ * A stage can also be a builtin (see isBuiltinStage()), the first one is run by the shell itself once every other stage
+ * has been started, so it never blocks on a pipe nobody reads yet, any other one is run by a forked child.
+ * The shell opens the files and starts every stage at once with spawnCommand(), connected to the files and to pipes between stages.
+ * A stage with several outputs (several "> file", or "> file" before a '|') writes into a relay process that copies its output
+ * to all of them with tee()/splice() (see relay.c), like zsh multios.
+ * With job control the children form a process group of their own, which has the terminal until they are done (see joinJob()).
+ * Waits for every stage and records the exit status of the last one for $?.
  */
 void execute(char** arguments, int numArgs) {
-    int inputRedirect = 0, outputRedirect = 0, piping = 0, inputRedirectIndex = 0, outputRedirectIndex = 0, pipingIndex = 0;
-    int fds[2];
+    int stages = 1;
     for(int i = 0; i < numArgs; i ++){
-        if(strcmp(arguments[i], "<") == 0) {
-            if(piping == 1) {
-                fprintf(stderr, "error: cannot redirect input and pipe\n");
-                return;
-                exit_status = 0;
-            }
-            inputRedirect = 1; 
-            inputRedirectIndex = i;
-            struct stat pfile;
-            if(stat(arguments[inputRedirectIndex + 1], &pfile) == -1) { exit_status = 0; fprintf(stderr, "error: no such file"); return;}
-        }
-        else if(strcmp(arguments[i], ">") == 0) {
-            if(outputRedirect == 1) {
-                fprintf(stderr, "error: cannot redirect output and pipe\n");
-                return;
-                exit_status = 0;
-            }
-            outputRedirect = 1;
-            outputRedirectIndex = i;
+        if(strcmp(arguments[i], "|") == 0) stages ++;
+    }
+    pipeline_stage stage[stages];
+    char *words[numArgs + stages], *outputs[numArgs];
+    int s = 0, w = 0, o = 0;
+    memset(stage, 0, sizeof(stage));
+    stage[0].argv = words;
+    stage[0].outputs = outputs;
+    for(int i = 0; i < numArgs; i ++){
+        if(strcmp(arguments[i], "|") == 0){
+            words[w ++] = NULL;
+            s ++;
+            stage[s].argv = words + w;
+            stage[s].outputs = outputs + o;
         }
-        else if(strcmp(arguments[i], "|") == 0) {
-            if(outputRedirect == 1) {
-                fprintf(stderr, "error: cannot redirect output and pipe\n");
-                return;
-                exit_status = 0;
-            }
-            piping = 1; 
-            pipingIndex = i; 
-            if(pipe(fds) == -1){ 
-                exit_status = 0; 
+        else if(strcmp(arguments[i], "<") == 0 || strcmp(arguments[i], ">") == 0){
+            if(i + 1 == numArgs || strcmp(arguments[i + 1], "|") == 0 || strcmp(arguments[i + 1], "<") == 0 || strcmp(arguments[i + 1], ">") == 0){
+                fprintf(ctx->err, "error: missing file name after %s\n", arguments[i]);
+                ctx->exit_status = 0;
                 return;
             }
-        }
-        //fds[0] - read end  fds[1] - write end
-    }
-    if(inputRedirect && !piping){
-        int fd = open(arguments[inputRedirectIndex + 1], O_RDONLY);
-        if(fd == -1){ exit_status = 0; return;}
-        saved_stdin = dup(STDIN_FILENO);
-        dup2(fd, STDIN_FILENO); // STDIN_FILENO (0) - file descriptor for stdin
-        close(fd);
-    }
-    if(outputRedirect && !piping){
-        int fd = open(arguments[outputRedirectIndex + 1], O_WRONLY | O_CREAT | O_TRUNC, 0640);
-        if(fd == -1){ exit_status = 0; return;}
-        saved_stdout = dup(STDOUT_FILENO);
-        dup2(fd, STDOUT_FILENO); // STDOUT_FILENO (1) - file descriptor for stdout
-        close(fd);
-    }
-    if(piping){
-            saved_stdout = dup(STDOUT_FILENO);
-            dup2(fds[1], STDOUT_FILENO);
-            saved_stdin = dup(STDIN_FILENO);
-            dup2(fds[0], STDIN_FILENO);
-    }
-    if((inputRedirect && !outputRedirect && !piping) || (!inputRedirect && outputRedirect && !piping)){ //only input redirection or output redirection
-        char *newArgs[numArgs - 1];
-        newArgs[numArgs - 2] = NULL;
-        for(int i = 0; i < numArgs - 2; i ++){
-            newArgs[i] = malloc(strlen(arguments[i]) + 1);
-            strcpy(newArgs[i], arguments[i]);
-        }
-        callExec(newArgs);
-        for(int i = 0; i < numArgs - 2; i ++){
-            free(newArgs[i]);
-        }
-        if(inputRedirect){
-            dup2(saved_stdin, STDIN_FILENO);
-            close(saved_stdin);
+            if(arguments[i][0] == '<') stage[s].input = arguments[++ i];
+            else {stage[s].outputs[stage[s].output_count ++] = arguments[++ i]; o ++;}
         }
         else{
-            dup2(saved_stdout, STDOUT_FILENO);
-            close(saved_stdout);
+            words[w ++] = arguments[i];
+            stage[s].argc ++;
         }
     }
-    else if(inputRedirect && outputRedirect && !piping){ //only input and output redirection
-        char *newArgs[numArgs - 3];
-        newArgs[numArgs - 4] = NULL;
-        for(int i = 0; i < numArgs - 4; i ++){
-            newArgs[i] = malloc(strlen(arguments[i]) + 1);
-            strcpy(newArgs[i], arguments[i]);
+    words[w] = NULL;
+    char *paths[stages];
+    int resolved = 0;
+    for(s = 0; s < stages; s ++){
+        if(stage[s].argc == 0) {fprintf(ctx->err, "error: missing command in pipeline\n"); ctx->exit_status = 0; break;}
+        paths[s] = NULL;
+        if(s == 0 || isBuiltinStage(stage[s].argv, stage[s].argc)) continue;
+        paths[s] = resolveCommand(stage[s].argv[0]);
+        if(paths[s] == NULL){
+            if(strchr(stage[s].argv[0], '/') != NULL) fprintf(ctx->err, "%s: no such file or directory\n", stage[s].argv[0]);
+            else fprintf(ctx->err, "error: undefined command: %s\n", stage[s].argv[0]);
+            ctx->exit_status = 0;
+            break;
         }
-        callExec(newArgs);
-        for(int i = 0; i < numArgs - 4; i ++){
-            free(newArgs[i]);
-        }
-        exit_status = 0;
-        dup2(saved_stdin, STDIN_FILENO);
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdin);
-        close(saved_stdout);
+        stage[s].argv[0] = paths[s];
+        resolved = s;
     }
-    else if(inputRedirect && !outputRedirect && piping){ //input redirection and piping
-        char* args1[pipingIndex-1];
-        for(int i=0; i<pipingIndex-2; i++) {
-            args1[i] = malloc(strlen(arguments[i])+1);
-            strcpy(args1[i], arguments[i]);
-        }
-        args1[pipingIndex-2] = NULL;
-
-        char* args2[numArgs-pipingIndex];
-        args2[numArgs-pipingIndex-1] = NULL;
-        for(int i=pipingIndex+1; i<numArgs; i++) {
-            args2[i-(pipingIndex+1)] = malloc(strlen(arguments[i])+1);
-            strcpy(args2[i-(pipingIndex+1)], arguments[i]);
+    //a builtin stage already runs without a fork, and several outputs need the relay
+    if(ctx->exit_status && ctx->exec_in_place && stages == 1 && stage[0].output_count <= 1 && !isBuiltinStage(stage[0].argv, stage[0].argc)){
+        execInPlace(&stage[0]);
+        return;
+    }
+    if(ctx->exit_status){
+        //fds[0] - read end  fds[1] - write end
+        pid_t pids[stages * 2], last = -1;
+        char *names[stages * 2];
+        unsigned long long spawned[stages * 2]; //start of each child and its track, for --trace
+        int tracks[stages * 2];
+        int started = 0, input = ctx->fds[0], builtin_stage = -1, builtin_in = -1, builtin_out = -1;
+        if(ctx->job_control) ctx->job_pgid = 0;
+        for(s = 0; s < stages && ctx->exit_status; s ++){
+            int fds[2] = {-1, -1}, outs[stage[s].output_count + 1], out_count = 0, in = input, out = ctx->fds[1];
+            if(s < stages - 1 && pipe2(fds, O_CLOEXEC) == -1) {printError("pipe"); ctx->exit_status = 0;}
+            if(ctx->exit_status && stage[s].input != NULL && (in = open(stage[s].input, O_RDONLY | O_CLOEXEC)) == -1) {printError(stage[s].input); ctx->exit_status = 0;}
+            for(int i = 0; ctx->exit_status && i < stage[s].output_count; i ++){
+                outs[out_count] = open(stage[s].outputs[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+                if(outs[out_count] == -1) {printError(stage[s].outputs[i]); ctx->exit_status = 0;}
+                else out_count ++;
+            }
+            if(fds[1] != -1) outs[out_count ++] = fds[1];
+            int relay[2] = {-1, -1};
+            if(ctx->exit_status && out_count == 1) out = outs[0];
+            else if(ctx->exit_status && out_count > 1){
+                if(pipe2(relay, O_CLOEXEC) == -1) {printError("pipe"); ctx->exit_status = 0;}
+                else{
+                    fflush(ctx->out);
+                    pid_t pid = fork();
+                    if(pid == 0){
+                        childJob();
+                        close(relay[1]);
+                        if(in != ctx->fds[0] && in != -1) close(in);
+                        if(fds[0] != -1) close(fds[0]);
+                        if(builtin_stage != -1) {close(builtin_in); close(builtin_out);}
+                        _exit(relay_fanout(relay[0], outs, out_count) ? 0 : 1);
+                    }
+                    if(pid == -1) {printError("fork"); ctx->exit_status = 0;}
+                    else {
+                        joinJob(pid);
+                        names[started] = NULL;
+                        spawned[started] = trace_enabled ? monotonicNs() : 0;
+                        tracks[started] = s + 1;
+                        pids[started ++] = pid;
+                    }
+                    out = relay[1];
+                }
+            }
+            int builtin = isBuiltinStage(stage[s].argv, stage[s].argc);
+            //with resource limits or pin settings every stage runs in a child, so they never apply to the shell,
+            //and with job control so Ctrl-C stops it and it can read the terminal
+            if(ctx->exit_status && builtin && builtin_stage == -1 && !childSettings() && !ctx->job_control){
+                builtin_stage = s;
+                builtin_in = fcntl(in, F_DUPFD_CLOEXEC, 0);
+                builtin_out = fcntl(out, F_DUPFD_CLOEXEC, 0);
+                if(builtin_in == -1 || builtin_out == -1) {printError("dup"); ctx->exit_status = 0;}
+            }
+            else if(ctx->exit_status){
+                ctx->child_pin.stage = s;
+                spawned[started] = trace_enabled ? monotonicNs() : 0;
+                pid_t pid = builtin ? spawnBuiltin(stage[s].argv, in, out) : spawnCommand(stage[s].argv, in, out);
+                if(pid == -1) ctx->exit_status = 0;
+                else {
+                    joinJob(pid);
+                    names[started] = stage[s].argv[0];
+                    tracks[started] = s + 1;
+                    pids[started ++] = pid;
+                    if(s == stages - 1) last = pid;
+                }
+            }
+            //the children have their own copies, the shell only keeps the read end of the next pipe
+            if(in != ctx->fds[0] && in != -1) close(in);
+            if(input != ctx->fds[0] && input != in) close(input);
+            for(int i = 0; i < out_count; i ++) close(outs[i]);
+            if(relay[0] != -1) {close(relay[0]); close(relay[1]);}
+            input = fds[0];
+        }
+        if(input != ctx->fds[0] && input != -1) close(input);
+        if(builtin_stage != -1){
+            if(ctx->exit_status){
+                //a reader that exits early must not kill the shell with SIGPIPE, the builtin sees EPIPE instead.
+                //The signal is only blocked in this thread and discarded afterwards, other contexts' threads are left alone
+                sigset_t pipe_mask, saved_mask;
+                struct timespec no_wait = {0, 0};
+                sigemptyset(&pipe_mask);
+                sigaddset(&pipe_mask, SIGPIPE);
+                pthread_sigmask(SIG_BLOCK, &pipe_mask, &saved_mask);
+                fflush(ctx->out);
+                unsigned long long cat_started = trace_enabled ? monotonicNs() : 0;
+                int status = catCommand(stage[builtin_stage].argv, builtin_in, builtin_out);
+                if(trace_enabled) trace_span("cat", builtin_stage + 1, cat_started, monotonicNs(), "builtin, in the shell");
+                while(sigtimedwait(&pipe_mask, NULL, &no_wait) == SIGPIPE);
+                pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+                if(builtin_stage == stages - 1) ctx->last_status = status;
+            }
+            if(builtin_in != -1) close(builtin_in);
+            if(builtin_out != -1) close(builtin_out);
         }
+        for(int i = 0; i < started; i ++){
+            int wstatus;
+            struct rusage usage;
+            if(wait4(pids[i], &wstatus, 0, &usage) == -1) continue;
+            if(pids[i] == last && ctx->exit_status) ctx->last_status = waitStatus(wstatus);
+            if(trace_enabled) {
+                //the end is when the shell reaps the child, stages are reaped in order so a later one may end earlier
+                char detail[64];
+                snprintf(detail, sizeof(detail), "pid %d, status %d", pids[i], waitStatus(wstatus));
+                trace_span(names[i] != NULL ? names[i] : "relay", tracks[i], spawned[i], monotonicNs(), detail);
+            }
+            //a command ended by one of its limits says so, its status is 128 + the signal as usual
+            const char *reason = WIFSIGNALED(wstatus) && names[i] != NULL && limits_any(&ctx->child_limits) ? limits_reason(&ctx->child_limits, WTERMSIG(wstatus), &usage) : NULL;
+            if(reason != NULL) fprintf(ctx->err, "%s: %s\n", names[i], reason);
+        }
+        //the shell takes the terminal back, it ignores the SIGTTOU this sends from the background
+        if(ctx->job_pgid > 0) tcsetpgrp(ctx->fds[0], getpgrp());
+        ctx->job_pgid = -1;
+    }
+    for(s = 1; s <= resolved; s ++) if(paths[s] != NULL) free(paths[s]);
+    return;
+}
 
-        int fd = open(arguments[inputRedirectIndex + 1], O_RDONLY);
-        if(fd == -1){ exit_status = 0; return;}
-        dup2(fd, STDIN_FILENO); // STDIN_FILENO (0) - file descriptor for stdin
+/*
+ * Runs a single command in place of the shell, without forking: for the last command of a batch script, of -c or of a
+ * command substitution, which the shell would only wait for before exiting, and for the exec builtin.
+ * The redirections are installed on the shell's own stdin and stdout, along with the resource limits and pin settings.
+ * Returns only if a redirection cannot be opened, a failing execve() exits with 127 like a child would
+ */
+void execInPlace(pipeline_stage *stage) {
+    int in = -1, out = -1;
+    if(stage->input != NULL && (in = open(stage->input, O_RDONLY | O_CLOEXEC)) == -1) {printError(stage->input); ctx->exit_status = 0; return;}
+    if(stage->output_count == 1 && (out = open(stage->outputs[0], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640)) == -1) {
+        printError(stage->outputs[0]);
+        if(in != -1) close(in);
+        ctx->exit_status = 0;
+        return;
+    }
+    fflush(ctx->out);
+    childJob();
+    childStdio(in != -1 ? in : ctx->fds[0], out != -1 ? out : ctx->fds[1]);
+    if(in != -1) close(in);
+    if(out != -1) close(out);
+    limits_apply(&ctx->child_limits);
+    ctx->child_pin.stage = 0;
+    pin_apply(&ctx->child_pin);
+    if(trace_enabled) {
+        unsigned long long now = monotonicNs();
+        //the program replaces the shell, so its span ends here and the spans still open around it end with the trace
+        trace_span("exec", 0, now, now, stage->argv[0]);
+        trace_span(stage->argv[0], 1, now, now, "replaces the shell, not reaped");
+        trace_close();
+    }
+    execve(stage->argv[0], stage->argv, vars_environ(&ctx->vars));
+    printError(stage->argv[0]);
+    exit(127);
+}
 
-        callExec(args1);
-        close(fd);
-        dup2(fds[0], STDIN_FILENO);
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdout);
-
-        callExec(args2);
-        close(fds[0]);
-        close(fds[1]);
-        for(int i=0; i<pipingIndex-1; i++) free(args1[i]);
-        for(int i=0; i<numArgs-1-pipingIndex; i++) free(args2[i]);
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdin);
-
-    }
-    else if(!inputRedirect && outputRedirect && piping){ //output redirection and piping
-        char* args1[pipingIndex+1];
-        for(int i=0; i<pipingIndex; i++) {
-            args1[i] = malloc(strlen(arguments[i])+1);
-            strcpy(args1[i], arguments[i]);
-        }
-        args1[pipingIndex] = NULL;
-
-        char* args2[numArgs-2-pipingIndex];
-        args2[numArgs-2-pipingIndex-1] = NULL;
-        for(int i=pipingIndex+1; i<numArgs-2; i++) {
-            args2[i-(pipingIndex+1)] = malloc(strlen(arguments[i])+1);
-            strcpy(args2[i-(pipingIndex+1)], arguments[i]);
-        }
-        callExec(args1);
-        int fd = open(arguments[outputRedirectIndex + 1], O_WRONLY | O_CREAT | O_TRUNC, 0640);
-        if(fd == -1){ exit_status = 0; return;}
-        dup2(fd, STDOUT_FILENO); // STDOUT_FILENO (1) - file descriptor for stdout
-        close(fd);
+/*
+ * Starts args[0] with input and output as its stdin and stdout, the child gets the exported shell variables as its environment.
+ * With --zygote the child is started by the zygote (zygote.c) so the cost does not depend on the size of the shell,
+ * falling back to fork if the zygote is gone. Otherwise the shell forks and installs input and output before calling execve.
+ * Resource limits from ulimit or the limit prefix and the settings of the pin prefix are installed by the forked child with
+ * limits_apply() and pin_apply(), so such commands do not use the zygote. Neither do the stages of a pipeline with a process
+ * group of its own, a child of the zygote could read the terminal before the shell has put it in the group.
+ * Returns the pid of the child, or -1 if it could not be started
+ */
+pid_t spawnCommand(char** args, int input, int output) {
+    char **envp = vars_environ(&ctx->vars);
+    unsigned long long started = monotonicNs();
+    int process = -1;
+    const char *how = "fork";
+    if(ctx->zyg.sock != -1 && !childSettings() && ctx->job_pgid == -1) {
+        char cwd[PATH_MAX];
+        int fds[3] = {input, output, ctx->fds[2]};
+        if(getcwd(cwd, PATH_MAX) != NULL) process = zygote_spawn(&ctx->zyg, args[0], args, envp, cwd, fds);
+        if(process == -1 && errno == EPIPE) {fprintf(ctx->err, "error: zygote exited, using fork\n"); zygote_stop(&ctx->zyg);}
+        if(process != -1) {ctx->stats.zygote_spawns ++; how = "spawn (zygote)";}
+    }
+    if(process == -1) process = fork();
+    if(process == -1) {fprintf(ctx->err, "error: cannot execute\n"); return -1;}
+    if(process == 0) {
+        childJob();
+        childStdio(input, output);
+        limits_apply(&ctx->child_limits);
+        pin_apply(&ctx->child_pin);
+        execve(args[0], args, envp);
+        printError(args[0]);
+        _exit(127);
+    }
+    unsigned long long spawned = monotonicNs();
+    recordSpawn(spawned - started);
+    if(trace_enabled) trace_span(how, 0, started, spawned, args[0]);
+    if(DEBUG) fprintf(ctx->out, "%d", process);
+    return process;
+}
 
-        callExec(args2);
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdout);
-        close(fds[0]);
-        close(fds[1]);
-        for(int i=0; i<pipingIndex+1; i++) free(args1[i]);
-        for(int i=0; i<numArgs-2-pipingIndex; i++) free(args2[i]);
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdin);
-
-    }
-    else if(!inputRedirect && !outputRedirect && piping){ //only piping
-        char* args1[pipingIndex+1];
-        for(int i=0; i<pipingIndex; i++) {
-            args1[i] = malloc(strlen(arguments[i])+1);
-            strcpy(args1[i], arguments[i]);
-        }
-        args1[pipingIndex] = NULL;
-
-        char* args2[numArgs-pipingIndex];
-        args2[numArgs-pipingIndex-1] = NULL;
-        for(int i=pipingIndex+1; i<numArgs; i++) {
-            args2[i-(pipingIndex+1)] = malloc(strlen(arguments[i])+1);
-            strcpy(args2[i-(pipingIndex+1)], arguments[i]);
-        }
-
-        callExec(args1);
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdout);
-        callExec(args2);
-        close(fds[0]);
-        close(fds[1]);
-        for(int i=0; i<pipingIndex+1; i++) free(args1[i]);
-        for(int i=0; i<numArgs-pipingIndex; i++) free(args2[i]);
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdin);
-    }
-    else if(inputRedirect && outputRedirect && piping){ //input/output redirection and piping
-        char* args1[pipingIndex-1];
-        for(int i=0; i<pipingIndex-2; i++) {
-            args1[i] = malloc(strlen(arguments[i])+1);
-            strcpy(args1[i], arguments[i]);
-        }
-        args1[pipingIndex-2] = NULL;
-        int fd = open(arguments[inputRedirectIndex + 1], O_RDONLY);
-        if(fd == -1){ exit_status = 0; return;}
-        dup2(fd, STDIN_FILENO); // STDIN_FILENO (0) - file descriptor for stdin
-        close(fd);
-        callExec(args1);
-
-        char* args2[numArgs-2-pipingIndex];
-        args2[numArgs-2-pipingIndex-1] = NULL;
-        for(int i=pipingIndex+1; i<numArgs-2; i++) {
-            args2[i-(pipingIndex+1)] = malloc(strlen(arguments[i])+1);
-            strcpy(args2[i-(pipingIndex+1)], arguments[i]);
-        }
-        int fd2 = open(arguments[outputRedirectIndex + 1], O_WRONLY | O_CREAT | O_TRUNC, 0640);
-        if(fd2 == -1){ exit_status = 0; return;}
-        dup2(fd2, STDOUT_FILENO); // STDOUT_FILENO (1) - file descriptor for stdout
-        close(fd2);
-        dup2(fds[0], STDIN_FILENO);
-        callExec(args2);
-        for(int i=0; i<numArgs-2-pipingIndex; i++) free(args2[i]);
-        for(int i=0; i<pipingIndex-1; i++) free(args1[i]);
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdin);
-        dup2(saved_stdout, STDOUT_FILENO);
-        close(saved_stdout);
-    }
-    else{ 
-        callExec(arguments);
+/*
+ * Returns 1 if the stage with the given arguments (up to argc or the first '|') is run by a builtin instead of a program:
+ * cat without options, options are left to the real cat
+ */
+int isBuiltinStage(char **args, int argc) {
+    if(strcmp(args[0], "cat") != 0) return 0;
+    for(int i = 1; i < argc && strcmp(args[i], "|") != 0; i ++){
+        if(args[i][0] == '-' && args[i][1] != '\0') return 0;
     }
-    return;
+    return 1;
 }
 
 /*
- * Calls fork to create a child process, then calles execv to execute if a child process was successfully created.
- * Returns after child process is completed or fork/execv fails.
+ * Runs a builtin stage in a forked child with input and output as its stdin and stdout,
+ * for pipelines with more than one builtin stage and for commands with resource limits or pin settings
+ * Returns the pid of the child, or -1 if it could not be started
  */
-void callExec(char** args) {
-    int process = fork();
-    if(process == -1) {fprintf(stderr, "error: cannot execute"); exit_status = 0; return;}
+pid_t spawnBuiltin(char **args, int input, int output) {
+    fflush(ctx->out);
+    pid_t process = fork();
+    if(process == -1) {fprintf(ctx->err, "error: cannot execute\n"); return -1;}
     if(process == 0) {
-        execv(args[0], args);
+        childJob();
+        childStdio(input, output);
+        //the child must not keep other pipe ends of the pipeline open, that includes the context's own descriptors
+        close_range(3, ~0U, 0);
+        ctx->err = stderr;
+        limits_apply(&ctx->child_limits);
+        pin_apply(&ctx->child_pin);
+        _exit(catCommand(args, STDIN_FILENO, STDOUT_FILENO));
     }
-    int wstatus;
-    int tpid = wait(&wstatus);
-    if(DEBUG) printf("%d", tpid);
-    if (WIFEXITED(wstatus)) {
-        // child exited normally
-        if(DEBUG) printf("child exited with %d\n", WEXITSTATUS(wstatus));
+    return process;
+}
+
+/*
+ * Implements the cat builtin, copies every file named in args (input for none or "-") to output
+ * with copy_fd() (see copy.c), which avoids copying the data through user space
+ * Returns the exit status, 0 if every file was copied, 128 + SIGPIPE if the reader went away or 1 otherwise
+ */
+int catCommand(char **args, int input, int output) {
+    int status = 0;
+    for(int i = 1; i == 1 || args[i] != NULL; i ++){
+        char *name = args[i] == NULL ? "-" : args[i];
+        int fd = strcmp(name, "-") == 0 ? input : open(name, O_RDONLY | O_CLOEXEC);
+        int copied = fd != -1 && copy_fd(fd, output), error = errno;
+        if(fd != input && fd != -1) close(fd);
+        //like a program killed by SIGPIPE when the reader went away
+        if(!copied && error == EPIPE) return 128 + SIGPIPE;
+        if(!copied) {
+            fprintf(ctx->err, "cat: %s: %s\n", name, strerror(error));
+            status = 1;
+        }
+        if(args[i] == NULL) break;
     }
-    return;
+    return status;
 }
 
 /*
@@ -588,10 +1595,10 @@ void callExec(char** args) {
  * Resets variables and frees necessary data associated with building the parsed command line
  */
 void cleanUp(char *cmdline){ //used to reset and free data to prepare for next input command
-    start = 0;
-    end = 0;
-    count = 0;
-    cmdline_size = 0;
+    ctx->start = 0;
+    ctx->end = 0;
+    ctx->count = 0;
+    ctx->cmdline_size = 0;
     free(cmdline);
 }
 
@@ -626,11 +1633,11 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
         if(wildcard_token[i] == '*') {star_index = i; break;}
     }
     init(wildcard_al, ALSIZE);
+    dp = opendir(path);
+    if(dp == NULL) {if(absolutePath) free(wildcard_token); return 0;}
     if(wildcard_token[0] == '*' && wildcard_token[1] == '.'){ //matching files of same type (*.txt) (works)
         char *file_type = malloc((strlen(wildcard_token + 1) + 1) * sizeof(char));
         strcpy(file_type, wildcard_token+1);
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             char *type = getFileType(de->d_name);
             if(type == NULL) continue;
@@ -644,8 +1651,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
         free(file_type);
     }
     else if(wildcard_token[0] == '*' && strlen(wildcard_token) == 1){ //matching all files (*) (works)
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             if((strlen(de->d_name) == 1 && de->d_name[0] == '.') || (strlen(de->d_name) == 2 && strcmp(de->d_name, "..") == 0) || (de->d_name[0] == '.')) continue;
             matches_found = 1;
@@ -656,8 +1661,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
     else if(wildcard_token[0] == '*' && wildcard_token[1] != '.' && !containsDot){ //matching files ending with pattern (*bar) (works)
         char *endPattern = malloc((sizeof(char)) * (strlen(wildcard_token)));
         strcpy(endPattern, wildcard_token + 1);
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             char *fileEndPattern = getFileEnd(de->d_name, strlen(wildcard_token) - 1);
             if(fileEndPattern == NULL) continue;
@@ -674,8 +1677,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
         char *startPattern = malloc(sizeof(char) * (strlen(wildcard_token)));
         startPattern[strlen(wildcard_token) - 1] = '\0';
         memcpy(startPattern, wildcard_token, strlen(wildcard_token) - 1);
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             char *fileStartPattern = getFileStartPattern(de->d_name, strlen(wildcard_token) - 1);
             if(fileStartPattern == NULL) continue;
@@ -695,8 +1696,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
         char *endPattern = malloc(sizeof(char) * (strlen(wildcard_token) - star_index));
         endPattern[strlen(wildcard_token) - star_index - 1] = '\0';
         memcpy(endPattern, wildcard_token + star_index + 1, strlen(wildcard_token) - star_index - 1);
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             char *fileStartPattern = getFileStartPattern(de->d_name, strlen(startPattern));
             char *fileEndPattern = getFileEnd(de->d_name, strlen(endPattern));
@@ -725,8 +1724,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
             if(wildcard_token[i] == '.') break;
             patternLength ++;
         }
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             if(isExecutable(de->d_name)) continue;
             char *fileEndPattern = getFileEndPattern(de->d_name, patternLength);
@@ -756,8 +1753,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
         type[strlen(wildcard_token) - star_index - 1] = '\0';
         strcpy(type, wildcard_token + star_index + 1);
         int patternLength = strlen(startPattern);
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             if(isExecutable(de->d_name)) continue;
             char *fileStartPattern = getFileStartPattern(de->d_name, patternLength);
@@ -790,8 +1785,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
             if(wildcard_token[i] == '.') break;
             endPatternLength ++;
         }
-        dp = opendir(path);
-        if(dp == NULL) {destroy(wildcard_al); return 0;}
         while((de =readdir(dp)) != NULL){
             if(isExecutable(de->d_name)) continue;
             char *fileStartPattern = getFileStartPattern(de->d_name, startPatternLength);
@@ -819,8 +1812,6 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
     }
     else if(star_index != 0 && wildcard_token[strlen(wildcard_token) - 1] == '*' && wildcard_token[strlen(wildcard_token) - 2] == '.'){ //matching files of any type with same name (foo.*) (works)
         char *name = getFileName(wildcard_token);
-        dp = opendir(path);
-        if(dp == NULL){destroy(wildcard_al); return 0;}
         while((de = readdir(dp)) != NULL){
             char *file_name = getFileName(de->d_name);
             if(strcmp(name, file_name) == 0){
@@ -832,6 +1823,9 @@ int processWildcard(array_list *wildcard_al, char *wildcard_token){
         closedir(dp);
         free(name);
     }
+    else{
+        closedir(dp);
+    }
     if(absolutePath){
         free(wildcard_token);
     }
@@ -890,7 +1884,7 @@ char* getFileEnd(char *file_name, int patternLength){
     int fileLength = strlen(file_name);
     char *end = malloc((patternLength + 1) * sizeof(char));
     end[patternLength] = '\0';
-    for(int j = fileLength - 1, k = strlen(end) - 1; j > fileLength - 1 - patternLength; j --, k --){
+    for(int j = fileLength - 1, k = patternLength - 1; j > fileLength - 1 - patternLength; j --, k --){
         end[k] = file_name[j];
     }
     return end;
@@ -978,12 +1972,18 @@ int containsWildcard(char *cmdstring){
 }
 
 /*
- * Takes pointer to string representing parsed command line as argument
- * Returns 1 if a token contains a path starting with "~/", 0 otherwise
+ * Takes a pointer to the raw (still escaped) text of a token and its length
+ * Returns 1 if the token starts with '~', or is a NAME=value assignment with a '~' right after the '=' or a ':', 0 otherwise.
+ * A "\~" does not count, the character before the '~' is then the '\'
  */
-int containsHomeDirShortcut(char *cmdstring){
-    if(strlen(cmdstring) < 2) return 0;
-    if(cmdstring[0] == '~' && cmdstring[1] == '/') return 1;
+int containsHomeDirShortcut(char *src, int size){
+    if(size > 0 && src[0] == '~') return 1;
+    int equals = 0;
+    while(equals < size && src[equals] != '=') equals ++;
+    if(equals == size || !isName(src, equals)) return 0;
+    for(int i = equals + 1; i < size; i ++) {
+        if(src[i] == '~' && (i - 1 == equals || src[i - 1] == ':')) return 1;
+    }
     return 0;
 }
 
@@ -1022,3 +2022,1291 @@ char* specialHandlingMemCopy(char* src, int size) {
     }
     return str;
 }
+
+/*
+ * Opens the persistent history file ($HISTFILE, or ~/.mysh_history) if it is not already open
+ * The file is only mapped here, entries are not read until a search needs them
+ * Returns 1 if history is available, 0 otherwise
+ */
+int openHistory() {
+    if(ctx->history_enabled) return 1;
+    char *path = vars_get(&ctx->vars, "HISTFILE");
+    char default_path[PATH_MAX];
+    if(path == NULL) {
+        if(ctx->home_path == NULL) return 0;
+        snprintf(default_path, PATH_MAX, "%s/.mysh_history", ctx->home_path);
+        path = default_path;
+    }
+    ctx->history_enabled = history_open(&ctx->hist, path);
+    return ctx->history_enabled;
+}
+
+/*
+ * Expands history references in the command line before it is tokenized
+ * "!!" is replaced by the previous command and "!prefix" by the newest command starting with prefix,
+ * both only at the start of a word and not when escaped
+ * The expanded command line is echoed to stderr
+ * Returns 1 if the command line should be run, or 0 if a reference could not be found
+ */
+int expandHistory() {
+    if(!ctx->history_enabled) return 1;
+    int found = 0;
+    for(int i = 0; i < ctx->cmdline_size; i ++) {
+        if(ctx->cmdline[i] == '!' && (i == 0 || ctx->cmdline[i - 1] == ' ') && i + 1 < ctx->cmdline_size && ctx->cmdline[i + 1] != ' ' && ctx->cmdline[i + 1] != '\n') {found = 1; break;}
+    }
+    if(!found) return 1;
+    int size = 0, capacity = ctx->cmdline_size + 1;
+    char *expanded = malloc(capacity);
+    for(int i = 0; i < ctx->cmdline_size; i ++) {
+        const char *text = ctx->cmdline + i;
+        unsigned int length = 1;
+        int consumed = 1;
+        if(ctx->cmdline[i] == '\\' && i + 1 < ctx->cmdline_size) {
+            length = 2;
+            consumed = 2;
+        }
+        else if(ctx->cmdline[i] == '!' && (i == 0 || ctx->cmdline[i - 1] == ' ') && i + 1 < ctx->cmdline_size && ctx->cmdline[i + 1] != ' ' && ctx->cmdline[i + 1] != '\n') {
+            if(ctx->cmdline[i + 1] == '!') {
+                text = history_last(&ctx->hist, &length);
+                consumed = 2;
+            }
+            else {
+                int j = i + 1;
+                while(j < ctx->cmdline_size && ctx->cmdline[j] != ' ' && ctx->cmdline[j] != '\n') j ++;
+                char prefix[j - i];
+                memcpy(prefix, ctx->cmdline + i + 1, j - i - 1);
+                prefix[j - i - 1] = '\0';
+                text = history_find_prefix(&ctx->hist, prefix, &length);
+                consumed = j - i;
+            }
+            if(text == NULL) {
+                fprintf(ctx->err, "error: event not found: %.*s\n", consumed, ctx->cmdline + i);
+                free(expanded);
+                ctx->exit_status = 0;
+                ctx->prompt = "!mysh> ";
+                return 0;
+            }
+        }
+        if(size + length + 1 > capacity) {
+            while(size + length + 1 > capacity) capacity *= 2;
+            expanded = realloc(expanded, capacity);
+        }
+        memcpy(expanded + size, text, length);
+        size += length;
+        i += consumed - 1;
+    }
+    free(ctx->cmdline);
+    ctx->cmdline = expanded;
+    ctx->cmdline_size = size;
+    fprintf(ctx->err, "%.*s", ctx->cmdline_size, ctx->cmdline);
+    if(ctx->cmdline_size == 0 || ctx->cmdline[ctx->cmdline_size - 1] != '\n') fputc('\n', ctx->err);
+    return 1;
+}
+
+/*
+ * Appends the current interactive command line to the history file
+ * Blank lines and repeats of the previous entry are not recorded
+ */
+void recordHistory() {
+    if(!ctx->history_enabled) return;
+    int length = ctx->cmdline_size;
+    while(length > 0 && (ctx->cmdline[length - 1] == '\n' || ctx->cmdline[length - 1] == ' ')) length --;
+    int blank = 1;
+    for(int i = 0; i < length; i ++) if(ctx->cmdline[i] != ' ') {blank = 0; break;}
+    if(blank) return;
+    unsigned int last_length;
+    const char *last = history_last(&ctx->hist, &last_length);
+    if(last != NULL && last_length == length && memcmp(last, ctx->cmdline, length) == 0) return;
+    history_append(&ctx->hist, ctx->cmdline, length);
+}
+
+/*
+ * Implements the history builtin
+ * history           lists every entry
+ * history N         lists the newest N entries
+ * history -p text   lists entries starting with text
+ * history -s text   lists entries containing text
+ * history -c        compacts the history file
+ */
+void historyCommand(array_list *al) {
+    if(!openHistory()) {fprintf(ctx->err, "error: history is not available\n"); ctx->exit_status = 0; return;}
+    int length = get_length(al);
+    if(length == 1) {history_list(&ctx->hist, "", HISTORY_ALL, 0, printHistoryEntry); return;}
+    if(length == 2 && strcmp(al->data[1], "-c") == 0) {
+        if(!history_compact(&ctx->hist, HISTORY_KEEP)) {fprintf(ctx->err, "error: could not compact history\n"); ctx->exit_status = 0;}
+        return;
+    }
+    if(length == 3 && (strcmp(al->data[1], "-p") == 0 || strcmp(al->data[1], "-s") == 0)) {
+        int mode = al->data[1][1] == 'p' ? HISTORY_PREFIX : HISTORY_SUBSTRING;
+        if(history_list(&ctx->hist, al->data[2], mode, 0, printHistoryEntry) == 0) ctx->exit_status = 0;
+        return;
+    }
+    if(length == 2 && atoi(al->data[1]) > 0) {history_list(&ctx->hist, "", HISTORY_ALL, atoi(al->data[1]), printHistoryEntry); return;}
+    fprintf(ctx->err, "error: usage: history [N | -p prefix | -s text | -c]\n");
+    ctx->exit_status = 0;
+}
+
+/*
+ * Prints a single numbered history entry, used as the history_list() callback
+ */
+void printHistoryEntry(unsigned int number, const char *text, unsigned int length) {
+    fprintf(ctx->out, "%5u  %.*s\n", number, (int)length, text);
+}
+
+/*
+ * Takes a pointer to the raw (still escaped) text of a token and its length
+ * Returns 1 if the token contains an unescaped variable reference ($NAME, ${NAME}, $?, $$)
+ * or command substitution ($(command) or `command`), 0 otherwise
+ */
+int containsExpansion(char *src, int size) {
+    for(int i = 0; i < size; i ++) {
+        if(src[i] == '\\') {i ++; continue;}
+        if(src[i] == '`') return 1;
+        if(src[i] != '$' || i + 1 == size) continue;
+        char next = src[i + 1];
+        if(next == '(' || next == '{' || next == '?' || next == '$' || next == '_' || (next >= 'A' && next <= 'Z') || (next >= 'a' && next <= 'z')) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Takes a pointer to a token and the index of the "(" of a "$(" or of an opening "`"
+ * Returns the index of the matching ")" or "`", or -1 if the substitution is not terminated
+ */
+int findSubstitutionEnd(char *src, int index) {
+    if(src[index] == '`') {
+        char *close = strchr(src + index + 1, '`');
+        return close == NULL ? -1 : close - src;
+    }
+    int depth = 1;
+    for(int i = index + 1; src[i] != '\0'; i ++) {
+        if(src[i] == '(') depth ++;
+        else if(src[i] == ')' && --depth == 0) return i;
+    }
+    return -1;
+}
+
+/*
+ * Takes a pointer to a token containing variable references and/or command substitutions, and a pointer to store the result length
+ * Expansion is done in two passes, the first measures the result (running each substitution once) so it is built in a single allocation.
+ * Unset variables expand to nothing, a "$" not followed by a name is kept as is.
+ * Output of command substitutions has trailing newlines removed and is split into fields at whitespace,
+ * fields are separated by '\0' in the result and may be empty
+ * Returns the new fields, which the caller frees
+ */
+char* expandToken(char *cmdstring, int *length) {
+    char number[16];
+    int total = 0, captures = 0;
+    char **outputs = NULL;
+    int *output_sizes = NULL;
+    char *expanded = NULL;
+    for(int pass = 0; pass < 2; pass ++) {
+        int n = 0, capture = 0;
+        for(int i = 0; cmdstring[i] != '\0'; i ++) {
+            const char *value = NULL;
+            int value_length = 0, split = 0;
+            //an escaped character is kept as it is, an escaped newline is removed
+            if(cmdstring[i] == '\\' && cmdstring[i + 1] != '\0') {
+                i ++;
+                if(pass == 1 && cmdstring[i] != '\n') expanded[n] = cmdstring[i];
+                if(cmdstring[i] != '\n') n ++;
+                continue;
+            }
+            int substitution = cmdstring[i] == '`' ? i : (cmdstring[i] == '$' && cmdstring[i + 1] == '(') ? i + 1 : -1;
+            int close = substitution == -1 ? -1 : findSubstitutionEnd(cmdstring, substitution);
+            if(close != -1) {
+                if(pass == 0) {
+                    outputs = realloc(outputs, sizeof(char *) * (captures + 1));
+                    output_sizes = realloc(output_sizes, sizeof(int) * (captures + 1));
+                    outputs[captures] = captureOutput(cmdstring + substitution + 1, close - substitution - 1, &output_sizes[captures]);
+                    captures ++;
+                }
+                value = outputs[capture];
+                value_length = output_sizes[capture ++];
+                split = 1;
+                i = close;
+            }
+            else if(cmdstring[i] == '$' && (cmdstring[i + 1] == '?' || cmdstring[i + 1] == '$')) {
+                value_length = snprintf(number, sizeof(number), "%d", cmdstring[i + 1] == '?' ? ctx->last_status : (int)getpid());
+                value = number;
+                i ++;
+            }
+            else if(cmdstring[i] == '$' && cmdstring[i + 1] == '{' && strchr(cmdstring + i, '}') != NULL) {
+                int name_length = strchr(cmdstring + i, '}') - (cmdstring + i + 2);
+                var_entry *entry = vars_lookup(&ctx->vars, cmdstring + i + 2, name_length);
+                value = entry == NULL ? "" : entry->value;
+                value_length = strlen(value);
+                i += name_length + 2;
+            }
+            else if(cmdstring[i] == '$' && isName(cmdstring + i + 1, 1)) {
+                int name_length = 1;
+                while(isName(cmdstring + i + 1, name_length + 1)) name_length ++;
+                var_entry *entry = vars_lookup(&ctx->vars, cmdstring + i + 1, name_length);
+                value = entry == NULL ? "" : entry->value;
+                value_length = strlen(value);
+                i += name_length;
+            }
+            else {
+                value = cmdstring + i;
+                value_length = 1;
+            }
+            if(pass == 1) {
+                memcpy(expanded + n, value, value_length);
+                for(int j = n; split && j < n + value_length; j ++) {
+                    if(expanded[j] == ' ' || expanded[j] == '\t' || expanded[j] == '\n') expanded[j] = '\0';
+                }
+            }
+            n += value_length;
+        }
+        if(pass == 0) {
+            total = n;
+            expanded = malloc(total + 1);
+        }
+    }
+    expanded[total] = '\0';
+    for(int i = 0; i < captures; i ++) free(outputs[i]);
+    free(outputs);
+    free(output_sizes);
+    *length = total + 1;
+    return expanded;
+}
+
+/*
+ * Takes a pointer to a command (not NUL terminated) and its length, and a pointer to store the output size
+ * Runs the command in a forked copy of the shell with stdout connected to a pipe, and reads everything it writes
+ * into a buffer that doubles in size, so large outputs are captured with few large reads.
+ * The pipe is enlarged when possible so the child blocks less often.
+ * Trailing newlines are removed and $? is set to the command's exit status
+ * Returns the captured output, which the caller frees, empty if the command could not be started
+ */
+char* captureOutput(char *command, int length, int *size) {
+    unsigned long long started = monotonicNs();
+    int fds[2];
+    *size = 0;
+    if(pipe2(fds, O_CLOEXEC) == -1) {printError("pipe"); ctx->exit_status = 0; return calloc(1, 1);}
+    fcntl(fds[0], F_SETPIPE_SZ, CAPTURE_PIPE_SIZE);
+    fflush(ctx->out);
+    int process = fork();
+    if(process == -1) {printError("fork"); close(fds[0]); close(fds[1]); ctx->exit_status = 0; return calloc(1, 1);}
+    if(process == 0) {
+        //children started by the zygote belong to the process that started it, so this copy forks for itself
+        ctx->zyg.sock = -1;
+        ctx->owns_process = 1;
+        childJob();
+        dup2(fds[1], ctx->fds[1]);
+        char *text = malloc(length + 1);
+        memcpy(text, command, length);
+        text[length] = '\n';
+        ctx->fin = -1;
+        ctx->start = 0;
+        ctx->end = 0;
+        ctx->special_handling = 0;
+        ctx->special_handling_index = 512;
+        ctx->cmdline_size = length + 1;
+        ctx->exec_last = 1;
+        interpret(text, &ctx->al, &ctx->wildcard_al);
+        fflush(ctx->out);
+        _exit(ctx->last_status);
+    }
+    close(fds[1]);
+    int capacity = CAPTURE_CHUNK;
+    char *output = malloc(capacity);
+    ssize_t bytes_read;
+    while((bytes_read = read(fds[0], output + *size, capacity - *size)) > 0) {
+        *size += bytes_read;
+        if(*size == capacity) {
+            capacity *= 2;
+            output = realloc(output, capacity);
+        }
+    }
+    close(fds[0]);
+    int wstatus;
+    if(waitpid(process, &wstatus, 0) != -1) ctx->last_status = waitStatus(wstatus);
+    while(*size > 0 && output[*size - 1] == '\n') (*size) --;
+    unsigned long long elapsed = monotonicNs() - started;
+    ctx->stats.captures ++;
+    ctx->stats.capture_bytes += *size;
+    ctx->stats.capture_ns += elapsed;
+    if(elapsed > ctx->stats.capture_max_ns) ctx->stats.capture_max_ns = elapsed;
+    if(trace_enabled) {
+        char text[81];
+        snprintf(text, sizeof(text), "%.*s", length, command);
+        trace_span("substitution", 0, started, started + elapsed, text);
+    }
+    return output;
+}
+
+/*
+ * Takes pointers to the command arraylist, the wildcard arraylist and a fully expanded token
+ * Pushes the token, or the matches of its wildcard expansion, onto the command arraylist
+ */
+void pushToken(array_list *al, array_list *wildcard_al, char *token) {
+    if(containsWildcard(token)){
+        unsigned long long started = trace_enabled ? monotonicNs() : 0;
+        int matched = processWildcard(wildcard_al, token);
+        if(trace_enabled) trace_span("processWildcard", 0, started, monotonicNs(), token);
+        if(matched){
+            for(int j = 0; j < get_length(wildcard_al); j ++){
+                push(al, wildcard_al->data[j]);
+            }
+            destroy(wildcard_al);
+        }
+        else{
+            destroy(wildcard_al);
+            push(al, token);
+        }
+    }
+    else{
+        push(al, token);
+    }
+}
+
+/*
+ * Returns the value of CLOCK_MONOTONIC in nanoseconds
+ */
+unsigned long long monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Implements the stats builtin, printing counters collected by the shell
+ */
+void statsCommand() {
+    fprintf(ctx->out, "command substitutions: %lu\n", ctx->stats.captures);
+    fprintf(ctx->out, "  captured bytes: %llu\n", ctx->stats.capture_bytes);
+    fprintf(ctx->out, "  total latency: %.3f ms\n", ctx->stats.capture_ns / 1e6);
+    fprintf(ctx->out, "  mean latency: %.3f ms\n", ctx->stats.captures ? ctx->stats.capture_ns / 1e6 / ctx->stats.captures : 0.0);
+    fprintf(ctx->out, "  max latency: %.3f ms\n", ctx->stats.capture_max_ns / 1e6);
+    unsigned long samples = ctx->stats.spawns < SPAWN_SAMPLES ? ctx->stats.spawns : SPAWN_SAMPLES;
+    unsigned long long sorted[SPAWN_SAMPLES];
+    memcpy(sorted, ctx->stats.spawn_ns, sizeof(unsigned long long) * samples);
+    qsort(sorted, samples, sizeof(unsigned long long), compareNs);
+    fprintf(ctx->out, "command spawns: %lu (%lu through the zygote)\n", ctx->stats.spawns, ctx->stats.zygote_spawns);
+    fprintf(ctx->out, "  p50 latency: %.3f ms\n", samples ? sorted[(samples - 1) / 2] / 1e6 : 0.0);
+    fprintf(ctx->out, "  p99 latency: %.3f ms\n", samples ? sorted[(samples - 1) * 99 / 100] / 1e6 : 0.0);
+    fprintf(ctx->out, "  max latency: %.3f ms\n", samples ? sorted[samples - 1] / 1e6 : 0.0);
+    fprintf(ctx->out, "memo: %lu hits, %lu misses, %lu evictions\n", ctx->stats.memo_hits, ctx->stats.memo_misses, ctx->stats.memo_evictions);
+}
+
+/*
+ * Records how long starting a command took (fork, or the round trip to the zygote), keeping the latest SPAWN_SAMPLES
+ */
+void recordSpawn(unsigned long long elapsed) {
+    ctx->stats.spawn_ns[ctx->stats.spawns % SPAWN_SAMPLES] = elapsed;
+    ctx->stats.spawns ++;
+}
+
+/*
+ * qsort() comparison of two nanosecond counts
+ */
+int compareNs(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Takes a pointer to a string and the number of characters to check
+ * Returns 1 if those characters form a valid variable name (letters, digits and '_', not starting with a digit), 0 otherwise
+ */
+int isName(char *name, int length) {
+    if(length == 0 || (name[0] >= '0' && name[0] <= '9')) return 0;
+    for(int i = 0; i < length; i ++) {
+        if(!(name[i] == '_' || (name[i] >= 'A' && name[i] <= 'Z') || (name[i] >= 'a' && name[i] <= 'z') || (name[i] >= '0' && name[i] <= '9'))) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Takes a pointer to a token
+ * Returns 1 if the token has the form NAME=value with a valid variable name, 0 otherwise
+ */
+int isAssignment(char *token) {
+    char *equals = strchr(token, '=');
+    return equals != NULL && isName(token, equals - token);
+}
+
+/*
+ * Sets shell variables when every token of the command is a NAME=value assignment
+ * Returns 1 if the command was made only of assignments, 0 if it should be run as a normal command
+ */
+int assignVariables(array_list *al) {
+    for(int i = 0; i < get_length(al); i ++) {
+        if(!isAssignment(al->data[i])) return 0;
+    }
+    for(int i = 0; i < get_length(al); i ++) {
+        char *equals = strchr(al->data[i], '=');
+        *equals = '\0';
+        vars_set(&ctx->vars, al->data[i], equals + 1, 0);
+        *equals = '=';
+    }
+    ctx->home_path = vars_get(&ctx->vars, "HOME");
+    return 1;
+}
+
+/*
+ * Implements the export builtin
+ * "export NAME=value" sets and exports, "export NAME" exports an existing variable, "export" lists exported variables
+ */
+void exportCommand(array_list *al) {
+    if(get_length(al) == 1) {
+        char **envp = vars_environ(&ctx->vars);
+        for(int i = 0; envp[i] != NULL; i ++) fprintf(ctx->out, "export %s\n", envp[i]);
+        return;
+    }
+    for(int i = 1; i < get_length(al); i ++) {
+        char *equals = strchr(al->data[i], '=');
+        if(isAssignment(al->data[i])) {
+            *equals = '\0';
+            vars_set(&ctx->vars, al->data[i], equals + 1, VAR_EXPORT);
+            *equals = '=';
+        }
+        else if(equals == NULL && isName(al->data[i], strlen(al->data[i]))) {
+            vars_set(&ctx->vars, al->data[i], NULL, VAR_EXPORT);
+        }
+        else {
+            fprintf(ctx->err, "error: export: invalid variable name: %s\n", al->data[i]);
+            ctx->exit_status = 0;
+        }
+    }
+    ctx->home_path = vars_get(&ctx->vars, "HOME");
+}
+
+/*
+ * Implements the unset builtin, removing each named variable
+ */
+void unsetCommand(array_list *al) {
+    for(int i = 1; i < get_length(al); i ++) {
+        vars_unset(&ctx->vars, al->data[i]);
+    }
+    ctx->home_path = vars_get(&ctx->vars, "HOME");
+}
+
+/*
+ * Implements the ulimit builtin: "ulimit -t 30" sets the cpu time limit of the commands started afterwards, "ulimit -t" prints it
+ * and "ulimit" or "ulimit -a" prints every limit. Options: -t cpu seconds, -v address space and -c core size in kbytes,
+ * -n open files, -u processes. The limits are kept by the shell and installed in each child, the shell's own limits do not change
+ */
+void ulimitCommand(array_list *al) {
+    if(get_length(al) == 1) {limits_print(&ctx->child_limits, 'a', ctx->out, ctx->err); return;}
+    for(int i = 1; i < get_length(al); i ++) {
+        char *option = al->data[i];
+        if(option[0] != '-' || option[1] == '\0' || option[2] != '\0') {
+            fprintf(ctx->err, "error: ulimit: invalid option: %s\n", option);
+            ctx->exit_status = 0;
+            return;
+        }
+        if(option[1] != 'a' && i + 1 < get_length(al) && al->data[i + 1][0] != '-') {
+            if(!limits_option(&ctx->child_limits, option[1], al->data[++ i], ctx->err)) {ctx->exit_status = 0; return;}
+        }
+        else limits_print(&ctx->child_limits, option[1], ctx->out, ctx->err);
+    }
+}
+
+/*
+ * Implements the limit prefix, "limit mem=2G cpu=30 cmd args..." runs cmd with these limits added to the ones from ulimit
+ * Names: cpu (seconds), mem (address space), core (bytes, with an optional K, M, G or T suffix), files, procs
+ */
+void limitCommand(array_list *al) {
+    limit_set saved = ctx->child_limits;
+    unsigned int i = 1;
+    for(; i < get_length(al) && strchr(al->data[i], '=') != NULL; i ++) {
+        if(!limits_parse(&ctx->child_limits, al->data[i], ctx->err)) {ctx->child_limits = saved; ctx->exit_status = 0; return;}
+    }
+    if(i == get_length(al)) {
+        fprintf(ctx->err, "error: limit: missing command\n");
+        ctx->child_limits = saved;
+        ctx->exit_status = 0;
+        return;
+    }
+    //the rest of the arguments are run as a command of their own
+    array_list command = {al->size - i, al->capacity - i, al->data + i};
+    processInput(&command);
+    ctx->child_limits = saved;
+}
+
+/*
+ * Implements the pin prefix, "pin 0-3 nice=10 cmd args..." runs cmd on cpus 0 to 3 with a nice value of 10.
+ * Settings: a cpu list, auto (each stage of a pipeline on its own cpu of the NUMA node the shell runs on), nice=N,
+ * ioprio=rt|be|idle[:level] and sched=batch|idle|other. They are installed in the child after fork (see pin.c)
+ */
+void pinCommand(array_list *al) {
+    pin_settings saved = ctx->child_pin;
+    unsigned int i = 1;
+    for(; i < get_length(al) && (strchr(al->data[i], '=') != NULL || (al->data[i][0] >= '0' && al->data[i][0] <= '9') || strcmp(al->data[i], "auto") == 0); i ++) {
+        if(!pin_parse(&ctx->child_pin, al->data[i], ctx->err)) {ctx->child_pin = saved; ctx->exit_status = 0; return;}
+    }
+    if(i == 1 || i == get_length(al)) {
+        fprintf(ctx->err, i == 1 ? "error: pin: missing settings\n" : "error: pin: missing command\n");
+        ctx->child_pin = saved;
+        ctx->exit_status = 0;
+        return;
+    }
+    array_list command = {al->size - i, al->capacity - i, al->data + i};
+    processInput(&command);
+    ctx->child_pin = saved;
+}
+
+/*
+ * Implements the exec builtin, "exec cmd args < in > out" replaces the shell with the command (see execInPlace()),
+ * while "exec > file" or "exec < file", with only redirections, moves the shell's own stdout or stdin to the file for good
+ */
+void execCommand(array_list *al) {
+    unsigned int argc = get_length(al);
+    if(argc == 1) return;
+    if(strcmp(al->data[1], "<") != 0 && strcmp(al->data[1], ">") != 0) {
+        array_list command = {al->size - 1, al->capacity - 1, al->data + 1};
+        //an embedded context cannot replace the program, it runs the command as a child and ends its input instead
+        ctx->exec_in_place = ctx->owns_process;
+        processInput(&command);
+        ctx->exec_in_place = 0;
+        if(!ctx->owns_process) ctx->exited = 1;
+        return;
+    }
+    for(unsigned int i = 1; i < argc; i += 2) {
+        int output = strcmp(al->data[i], ">") == 0;
+        if(!output && strcmp(al->data[i], "<") != 0) {fprintf(ctx->err, "error: exec: the command must come before the redirections\n"); ctx->exit_status = 0; return;}
+        if(i + 1 == argc) {fprintf(ctx->err, "error: missing file name after %s\n", al->data[i]); ctx->exit_status = 0; return;}
+        int fd = output ? open(al->data[i + 1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640) : open(al->data[i + 1], O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {printError(al->data[i + 1]); ctx->exit_status = 0; return;}
+        if(output) fflush(ctx->out);
+        redirectContext(fd, output ? ctx->fds[1] : ctx->fds[0]);
+        close(fd);
+    }
+}
+
+/*
+ * Implements the memo prefix, "memo cmd args < in > out" runs the command once and replays its result afterwards as long as
+ * the words, the working directory, the program and the files named in the words are unchanged (see memo.c).
+ * A hit copies the cached output files and standard output and sets $? without running anything. A miss runs the command
+ * with its standard output going to the new entry, copies it to stdout when the command is done, and stores the entry
+ * unless the shell failed to run the command or it was killed by a signal. Standard error is not cached.
+ * Builtins that change the shell itself (cd, export, assignments...) are refused, a hit would skip the change
+ */
+void memoCommand(array_list *al) {
+    static const char *stateful[] = {"cd", "export", "unset", "exit", "exec", "ulimit", "pin", "limit", "history", "break", "continue",
+                                     "if", "then", "elif", "else", "fi", "while", "for", "do", "done", NULL};
+    if(get_length(al) < 2) {fprintf(ctx->err, "error: memo: missing command\n"); ctx->exit_status = 0; return;}
+    array_list command = {al->size - 1, al->capacity - 1, al->data + 1};
+    for(int i = 0; stateful[i] != NULL || isAssignment(command.data[0]); i ++) {
+        if(stateful[i] == NULL || strcmp(command.data[0], stateful[i]) == 0) {
+            fprintf(ctx->err, "error: memo: %s changes the shell and cannot be cached\n", command.data[0]);
+            ctx->exit_status = 0;
+            return;
+        }
+    }
+    unsigned int words = get_length(&command);
+    //builtins have no program file to identify
+    char *path = isBuiltinStage(command.data, words) ? NULL : resolveCommand(command.data[0]);
+    //the cache location and size come from the shell's variables, an export does not reach this process's environment
+    const char *max = vars_get(&ctx->vars, "MYSH_MEMO_MAX");
+    unsigned long long max_size = max != NULL && max[0] >= '0' && max[0] <= '9' ? strtoull(max, NULL, 10) : 0;
+    memo_entry entry;
+    int cached = memo_open(&entry, vars_get(&ctx->vars, "XDG_CACHE_HOME"), vars_get(&ctx->vars, "HOME"), max_size, command.data, words, path), status;
+    free(path);
+    if(cached && memo_replay(&entry, &status, ctx->fds[1], ctx->err)) {
+        ctx->stats.memo_hits ++;
+        ctx->last_status = status;
+        memo_close(&entry);
+        return;
+    }
+    if(!cached || !memo_begin(&entry, ctx->err)) {
+        if(!cached) fprintf(ctx->err, "error: memo: no cache directory\n");
+        else memo_close(&entry);
+        processInput(&command);
+        return;
+    }
+    ctx->stats.memo_misses ++;
+    //the shell stores the result once the command is done, so it must not replace itself
+    ctx->exec_in_place = 0;
+    fflush(ctx->out);
+    int saved = fcntl(ctx->fds[1], F_DUPFD_CLOEXEC, 0);
+    redirectContext(entry.out, ctx->fds[1]);
+    processInput(&command);
+    fflush(ctx->out);
+    redirectContext(saved, ctx->fds[1]);
+    close(saved);
+    if(lseek(entry.out, 0, SEEK_SET) == -1 || !copy_fd(entry.out, ctx->fds[1])) printError("memo");
+    if(ctx->exit_status && ctx->last_status < 128) {
+        char *outputs[words];
+        int output_count = 0;
+        for(unsigned int i = 0; i + 1 < words; i ++) {
+            if(strcmp(command.data[i], ">") == 0) outputs[output_count ++] = command.data[++ i];
+        }
+        if(!memo_commit(&entry, ctx->last_status, outputs, output_count, &ctx->stats.memo_evictions)) printError("memo");
+    }
+    memo_close(&entry);
+}
+
+/*
+ * Implements the watch builtin, "watch [-d ms] [-n runs] paths -- cmd args" runs the command, then again each time one of the
+ * paths (files or directories, usually from a wildcard) changes, until Ctrl-C or until it has run -n times.
+ * The paths are watched with inotify (see watch.c) and the shell sleeps in poll() between changes. A burst of events is
+ * debounced: the command runs once nothing has changed for -d milliseconds (WATCH_DEBOUNCE_MS by default).
+ * Each run is a forked copy of the shell in its own process group, so a run still going when a change comes in
+ * is stopped as a whole with SIGTERM to the group. The end of a run is seen through its pidfd, so children of other contexts
+ * are left to them, and Ctrl-C through a signalfd like the server does.
+ */
+void watchCommand(array_list *al) {
+    unsigned int i = 1, argc = get_length(al);
+    long debounce = WATCH_DEBOUNCE_MS, max_runs = 0;
+    for(; i + 1 < argc && (strcmp(al->data[i], "-d") == 0 || strcmp(al->data[i], "-n") == 0); i += 2) {
+        char *end;
+        long value = strtol(al->data[i + 1], &end, 10);
+        if(*end != '\0' || value < 0 || (value == 0 && al->data[i][1] == 'n')) {
+            fprintf(ctx->err, "error: watch: invalid value: %s\n", al->data[i + 1]);
+            ctx->exit_status = 0;
+            return;
+        }
+        if(al->data[i][1] == 'd') debounce = value;
+        else max_runs = value;
+    }
+    unsigned int separator = i;
+    while(separator < argc && strcmp(al->data[separator], "--") != 0) separator ++;
+    if(separator == i || separator + 1 >= argc) {
+        if(separator == i) fprintf(ctx->err, "error: watch: missing paths\n");
+        else fprintf(ctx->err, separator == argc ? "error: watch: missing -- before the command\n" : "error: watch: missing command after --\n");
+        ctx->exit_status = 0;
+        return;
+    }
+    watch_set w;
+    if(!watch_open(&w, al->data + i, separator - i, ctx->err)) {ctx->exit_status = 0; return;}
+    array_list command = {al->size - separator - 1, al->capacity - separator - 1, al->data + separator + 1};
+    sigset_t mask, saved_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &saved_mask);
+    int signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(signals == -1) {printError("signalfd"); pthread_sigmask(SIG_SETMASK, &saved_mask, NULL); watch_close(&w); ctx->exit_status = 0; return;}
+    pid_t running = -1;
+    int run_fd = -1;
+    long runs = 0;
+    int pending = 1, stop = 0;
+    unsigned long long due = 0;
+    while(!stop) {
+        unsigned long long now = monotonicNs();
+        if(pending && now >= due && (max_runs == 0 || runs < max_runs)) {
+            if(running != -1) {
+                kill(-running, SIGTERM);
+                waitpid(running, NULL, 0);
+                if(run_fd != -1) close(run_fd);
+                fprintf(ctx->err, "watch: changed, restarting\n");
+            }
+            watch_refresh(&w);
+            running = watchRun(&command, &saved_mask);
+            run_fd = running != -1 ? pidfdOpen(running) : -1;
+            if(running != -1) runs ++;
+            pending = 0;
+        }
+        if(running == -1 && max_runs != 0 && runs >= max_runs) break;
+        //sleeps until a change, the end of the run or Ctrl-C, with a timeout only while a change is being debounced
+        int timeout = pending && (max_runs == 0 || runs < max_runs) ? (int)((due > now ? due - now : 0) / 1000000) + 1 : -1;
+        //without a pidfd (kernels before 5.3) the run is checked for every 100 ms
+        if(running != -1 && run_fd == -1 && (timeout == -1 || timeout > 100)) timeout = 100;
+        struct pollfd fds[3] = {{w.fd, POLLIN, 0}, {signals, POLLIN, 0}, {running != -1 ? run_fd : -1, POLLIN, 0}};
+        if(poll(fds, 3, timeout) == -1) {
+            if(errno == EINTR) continue;
+            printError("poll");
+            break;
+        }
+        if(fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while(read(signals, &info, sizeof(info)) == sizeof(info)) {
+                if(info.ssi_signo == SIGINT) stop = 1;
+            }
+        }
+        int wstatus;
+        if(running != -1 && (run_fd == -1 || (fds[2].revents & POLLIN)) && waitpid(running, &wstatus, WNOHANG) == running) {
+            ctx->last_status = waitStatus(wstatus);
+            if(ctx->last_status != 0) fprintf(ctx->err, "watch: status %d\n", ctx->last_status);
+            running = -1;
+            if(run_fd != -1) close(run_fd);
+            run_fd = -1;
+        }
+        if((fds[0].revents & POLLIN) && watch_read(&w) > 0) {
+            pending = 1;
+            due = monotonicNs() + debounce * 1000000ULL;
+        }
+    }
+    if(running != -1) {
+        kill(-running, SIGTERM);
+        waitpid(running, NULL, 0);
+    }
+    if(run_fd != -1) close(run_fd);
+    if(stop) ctx->last_status = 128 + SIGINT;
+    close(signals);
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    watch_close(&w);
+}
+
+/*
+ * Starts one run of watch: a forked copy of the shell in a process group of its own, with the signal mask the shell had
+ * before watch and stdin from /dev/null since it runs in the background of the terminal, which runs the command
+ * Returns the pid of the copy, which is also its process group, or -1 if it could not be started
+ */
+pid_t watchRun(array_list *command, sigset_t *mask) {
+    fflush(ctx->out);
+    pid_t process = fork();
+    if(process == -1) {printError("fork"); return -1;}
+    if(process == 0) {
+        childJob();
+        setpgid(0, 0);
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        //children started by the zygote would not be in the group
+        ctx->zyg.sock = -1;
+        int null = open("/dev/null", O_RDONLY);
+        if(null != -1 && null != ctx->fds[0]) {dup2(null, ctx->fds[0]); close(null);}
+        processInput(command);
+        fflush(ctx->out);
+        _exit(ctx->exit_status ? ctx->last_status : 1);
+    }
+    setpgid(process, process);
+    return process;
+}
+
+/*
+ * Returns 1 if children get settings installed after fork (resource limits or pin settings),
+ * they must then be forked by the shell rather than started by the zygote or run inside the shell
+ */
+int childSettings() {
+    return limits_any(&ctx->child_limits) || pin_any(&ctx->child_pin);
+}
+
+/*
+ * Implements the timeout builtin, "timeout [-k grace] duration cmd args" runs the command and stops it once the duration has
+ * passed: SIGTERM to its process group, then SIGKILL if it is still running after the grace period (TIMEOUT_GRACE_MS by default,
+ * "-k 0" never sends it). A duration of 0 never times out. The shell sleeps in poll() on the pidfd of the command and a timerfd,
+ * armed again for the grace period after SIGTERM. SIGINT, SIGTERM and SIGHUP sent to the shell meanwhile are passed on to the
+ * command through a signalfd. $? is TIMEOUT_STATUS if the command timed out, its own status otherwise
+ */
+void timeoutCommand(array_list *al) {
+    unsigned int i = 1, argc = get_length(al);
+    long long grace = TIMEOUT_GRACE_MS * 1000000LL, duration;
+    if(i + 1 < argc && strcmp(al->data[i], "-k") == 0) {
+        if(!parseDuration(al->data[i + 1], &grace)) {fprintf(ctx->err, "error: timeout: invalid duration: %s\n", al->data[i + 1]); ctx->exit_status = 0; return;}
+        i += 2;
+    }
+    if(i + 1 >= argc) {
+        fprintf(ctx->err, i == argc ? "error: timeout: missing duration\n" : "error: timeout: missing command\n");
+        ctx->exit_status = 0;
+        return;
+    }
+    if(!parseDuration(al->data[i], &duration)) {fprintf(ctx->err, "error: timeout: invalid duration: %s\n", al->data[i]); ctx->exit_status = 0; return;}
+    array_list command = {al->size - i - 1, al->capacity - i - 1, al->data + i + 1};
+    sigset_t mask, saved_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &saved_mask);
+    int signals = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(signals == -1 || timer == -1) printError(signals == -1 ? "signalfd" : "timerfd");
+    pid_t process = signals != -1 && timer != -1 ? timeoutRun(&command, &saved_mask) : -1;
+    if(process == -1) {
+        if(signals != -1) close(signals);
+        if(timer != -1) close(timer);
+        pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+        ctx->exit_status = 0;
+        return;
+    }
+    int process_fd = pidfdOpen(process), sent = 0, forwarded = 0, wstatus = 0;
+    struct itimerspec expiry = {{0, 0}, {duration / 1000000000, duration % 1000000000}};
+    timerfd_settime(timer, 0, &expiry, NULL);
+    for(;;) {
+        //without a pidfd (kernels before 5.3) the command is checked for every 100 ms
+        struct pollfd fds[3] = {{process_fd, POLLIN, 0}, {timer, POLLIN, 0}, {signals, POLLIN, 0}};
+        if(poll(fds, 3, process_fd == -1 ? 100 : -1) == -1 && errno != EINTR) {
+            printError("poll");
+            kill(-process, SIGKILL);
+            waitpid(process, &wstatus, 0);
+            break;
+        }
+        uint64_t expirations;
+        if((fds[1].revents & POLLIN) && read(timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            sent = sent == 0 ? SIGTERM : SIGKILL;
+            kill(-process, sent);
+            //the grace period after SIGTERM, after SIGKILL (or with -k 0) the timer stays disarmed
+            struct itimerspec grace_expiry = {{0, 0}, {0, 0}};
+            if(sent == SIGTERM) {grace_expiry.it_value.tv_sec = grace / 1000000000; grace_expiry.it_value.tv_nsec = grace % 1000000000;}
+            timerfd_settime(timer, 0, &grace_expiry, NULL);
+        }
+        if(fds[2].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while(read(signals, &info, sizeof(info)) == sizeof(info)) {
+                forwarded = info.ssi_signo;
+                kill(-process, forwarded);
+            }
+        }
+        if((process_fd == -1 || (fds[0].revents & POLLIN)) && waitpid(process, &wstatus, WNOHANG) == process) break;
+    }
+    if(process_fd != -1) close(process_fd);
+    close(timer);
+    close(signals);
+    if(ctx->job_control) tcsetpgrp(ctx->fds[0], getpgrp());
+    pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+    if(sent != 0) {
+        fprintf(ctx->err, "timeout: %s: timed out%s\n", command.data[0], sent == SIGKILL ? ", killed" : "");
+        ctx->last_status = TIMEOUT_STATUS;
+    }
+    else ctx->last_status = waitStatus(wstatus);
+    //a batch script ends on a signal meant for the shell, as it would if the command were not in a group of its own
+    if(forwarded != 0 && !ctx->job_control && ctx->owns_process) raise(forwarded);
+}
+
+/*
+ * Starts the command of timeout in a forked copy of the shell leading a process group of its own, so the whole command,
+ * pipelines included, gets the signals. With job control the group gets the terminal. The copy has the signal mask the
+ * shell had before timeout and replaces itself with a single program (see execInPlace())
+ * Returns the pid of the copy, which is also its process group, or -1 if it could not be started
+ */
+pid_t timeoutRun(array_list *command, sigset_t *mask) {
+    fflush(ctx->out);
+    pid_t process = fork();
+    if(process == -1) {printError("fork"); return -1;}
+    if(process == 0) {
+        setpgid(0, 0);
+        if(ctx->job_control) tcsetpgrp(ctx->fds[0], getpid());
+        childJob();
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        //children started by the zygote would be the shell's and not in the group
+        ctx->zyg.sock = -1;
+        ctx->owns_process = 1;
+        ctx->exec_in_place = 1;
+        processInput(command);
+        fflush(ctx->out);
+        _exit(ctx->exit_status ? ctx->last_status : 1);
+    }
+    setpgid(process, process);
+    if(ctx->job_control) tcsetpgrp(ctx->fds[0], process);
+    return process;
+}
+
+/*
+ * Takes a duration of timeout: seconds, with an optional fraction and an optional unit ms, s, m or h ("1.5", "500ms", "2m")
+ * Returns 1 and stores it in nanoseconds in ns, or 0 if it is not a valid duration
+ */
+int parseDuration(char *text, long long *ns) {
+    char *end;
+    errno = 0;
+    double value = strtod(text, &end), unit = 1e9;
+    if(strcmp(end, "ms") == 0) unit = 1e6;
+    else if(strcmp(end, "m") == 0) unit = 60e9;
+    else if(strcmp(end, "h") == 0) unit = 3600e9;
+    else if(*end != '\0' && strcmp(end, "s") != 0) return 0;
+    //also refuses nan, inf and negative values
+    if(end == text || errno != 0 || !(value >= 0) || value * unit > 1e18) return 0;
+    *ns = value * unit;
+    return 1;
+}
+
+/*
+ * Sets up job control for an interactive shell whose terminal has the shell in the foreground: the shell leads a process group
+ * of its own, and each foreground pipeline runs in another one that has the terminal while it runs (see execute()), so Ctrl-C
+ * and Ctrl-\ reach the command and not the shell. The shell ignores them, and SIGTTOU and SIGTTIN so it can take the terminal
+ * back from the background. Ctrl-Z (SIGTSTP) is ignored by the shell and its commands since there are no background jobs to
+ * resume a stopped one
+ */
+void startJobControl() {
+    if(!isatty(ctx->fds[0]) || tcgetpgrp(ctx->fds[0]) != getpgrp()) return;
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    if(getpgrp() != getpid()) setpgid(0, 0);
+    tcsetpgrp(ctx->fds[0], getpgrp());
+    ctx->job_control = 1;
+}
+
+/*
+ * In a child of a shell with job control, before anything else: joins the process group of the pipeline being started
+ * (see joinJob()), the first child takes the terminal itself so it cannot read it before it is in the foreground.
+ * Then gives back the default action of the signals the shell ignores, SIGTSTP excepted, and leaves job control to the shell
+ */
+void childJob() {
+    if(!ctx->job_control) return;
+    if(ctx->job_pgid != -1) {
+        setpgid(0, ctx->job_pgid);
+        if(ctx->job_pgid == 0) tcsetpgrp(ctx->fds[0], getpid());
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    ctx->job_control = 0;
+}
+
+/*
+ * In the shell, puts a child just started for the pipeline in its process group, the first child starts the group and
+ * gets the terminal. The child does the same (see childJob()), so the group is right whichever of the two runs first
+ */
+void joinJob(pid_t pid) {
+    if(ctx->job_pgid == -1) return;
+    if(ctx->job_pgid == 0) {
+        ctx->job_pgid = pid;
+        setpgid(pid, pid);
+        tcsetpgrp(ctx->fds[0], pid);
+    }
+    else setpgid(pid, ctx->job_pgid);
+}
+
+/*
+ * Implements the parallel builtin, "parallel [-j N] [-k] cmd args {} ::: items" runs cmd once per item with {} replaced by the
+ * item (or the item added as the last argument without {}), keeping N children running (the number of usable cpus by default).
+ * Items come from the words after ":::" (so the shell's wildcards apply), the lines of the file after "::::", or the lines of
+ * standard input. Items are read only when a child can be started, children are reaped in any order (see waitJobs()).
+ * With -k the output of each child goes to a memfd and is copied to standard output in the order of the items, and at most
+ * PARALLEL_WINDOW * N items are started past the oldest one still running. Failed items are listed at the end,
+ * $? is the number of failed items (101 for more than 100)
+ */
+void parallelCommand(array_list *al) {
+    unsigned int i = 1, argc = get_length(al);
+    long jobs = 0;
+    int keep_order = 0;
+    for(; i < argc && al->data[i][0] == '-' && al->data[i][1] != '\0'; i ++) {
+        if(strcmp(al->data[i], "-k") == 0) keep_order = 1;
+        else if(strcmp(al->data[i], "-j") == 0 && i + 1 < argc) {
+            char *end;
+            jobs = strtol(al->data[++ i], &end, 10);
+            if(*end != '\0' || jobs <= 0 || jobs > 4096) {fprintf(ctx->err, "error: parallel: invalid job count: %s\n", al->data[i]); ctx->exit_status = 0; return;}
+        }
+        else {fprintf(ctx->err, "error: parallel: invalid option: %s\n", al->data[i]); ctx->exit_status = 0; return;}
+    }
+    unsigned int command = i, command_argc = 0;
+    while(i < argc && strcmp(al->data[i], ":::") != 0 && strcmp(al->data[i], "::::") != 0) i ++;
+    command_argc = i - command;
+    if(command_argc == 0) {fprintf(ctx->err, "error: parallel: missing command\n"); ctx->exit_status = 0; return;}
+    FILE *source = NULL;
+    char **items = NULL;
+    int item_count = 0, next_item = 0;
+    if(i < argc && strcmp(al->data[i], ":::") == 0) {items = al->data + i + 1; item_count = argc - i - 1;}
+    else if(i < argc) {
+        if(i + 2 != argc) {fprintf(ctx->err, "error: parallel: :::: takes one file\n"); ctx->exit_status = 0; return;}
+        if((source = fopen(al->data[i + 1], "re")) == NULL) {printError(al->data[i + 1]); ctx->exit_status = 0; return;}
+    }
+    else {
+        //a copy of stdin, so closing the source leaves the shell's own
+        int fd = fcntl(ctx->fds[0], F_DUPFD_CLOEXEC, 0);
+        if(fd == -1 || (source = fdopen(fd, "r")) == NULL) {printError("parallel"); if(fd != -1) close(fd); ctx->exit_status = 0; return;}
+    }
+    char *path = resolveCommand(al->data[command]);
+    if(path == NULL) {
+        fprintf(ctx->err, "error: undefined command: %s\n", al->data[command]);
+        if(source != NULL) fclose(source);
+        ctx->exit_status = 0;
+        return;
+    }
+    if(jobs == 0) {
+        cpu_set_t cpus;
+        jobs = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : 1;
+    }
+    //children reading items from the shell's stdin must not take lines meant for the queue
+    int input = i == argc ? open("/dev/null", O_RDONLY | O_CLOEXEC) : ctx->fds[0];
+    if(input == -1) input = ctx->fds[0];
+    long window = keep_order ? jobs * PARALLEL_WINDOW : jobs;
+    parallel_job *slots = calloc(window, sizeof(parallel_job));
+    array_list failed;
+    init(&failed, 8);
+    unsigned long started = 0, printed = 0, total = 0;
+    long running = 0;
+    char *item = NULL;
+    fflush(ctx->out);
+    while(1) {
+        //start children while there is room in the queue and items are left
+        while(running < jobs && (!keep_order || started - printed < (unsigned long)window) && ctx->exit_status
+              && (item = parallelItem(source, items, item_count, &next_item)) != NULL) {
+            parallel_job *job = slots;
+            while(job->pid != 0) job ++;
+            unsigned long long job_started = trace_enabled ? monotonicNs() : 0;
+            char **args = parallelArguments(al->data + command, command_argc, path, item);
+            int output = ctx->fds[1];
+            if(keep_order && (output = memfd_create("parallel", MFD_CLOEXEC)) == -1) {printError("memfd_create"); output = ctx->fds[1];}
+            pid_t pid = spawnCommand(args, input, output);
+            free(args);
+            if(pid == -1) {
+                if(output != ctx->fds[1]) close(output);
+                free(item);
+                ctx->exit_status = 0;
+                break;
+            }
+            parallel_job started_job = {pid, started ++, item, output, pidfdOpen(pid), 0, job_started};
+            *job = started_job;
+            running ++;
+            total ++;
+        }
+        if(running == 0) break;
+        int wstatus;
+        pid_t pid = waitJobs(slots, window, &wstatus);
+        if(pid == -1 && errno == EINTR) continue;
+        if(pid == -1) {printError("waitpid"); break;}
+        parallel_job *job = NULL;
+        for(long j = 0; j < window && job == NULL; j ++) if(slots[j].pid == pid) job = &slots[j];
+        //another child of the shell, like an exited zygote
+        if(job == NULL) continue;
+        running --;
+        job->pid = -1;
+        if(job->pidfd != -1) close(job->pidfd);
+        job->status = waitStatus(wstatus);
+        //each slot of the queue is a track of its own
+        if(trace_enabled) trace_span(al->data[command], job - slots + 1, job->started_ns, monotonicNs(), job->item);
+        //finished items are reported in the order they were started, at once without -k
+        for(long j = 0; j < window; j ++) {
+            job = &slots[j];
+            if(job->pid != -1 || (keep_order && job->index != printed)) continue;
+            if(keep_order && job->output != ctx->fds[1]) {
+                if(lseek(job->output, 0, SEEK_SET) == -1 || !copy_fd(job->output, ctx->fds[1])) printError("parallel");
+                close(job->output);
+            }
+            if(job->status != 0) {
+                char report[64 + strlen(job->item)];
+                snprintf(report, sizeof(report), "%s (status %d)", job->item, job->status);
+                push(&failed, report);
+            }
+            free(job->item);
+            job->pid = 0;
+            printed ++;
+            j = -1;
+        }
+    }
+    if(item == NULL && source != NULL && ferror(source)) printError("parallel");
+    if(source != NULL) fclose(source);
+    if(input != ctx->fds[0]) close(input);
+    free(path);
+    free(slots);
+    if(get_length(&failed) > 0) {
+        fprintf(ctx->err, "parallel: %u of %lu items failed:\n", get_length(&failed), total);
+        for(unsigned int j = 0; j < get_length(&failed); j ++) fprintf(ctx->err, "    %s\n", failed.data[j]);
+    }
+    ctx->last_status = get_length(&failed) > 100 ? 101 : get_length(&failed);
+    destroy(&failed);
+}
+
+/*
+ * Waits for one of the running children of parallel and reaps it, the shell sleeps in poll() on their pidfds.
+ * Other children of the process, like those of another context, are left alone. Without pidfds any child is reaped with waitpid(-1)
+ * Returns the pid of the reaped child, or -1 with errno set (EINTR when nothing was reaped and it should be called again)
+ */
+pid_t waitJobs(parallel_job *slots, long window, int *wstatus) {
+    struct pollfd fds[window];
+    int count = 0;
+    for(long j = 0; j < window; j ++) {
+        if(slots[j].pid <= 0) continue;
+        if(slots[j].pidfd == -1) return waitpid(-1, wstatus, 0);
+        struct pollfd pfd = {slots[j].pidfd, POLLIN, 0};
+        fds[count ++] = pfd;
+    }
+    if(poll(fds, count, -1) == -1) return -1;
+    for(long j = 0; j < window; j ++) {
+        if(slots[j].pid <= 0) continue;
+        for(int k = 0; k < count; k ++) {
+            if(fds[k].fd != slots[j].pidfd || !(fds[k].revents & POLLIN)) continue;
+            pid_t pid = waitpid(slots[j].pid, wstatus, WNOHANG);
+            if(pid > 0) return pid;
+        }
+    }
+    errno = EINTR;
+    return -1;
+}
+
+/*
+ * Returns a pidfd of the child pid (see pidfd_open(2)), which becomes readable when it exits, or -1 if the kernel has none
+ */
+int pidfdOpen(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/*
+ * Returns the next item of the parallel builtin, the next of count words in items or the next line of source,
+ * or NULL when there are no more. The item is allocated and belongs to the caller
+ */
+char* parallelItem(FILE *source, char **items, int count, int *next) {
+    if(source == NULL) return *next < count ? strdup(items[(*next) ++]) : NULL;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while((length = getline(&line, &capacity, source)) != -1) {
+        if(length > 0 && line[length - 1] == '\n') line[-- length] = '\0';
+        if(length > 0) return line;
+    }
+    free(line);
+    return NULL;
+}
+
+/*
+ * Builds the arguments of one parallel child from the argc words of command: path first, then the words with every {}
+ * replaced by item, or followed by item if none of them has {}.
+ * The array is allocated as a single block with its strings and belongs to the caller
+ */
+char** parallelArguments(char **command, int argc, char *path, char *item) {
+    size_t item_length = strlen(item), size = (argc + 2) * sizeof(char *) + strlen(path) + item_length + 2;
+    int placeholders = 0;
+    for(int i = 1; i < argc; i ++) {
+        size += strlen(command[i]) + 1;
+        for(char *p = strstr(command[i], "{}"); p != NULL; p = strstr(p + 2, "{}")) {placeholders ++; size += item_length;}
+    }
+    char **args = malloc(size), *text = (char *)(args + argc + 2);
+    int count = 0;
+    args[count ++] = strcpy(text, path);
+    text += strlen(path) + 1;
+    for(int i = 1; i < argc; i ++) {
+        args[count ++] = text;
+        for(char *word = command[i], *p; ; word = p + 2) {
+            p = strstr(word, "{}");
+            size_t length = p == NULL ? strlen(word) : (size_t)(p - word);
+            memcpy(text, word, length);
+            text += length;
+            if(p == NULL) break;
+            memcpy(text, item, item_length);
+            text += item_length;
+        }
+        *text ++ = '\0';
+    }
+    if(placeholders == 0) args[count ++] = strcpy(text, item);
+    args[count] = NULL;
+    return args;
+}
+
+/*
+ * Makes context the one the calling thread works on, the previous one is saved in *saved for the caller to restore.
+ * The first time a thread enters an embedded context it gets a working directory of its own (unshare(CLONE_FS)),
+ * then the context's directory is installed, so cd in one context never moves another thread
+ * Returns 1 on success or 0 with an error printed
+ */
+int enterContext(mysh_ctx *context, mysh_ctx **saved){
+    static __thread int own_directory = 0;
+    *saved = ctx;
+    ctx = context;
+    if(context->cwd == -1) return 1;
+    if(!own_directory && unshare(CLONE_FS) == -1) {printError("unshare"); ctx = *saved; return 0;}
+    own_directory = 1;
+    if(fchdir(context->cwd) == -1) {printError("cd"); ctx = *saved; return 0;}
+    return 1;
+}
+
+/*
+ * Creates an embedded shell context (see mysh.h) with copies of in, out and err as its standard descriptors,
+ * starting in the working directory of the caller
+ * Returns the context, or NULL if the descriptors cannot be copied
+ */
+mysh_ctx *mysh_ctx_new(int in, int out, int err){
+    int fds[3] = {fcntl(in, F_DUPFD_CLOEXEC, 3), fcntl(out, F_DUPFD_CLOEXEC, 3), fcntl(err, F_DUPFD_CLOEXEC, 3)};
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(fds[0] == -1 || fds[1] == -1 || fds[2] == -1 || cwd == -1){
+        for(int i = 0; i < 3; i ++) if(fds[i] != -1) close(fds[i]);
+        if(cwd != -1) close(cwd);
+        return NULL;
+    }
+    mysh_ctx *saved = ctx;
+    mysh_ctx *context = newContext(fds[0], fds[1], fds[2]);
+    ctx = saved;
+    context->cwd = cwd;
+    return context;
+}
+
+void mysh_ctx_free(mysh_ctx *context){
+    if(context == NULL) return;
+    vars_destroy(&context->vars);
+    while(context->user_homes != NULL){
+        user_home *next = context->user_homes->next;
+        free(context->user_homes->name);
+        free(context->user_homes->dir);
+        free(context->user_homes);
+        context->user_homes = next;
+    }
+    if(context->history_enabled) history_close(&context->hist);
+    if(context->zyg.sock != -1) zygote_stop(&context->zyg);
+    fclose(context->out);
+    fclose(context->err);
+    close(context->fds[0]);
+    close(context->cwd);
+    free(context);
+}
+
+/*
+ * Runs a command line, which may hold several lines, in context like the -c option does
+ * Returns $? after the line, or -1 if the context's working directory cannot be installed
+ */
+int mysh_run_line(mysh_ctx *context, const char *line){
+    mysh_ctx *saved;
+    if(!enterContext(context, &saved)) return -1;
+    int length = strlen(line);
+    char *text = malloc(length + 1);
+    memcpy(text, line, length);
+    text[length] = '\n';
+    ctx->exited = 0;
+    ctx->fin = -1;
+    ctx->cmdline_size = length + 1;
+    interpret(text, &ctx->al, &ctx->wildcard_al);
+    free(text);
+    fflush(ctx->out);
+    int status = ctx->last_status;
+    ctx = saved;
+    return status;
+}
+
+/*
+ * Runs the batch script at path in context, through the compiled script cache
+ * Returns $? after the script, or -1 if it cannot be opened or the context's working directory cannot be installed
+ */
+int mysh_run_file(mysh_ctx *context, const char *path){
+    mysh_ctx *saved;
+    if(!enterContext(context, &saved)) return -1;
+    int status = -1;
+    ctx->exited = 0;
+    ctx->fin = open(path, O_RDONLY | O_CLOEXEC);
+    if(ctx->fin == -1) printError(path);
+    else{
+        runScriptFile((char *)path, 1);
+        close(ctx->fin);
+        status = ctx->last_status;
+    }
+    ctx->fin = -1;
+    fflush(ctx->out);
+    ctx = saved;
+    return status;
+}
+
+/*
+ * Splits a command line into its words like the shell does before running it (see compileScript()), without expanding anything.
+ * Words with a tilde prefix, variable or substitution keep their escapes, the others are unescaped.
+ * Operators are words of their own and the end of each command is a ";" word
+ * Returns a NULL terminated array of *count words, allocated as a single block that the caller frees,
+ * or NULL if a command substitution is left open
+ */
+char **mysh_tokenize(mysh_ctx *context, const char *line, int *count){
+    mysh_ctx *saved = ctx;
+    ctx = context;
+    int length = strlen(line);
+    char *text = malloc(length + 1);
+    memcpy(text, line, length + 1);
+    compiled_script script;
+    script_init(&script);
+    int compiled = compileScript(&script, text, length);
+    free(text);
+    ctx = saved;
+    *count = 0;
+    if(!compiled) {script_free(&script); return NULL;}
+    //each command ends with an empty WORD_END word, kept as ";" between two commands only
+    uint32_t last = 0;
+    for(uint32_t i = 0; i < script.size; i ++) if(!(script.flags[i] & WORD_END)) last = i;
+    char **words = NULL, *strings = NULL;
+    size_t size = sizeof(char *);
+    for(int pass = 0; pass < 2; pass ++){
+        int n = 0, separated = 1;
+        for(uint32_t i = 0; i < script.size; i ++){
+            int end = script.flags[i] & WORD_END;
+            if(end && (separated || i > last)) continue;
+            const char *word = end ? ";" : script_word(&script, i);
+            separated = end;
+            if(pass == 0) size += sizeof(char *) + strlen(word) + 1;
+            else {words[n] = strings; strings = stpcpy(strings, word) + 1;}
+            n ++;
+        }
+        if(pass == 0) {words = malloc(size); strings = (char *)(words + n + 1); *count = n;}
+        else words[n] = NULL;
+    }
+    script_free(&script);
+    return words;
+}
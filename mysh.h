@@ -0,0 +1,21 @@
+#ifndef _MYSH_H
+#define _MYSH_H
+
+/*
+ * Embedding interface of the shell (libmysh.a)
+ * A context holds everything one shell knows: variables, $?, limits, the working directory and its standard descriptors.
+ * Contexts are independent, each may be used by one thread at a time and different ones on different threads at once.
+ * The thread running a context gets a working directory of its own (unshare(CLONE_FS)), so cd in one context never moves
+ * another one or the rest of the program.
+ * Commands are still started as child processes, "exit" ends the context's input instead of the program, and "exec"
+ * runs its command as a child since it cannot replace the program
+ */
+typedef struct mysh_ctx mysh_ctx;
+
+mysh_ctx *mysh_ctx_new(int in, int out, int err);
+void mysh_ctx_free(mysh_ctx *ctx);
+int mysh_run_line(mysh_ctx *ctx, const char *line);
+int mysh_run_file(mysh_ctx *ctx, const char *path);
+char **mysh_tokenize(mysh_ctx *ctx, const char *line, int *count);
+
+#endif
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "pin.h"
+
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+static const char *ioprio_classes[] = {"none", "rt", "be", "idle"};
+
+/*
+ * Parses a cpu list like "0-3,8,10-11", the format of the kernel's cpulist files, into set
+ * Returns 1 on success or 0 if the list is not valid
+ */
+static int parse_cpus(const char *text, cpu_set_t *set){
+    CPU_ZERO(set);
+    while(*text != '\0' && *text != '\n'){
+        char *end;
+        if(*text < '0' || *text > '9') return 0;
+        long first = strtol(text, &end, 10), last = first;
+        if(*end == '-'){
+            if(end[1] < '0' || end[1] > '9') return 0;
+            last = strtol(end + 1, &end, 10);
+        }
+        if(last < first || last >= CPU_SETSIZE) return 0;
+        for(long cpu = first; cpu <= last; cpu ++) CPU_SET(cpu, set);
+        if(*end == ',' && end[1] != '\0') end ++;
+        else if(*end != '\0' && *end != '\n') return 0;
+        text = end;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/*
+ * Reads a cpu list from a sysfs file into set
+ * Returns 1 on success or 0 if the file does not exist or cannot be parsed
+ */
+static int read_cpus(const char *path, cpu_set_t *set){
+    char line[4096];
+    FILE *file = fopen(path, "re");
+    if(file == NULL) return 0;
+    int ok = fgets(line, sizeof(line), file) != NULL && parse_cpus(line, set);
+    fclose(file);
+    return ok;
+}
+
+/*
+ * Finds the cpus of the NUMA node the shell is running on, limited to the ones the shell may use
+ * Without NUMA information (no /sys/devices/system/node, or a single node) every usable cpu belongs to the node.
+ * The cpus are ordered so the first hardware thread of every core comes before its siblings, so a pipeline gets a core
+ * per stage as long as there are enough of them.
+ * Returns 1 on success or 0 with an error printed
+ */
+static int find_node_cpus(pin_settings *pin, FILE *err){
+    cpu_set_t allowed, node;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {fprintf(err, "pin: %s\n", strerror(errno)); return 0;}
+    node = allowed;
+    int current = sched_getcpu();
+    DIR *nodes = opendir("/sys/devices/system/node");
+    struct dirent *entry;
+    while(current != -1 && nodes != NULL && (entry = readdir(nodes)) != NULL){
+        char path[300];
+        cpu_set_t cpus;
+        if(strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9') continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        if(read_cpus(path, &cpus) && CPU_ISSET(current, &cpus)) {CPU_AND(&node, &allowed, &cpus); break;}
+    }
+    if(nodes != NULL) closedir(nodes);
+    pin->auto_count = 0;
+    for(int pass = 0; pass < 2; pass ++){
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu ++){
+            if(!CPU_ISSET(cpu, &node)) continue;
+            char path[100];
+            cpu_set_t siblings;
+            int first = cpu;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+            if(read_cpus(path, &siblings)){
+                CPU_AND(&siblings, &siblings, &node);
+                for(first = 0; first < cpu && !CPU_ISSET(first, &siblings); first ++);
+            }
+            //the first pass takes one thread per core, the second one the remaining threads
+            if((first == cpu) == (pass == 0)) pin->auto_cpus[pin->auto_count ++] = cpu;
+        }
+    }
+    if(pin->auto_count == 0) {fprintf(err, "error: pin: no usable cpu\n"); return 0;}
+    return 1;
+}
+
+/*
+ * Parses an ioprio setting, a class (rt, be or idle) with an optional ":level" from 0 to 7
+ * Returns the ioprio value for ioprio_set(), or -1 if the setting is not valid
+ */
+static int parse_ioprio(const char *text){
+    const char *colon = strchr(text, ':');
+    size_t length = colon != NULL ? (size_t)(colon - text) : strlen(text);
+    for(int class = 1; class <= 3; class ++){
+        if(strlen(ioprio_classes[class]) != length || strncmp(text, ioprio_classes[class], length) != 0) continue;
+        int level = 4;
+        if(colon != NULL){
+            if(colon[1] < '0' || colon[1] > '7' || colon[2] != '\0') return -1;
+            level = colon[1] - '0';
+        }
+        return class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+    }
+    return -1;
+}
+
+/*
+ * Clears every setting, children then run where and how the shell does
+ */
+void pin_init(pin_settings *pin){
+    memset(pin, 0, sizeof(*pin));
+    pin->ioprio = -1;
+    pin->policy = -1;
+}
+
+/*
+ * Returns 1 if any setting is given
+ */
+int pin_any(const pin_settings *pin){
+    return pin->has_cpus || pin->automatic || pin->has_nice || pin->ioprio != -1 || pin->policy != -1;
+}
+
+/*
+ * Takes an argument of the pin prefix: a cpu list ("0-3,8"), "auto", "nice=N", "ioprio=class[:level]" or
+ * "sched=batch|idle|other"
+ * Returns 1 if the setting was added or 0 with an error printed to err
+ */
+int pin_parse(pin_settings *pin, const char *argument, FILE *err){
+    if(strcmp(argument, "auto") == 0){
+        if(!find_node_cpus(pin, err)) return 0;
+        pin->automatic = 1;
+        pin->has_cpus = 0;
+        return 1;
+    }
+    if(argument[0] >= '0' && argument[0] <= '9'){
+        cpu_set_t allowed;
+        if(!parse_cpus(argument, &pin->cpus)) {fprintf(err, "error: pin: invalid cpu list: %s\n", argument); return 0;}
+        //the kernel refuses a set without any cpu the process may use, this says so before anything is started
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+            CPU_AND(&allowed, &allowed, &pin->cpus);
+            if(CPU_COUNT(&allowed) == 0) {fprintf(err, "error: pin: no usable cpu in %s\n", argument); return 0;}
+        }
+        pin->has_cpus = 1;
+        pin->automatic = 0;
+        return 1;
+    }
+    if(strncmp(argument, "nice=", 5) == 0){
+        char *end;
+        long nice = strtol(argument + 5, &end, 10);
+        if(end == argument + 5 || *end != '\0' || nice < -20 || nice > 19) {fprintf(err, "error: pin: invalid value: %s\n", argument); return 0;}
+        pin->has_nice = 1;
+        pin->nice = nice;
+        return 1;
+    }
+    if(strncmp(argument, "ioprio=", 7) == 0){
+        if((pin->ioprio = parse_ioprio(argument + 7)) == -1) {fprintf(err, "error: pin: invalid value: %s\n", argument); return 0;}
+        return 1;
+    }
+    if(strncmp(argument, "sched=", 6) == 0){
+        const char *policy = argument + 6;
+        if(strcmp(policy, "batch") == 0) pin->policy = SCHED_BATCH;
+        else if(strcmp(policy, "idle") == 0) pin->policy = SCHED_IDLE;
+        else if(strcmp(policy, "other") == 0) pin->policy = SCHED_OTHER;
+        else {fprintf(err, "error: pin: invalid value: %s\n", argument); return 0;}
+        return 1;
+    }
+    fprintf(err, "error: pin: unknown setting: %s\n", argument);
+    return 0;
+}
+
+/*
+ * Installs the settings, to be called in a child between fork and exec so the shell keeps its own cpus and priorities
+ * Settings the kernel refuses (a lower nice value without the privilege) are reported and skipped
+ */
+void pin_apply(const pin_settings *pin){
+    if(pin->has_cpus && sched_setaffinity(0, sizeof(pin->cpus), &pin->cpus) == -1) perror("pin");
+    if(pin->automatic){
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(pin->auto_cpus[pin->stage % pin->auto_count], &cpu);
+        if(sched_setaffinity(0, sizeof(cpu), &cpu) == -1) perror("pin");
+    }
+    if(pin->policy != -1){
+        struct sched_param param = {0};
+        if(sched_setscheduler(0, pin->policy, &param) == -1) perror("sched");
+    }
+    if(pin->has_nice && setpriority(PRIO_PROCESS, 0, pin->nice) == -1) perror("nice");
+    if(pin->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, pin->ioprio) == -1) perror("ioprio");
+}
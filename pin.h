@@ -0,0 +1,30 @@
+#ifndef _PIN_H
+#define _PIN_H
+
+#include <stdio.h>
+#include <sched.h>
+
+/*
+ * Placement and scheduling settings to install in a child before it runs a command, from the pin prefix
+ * cpus is used when has_cpus is set. In auto mode stage s of a pipeline runs on auto_cpus[s % auto_count], stage is
+ * set by the shell before each stage is started. nice, ioprio and policy are used when set to something other than -1
+ */
+typedef struct{
+    int has_cpus;
+    cpu_set_t cpus;
+    int automatic;
+    int auto_cpus[CPU_SETSIZE];
+    int auto_count;
+    int stage;
+    int has_nice;
+    int nice;
+    int ioprio;
+    int policy;
+} pin_settings;
+
+void pin_init(pin_settings *pin);
+int pin_any(const pin_settings *pin);
+int pin_parse(pin_settings *pin, const char *argument, FILE *err);
+void pin_apply(const pin_settings *pin);
+
+#endif
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "relay.h"
+#include "copy.h"
+
+#ifndef RELAY_PIPE_SIZE
+#define RELAY_PIPE_SIZE (1024 * 1024)
+#endif
+#ifndef RELAY_BUFSIZE
+#define RELAY_BUFSIZE (64 * 1024)
+#endif
+
+/*
+ * Moves exactly size bytes from the pipe in to out with splice(), or with read()/write() when out does not support splicing
+ * Returns 1 on success or 0 on error
+ */
+static int move_bytes(int in, int out, size_t size){
+    static char *buffer = NULL;
+    while(size > 0){
+        ssize_t n = splice(in, NULL, out, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1 && errno == EINVAL){
+            //out cannot be spliced to (a terminal for example), copy through a buffer
+            if(buffer == NULL && (buffer = malloc(RELAY_BUFSIZE)) == NULL) return 0;
+            n = read(in, buffer, size < RELAY_BUFSIZE ? size : RELAY_BUFSIZE);
+            if(n > 0 && !write_all(out, buffer, n)) return 0;
+        }
+        if(n <= 0) return 0;
+        size -= n;
+    }
+    return 1;
+}
+
+/*
+ * Copies everything written to the pipe input into every output until the writers close it
+ * Every output but the last gets the data through tee() into a scratch pipe and splice() from it, the last one
+ * consumes the data from input with splice(), so the data never passes through a user space buffer.
+ * Returns 1 when the input is exhausted or 0 if writing to an output failed
+ */
+int relay_fanout(int input, const int *outputs, int count){
+    int scratch[2];
+    if(pipe2(scratch, O_CLOEXEC) == -1) return 0;
+    fcntl(input, F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    //the scratch pipe must hold everything tee() can take from input at once
+    fcntl(scratch[0], F_SETPIPE_SZ, fcntl(input, F_GETPIPE_SZ));
+    int ok = 1;
+    for(;;){
+        ssize_t n = tee(input, scratch[1], RELAY_PIPE_SIZE, 0);
+        if(n == -1 && errno == EINTR) continue;
+        if(n <= 0) {ok = n == 0; break;}
+        for(int i = 0; ok && i < count - 1; i ++){
+            //tee() always starts at the front of input, the scratch pipe is empty again so it takes the same n bytes
+            ssize_t copied = i == 0 ? n : -1;
+            while(copied == -1 && (copied = tee(input, scratch[1], n, 0)) == -1 && errno == EINTR);
+            ok = copied == n && move_bytes(scratch[0], outputs[i], n);
+        }
+        if(!ok || !move_bytes(input, outputs[count - 1], n)) {ok = 0; break;}
+    }
+    close(scratch[0]);
+    close(scratch[1]);
+    return ok;
+}
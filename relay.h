@@ -0,0 +1,6 @@
+#ifndef _RELAY_H
+#define _RELAY_H
+
+int relay_fanout(int input, const int *outputs, int count);
+
+#endif
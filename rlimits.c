@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include "rlimits.h"
+
+#ifndef LIMITS_CPU_SLACK_US
+#define LIMITS_CPU_SLACK_US 50000      //how far short of the hard cpu limit a SIGKILLed command may be reported
+#endif
+
+/*
+ * Limits understood by "limit name=value" and "ulimit -option value"
+ * ulimit takes sizes in units of 1024 bytes like other shells, the limit prefix takes bytes with an optional K, M, G or T suffix
+ */
+typedef struct{
+    const char *name;
+    char option;
+    int resource;
+    rlim_t ulimit_unit;
+    int size;
+    const char *description;
+} limit_info;
+
+static const limit_info limit_table[LIMIT_COUNT] = {
+    {"cpu", 't', RLIMIT_CPU, 1, 0, "cpu time (seconds)"},
+    {"mem", 'v', RLIMIT_AS, 1024, 1, "virtual memory (kbytes)"},
+    {"files", 'n', RLIMIT_NOFILE, 1, 0, "open files"},
+    {"procs", 'u', RLIMIT_NPROC, 1, 0, "max user processes"},
+    {"core", 'c', RLIMIT_CORE, 1024, 1, "core file size (kbytes)"},
+};
+
+/*
+ * Parses a limit value, "unlimited" or a number, followed by K, M, G or T when suffixes is set, and multiplies it by unit
+ * Returns 1 on success or 0 if the value is not valid
+ */
+static int parse_value(const char *text, rlim_t unit, int suffixes, rlim_t *value){
+    if(strcmp(text, "unlimited") == 0) {*value = RLIM_INFINITY; return 1;}
+    char *end;
+    errno = 0;
+    if(text[0] < '0' || text[0] > '9') return 0;
+    unsigned long long number = strtoull(text, &end, 10);
+    if(errno != 0) return 0;
+    if(suffixes && *end != '\0' && end[1] == '\0'){
+        const char *units = "KMGT";
+        const char *found = strchr(units, *end == 'k' ? 'K' : *end);
+        if(found == NULL) return 0;
+        for(int i = 0; i <= found - units; i ++) unit *= 1024;
+        end ++;
+    }
+    if(*end != '\0' || (number != 0 && unit > RLIM_INFINITY / number)) return 0;
+    *value = number * unit;
+    return 1;
+}
+
+/*
+ * Sets limit i to value after checking it against the shell's hard limit, which an unprivileged child could not raise
+ * Returns 1 on success or 0 with an error printed to err
+ */
+static int set_limit(limit_set *limits, int i, rlim_t value, const char *command, FILE *err){
+    struct rlimit current;
+    if(getrlimit(limit_table[i].resource, &current) == 0 && current.rlim_max != RLIM_INFINITY && value > current.rlim_max){
+        fprintf(err, "error: %s: %s exceeds the hard limit\n", command, limit_table[i].name);
+        return 0;
+    }
+    limits->set[i] = 1;
+    limits->value[i] = value;
+    return 1;
+}
+
+/*
+ * Returns 1 if any limit is set
+ */
+int limits_any(const limit_set *limits){
+    for(int i = 0; i < LIMIT_COUNT; i ++){
+        if(limits->set[i]) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Takes an argument of the limit prefix, name=value with name one of cpu, mem, files, procs or core
+ * Returns 1 if the limit was added or 0 with an error printed
+ */
+int limits_parse(limit_set *limits, const char *assignment, FILE *err){
+    const char *equals = strchr(assignment, '=');
+    for(int i = 0; equals != NULL && i < LIMIT_COUNT; i ++){
+        if(strncmp(assignment, limit_table[i].name, equals - assignment) != 0 || limit_table[i].name[equals - assignment] != '\0') continue;
+        rlim_t value;
+        if(!parse_value(equals + 1, 1, limit_table[i].size, &value)){
+            fprintf(err, "error: limit: invalid value: %s\n", assignment);
+            return 0;
+        }
+        return set_limit(limits, i, value, "limit", err);
+    }
+    fprintf(err, "error: limit: unknown limit: %s\n", assignment);
+    return 0;
+}
+
+/*
+ * Takes a ulimit option letter (t, v, n, u or c) and its value in ulimit units
+ * Returns 1 if the limit was set or 0 with an error printed
+ */
+int limits_option(limit_set *limits, char option, const char *value, FILE *err){
+    for(int i = 0; i < LIMIT_COUNT; i ++){
+        if(limit_table[i].option != option) continue;
+        rlim_t parsed;
+        if(!parse_value(value, limit_table[i].ulimit_unit, 0, &parsed)){
+            fprintf(err, "error: ulimit: invalid value: %s\n", value);
+            return 0;
+        }
+        return set_limit(limits, i, parsed, "ulimit", err);
+    }
+    fprintf(err, "error: ulimit: invalid option: -%c\n", option);
+    return 0;
+}
+
+/*
+ * Prints the limit for a ulimit option letter, or every limit with its description for option 'a'
+ * Limits that are not set show the shell's own soft limit, which the children inherit
+ */
+void limits_print(const limit_set *limits, char option, FILE *out, FILE *err){
+    for(int i = 0; i < LIMIT_COUNT; i ++){
+        if(option != 'a' && limit_table[i].option != option) continue;
+        rlim_t value = limits->value[i];
+        if(!limits->set[i]){
+            struct rlimit current;
+            getrlimit(limit_table[i].resource, &current);
+            value = current.rlim_cur;
+        }
+        if(option == 'a') fprintf(out, "%-26s (-%c) ", limit_table[i].description, limit_table[i].option);
+        if(value == RLIM_INFINITY) fprintf(out, "unlimited\n");
+        else fprintf(out, "%llu\n", (unsigned long long)(value / limit_table[i].ulimit_unit));
+        if(option != 'a') return;
+    }
+    if(option != 'a') fprintf(err, "error: ulimit: invalid option: -%c\n", option);
+}
+
+/*
+ * Installs the limits with setrlimit(), to be called in a child between fork and exec so the shell keeps its own limits
+ * The hard cpu limit is one second above the soft one, so the command gets SIGXCPU (which it can report) before SIGKILL
+ */
+void limits_apply(const limit_set *limits){
+    for(int i = 0; i < LIMIT_COUNT; i ++){
+        if(!limits->set[i]) continue;
+        struct rlimit current, limit = {limits->value[i], limits->value[i]};
+        getrlimit(limit_table[i].resource, &current);
+        if(limit_table[i].resource == RLIMIT_CPU && limit.rlim_max != RLIM_INFINITY) limit.rlim_max ++;
+        if(limit.rlim_max > current.rlim_max) limit.rlim_max = current.rlim_max;
+        if(setrlimit(limit_table[i].resource, &limit) == -1) perror(limit_table[i].name);
+    }
+}
+
+/*
+ * Takes the signal that ended a command run with limits and the command's resource usage from wait4()
+ * A SIGKILL is only put down to the cpu limit when the command has used up the hard limit (see limits_apply()),
+ * one from the OOM killer or from kill -9 is not. The reported usage can fall a few milliseconds short of the limit that killed it
+ * Returns a description of the limit it points to, or NULL if the signal does not come from a limit
+ */
+const char *limits_reason(const limit_set *limits, int signal, const struct rusage *usage){
+    if(signal == SIGXCPU) return "cpu time limit exceeded";
+    if(signal == SIGKILL && limits->set[0] && limits->value[0] != RLIM_INFINITY){
+        struct rlimit current;
+        rlim_t hard = limits->value[0] + 1;
+        if(getrlimit(RLIMIT_CPU, &current) == 0 && current.rlim_max < hard) hard = current.rlim_max;
+        unsigned long long used_us = (unsigned long long)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000
+            + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+        if(used_us + LIMITS_CPU_SLACK_US >= (unsigned long long)hard * 1000000) return "cpu time limit exceeded";
+    }
+    if(signal == SIGXFSZ) return "file size limit exceeded";
+    if((signal == SIGSEGV || signal == SIGABRT || signal == SIGBUS) && limits->set[1]) return "possibly out of memory (mem limit)";
+    return NULL;
+}
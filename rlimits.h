@@ -0,0 +1,25 @@
+#ifndef _RLIMITS_H
+#define _RLIMITS_H
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+#define LIMIT_COUNT 5
+
+/*
+ * Resource limits to install in a child before it runs a command, set[i] says whether limit i is given
+ * The indexes follow the table in rlimits.c: cpu, mem, files, procs, core
+ */
+typedef struct{
+    int set[LIMIT_COUNT];
+    rlim_t value[LIMIT_COUNT];
+} limit_set;
+
+int limits_any(const limit_set *limits);
+int limits_parse(limit_set *limits, const char *assignment, FILE *err);
+int limits_option(limit_set *limits, char option, const char *value, FILE *err);
+void limits_print(const limit_set *limits, char option, FILE *out, FILE *err);
+void limits_apply(const limit_set *limits);
+const char *limits_reason(const limit_set *limits, int signal, const struct rusage *usage);
+
+#endif
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "script.h"
+
+#define SCRIPT_MAGIC "MYSHSC04"
+
+/*
+ * Cache file header, followed by the source path (padded to 4 bytes), the offsets, the flags and the strings
+ */
+typedef struct{
+    char magic[8];
+    uint64_t mtime_ns;
+    uint64_t source_size;
+    uint64_t hash;
+    uint32_t path_length;
+    uint32_t words;
+    uint32_t strings_size;
+    uint32_t reserved;
+} script_header;
+
+/*
+ * FNV-1a hash used for the source contents and cache file names
+ */
+static uint64_t hash_bytes(const char *data, size_t size){
+    uint64_t hash = 1469598103934665603ULL;
+    for(size_t i = 0; i < size; i ++){
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t mtime_ns(struct stat *st){
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+}
+
+/* Initializes an empty script
+ * Returns 1 on success or 0 if not able to allocate storage
+ */
+int script_init(compiled_script *script){
+    memset(script, 0, sizeof(*script));
+    script->capacity = 64;
+    script->strings_capacity = 1024;
+    script->offsets = malloc(sizeof(uint32_t) * script->capacity);
+    script->flags = malloc(script->capacity);
+    script->strings = malloc(script->strings_capacity);
+    return script->offsets != NULL && script->flags != NULL && script->strings != NULL;
+}
+
+/*
+ * Frees a compiled script or unmaps a loaded one
+ */
+void script_free(compiled_script *script){
+    if(script->map != NULL){
+        munmap(script->map, script->map_size);
+    }
+    else{
+        free(script->offsets);
+        free(script->flags);
+        free(script->strings);
+    }
+    memset(script, 0, sizeof(*script));
+}
+
+/* Appends a word with its flags to a compiled script
+ * Returns 1 on success or 0 if not able to allocate storage
+ */
+int script_add(compiled_script *script, const char *word, int flags){
+    uint32_t length = strlen(word) + 1;
+    if(script->size == script->capacity){
+        uint32_t capacity = script->capacity * 2;
+        uint32_t *offsets = realloc(script->offsets, sizeof(uint32_t) * capacity);
+        if(!offsets) return 0;
+        script->offsets = offsets;
+        unsigned char *new_flags = realloc(script->flags, capacity);
+        if(!new_flags) return 0;
+        script->flags = new_flags;
+        script->capacity = capacity;
+    }
+    if(script->strings_size + length > script->strings_capacity){
+        uint32_t capacity = script->strings_capacity;
+        while(script->strings_size + length > capacity) capacity *= 2;
+        char *strings = realloc(script->strings, capacity);
+        if(!strings) return 0;
+        script->strings = strings;
+        script->strings_capacity = capacity;
+    }
+    memcpy(script->strings + script->strings_size, word, length);
+    script->offsets[script->size] = script->strings_size;
+    script->flags[script->size] = flags;
+    script->strings_size += length;
+    script->size ++;
+    return 1;
+}
+
+/*
+ * Returns the text of the word at index
+ */
+const char *script_word(compiled_script *script, uint32_t index){
+    return script->strings + script->offsets[index];
+}
+
+/*
+ * Returns the cache file for a script, $XDG_CACHE_HOME/mysh/<hash of absolute path>.msc (or ~/.cache/mysh/),
+ * creating the cache directory if needed. Returns NULL if no cache location is available, otherwise the caller frees the path
+ */
+char *script_cache_path(const char *source_path){
+    char absolute[PATH_MAX], dir[PATH_MAX];
+    if(realpath(source_path, absolute) == NULL) return NULL;
+    char *base = getenv("XDG_CACHE_HOME");
+    if(base != NULL && base[0] != '\0') snprintf(dir, PATH_MAX, "%s", base);
+    else if(getenv("HOME") != NULL) snprintf(dir, PATH_MAX, "%s/.cache", getenv("HOME"));
+    else return NULL;
+    mkdir(dir, 0700);
+    strncat(dir, "/mysh", PATH_MAX - strlen(dir) - 1);
+    if(mkdir(dir, 0700) == -1 && access(dir, W_OK) == -1) return NULL;
+    char *path = malloc(strlen(dir) + 24);
+    if(path == NULL) return NULL;
+    sprintf(path, "%s/%016llx.msc", dir, (unsigned long long)hash_bytes(absolute, strlen(absolute)));
+    return path;
+}
+
+/*
+ * Maps the cache file and checks that it belongs to the script at source_path in its current state.
+ * The script is unchanged if its size and mtime match; if only the mtime differs the contents are hashed,
+ * and when the hash still matches the cached mtime is refreshed so the next run skips hashing.
+ * Returns 1 if the script was loaded (pointing into the mapping) or 0 on a cache miss
+ */
+int script_load(compiled_script *script, const char *cache_path, const char *source_path){
+    char absolute[PATH_MAX];
+    struct stat source, cache;
+    if(realpath(source_path, absolute) == NULL || stat(absolute, &source) == -1) return 0;
+    int fd = open(cache_path, O_RDWR | O_CLOEXEC);
+    if(fd == -1) return 0;
+    if(fstat(fd, &cache) == -1 || cache.st_size < sizeof(script_header)) {close(fd); return 0;}
+    char *map = mmap(NULL, cache.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) {close(fd); return 0;}
+    script_header header;
+    memcpy(&header, map, sizeof(header));
+    size_t path_space = (header.path_length + 3) & ~3u;
+    size_t expected = sizeof(header) + path_space + (size_t)header.words * 5 + header.strings_size;
+    int valid = memcmp(header.magic, SCRIPT_MAGIC, 8) == 0 && expected == (size_t)cache.st_size
+        && header.path_length == strlen(absolute) && memcmp(map + sizeof(header), absolute, header.path_length) == 0
+        && header.source_size == (uint64_t)source.st_size
+        && header.strings_size > 0 && map[cache.st_size - 1] == '\0';
+    if(valid && header.mtime_ns != mtime_ns(&source)){
+        int source_fd = open(absolute, O_RDONLY | O_CLOEXEC);
+        char *content = source_fd == -1 || source.st_size == 0 ? NULL : mmap(NULL, source.st_size, PROT_READ, MAP_PRIVATE, source_fd, 0);
+        valid = content != NULL && content != MAP_FAILED && hash_bytes(content, source.st_size) == header.hash;
+        if(content != NULL && content != MAP_FAILED) munmap(content, source.st_size);
+        if(source_fd != -1) close(source_fd);
+        if(valid){
+            header.mtime_ns = mtime_ns(&source);
+            pwrite(fd, &header.mtime_ns, sizeof(header.mtime_ns), offsetof(script_header, mtime_ns));
+        }
+    }
+    close(fd);
+    if(!valid) {munmap(map, cache.st_size); return 0;}
+    memset(script, 0, sizeof(*script));
+    script->map = map;
+    script->map_size = cache.st_size;
+    script->size = header.words;
+    script->offsets = (uint32_t *)(map + sizeof(header) + path_space);
+    script->flags = (unsigned char *)(script->offsets + header.words);
+    script->strings = (char *)(script->flags + header.words);
+    script->strings_size = header.strings_size;
+    for(uint32_t i = 0; i < script->size; i ++){
+        if(script->offsets[i] >= script->strings_size) {script_free(script); return 0;}
+    }
+    return 1;
+}
+
+/*
+ * Writes a compiled script to its cache file along with the identity of its source (path, mtime, size and content hash)
+ * The file is written beside the final name and renamed into place so concurrent runs never see a partial cache
+ * Returns 1 on success or 0 on failure
+ */
+int script_save(compiled_script *script, const char *cache_path, const char *source_path, const char *content, size_t size){
+    char absolute[PATH_MAX];
+    struct stat source;
+    if(realpath(source_path, absolute) == NULL || stat(absolute, &source) == -1) return 0;
+    script_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRIPT_MAGIC, 8);
+    header.mtime_ns = mtime_ns(&source);
+    header.source_size = size;
+    header.hash = hash_bytes(content, size);
+    header.path_length = strlen(absolute);
+    header.words = script->size;
+    header.strings_size = script->strings_size;
+    char padding[4] = {0};
+    char *tmp_path = malloc(strlen(cache_path) + 32);
+    if(tmp_path == NULL) return 0;
+    sprintf(tmp_path, "%s.%d.tmp", cache_path, (int)gettid());
+    FILE *out = fopen(tmp_path, "w");
+    if(out == NULL) {free(tmp_path); return 0;}
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(absolute, 1, header.path_length, out);
+    fwrite(padding, 1, ((header.path_length + 3) & ~3u) - header.path_length, out);
+    fwrite(script->offsets, sizeof(uint32_t), script->size, out);
+    fwrite(script->flags, 1, script->size, out);
+    fwrite(script->strings, 1, script->strings_size, out);
+    int ok = !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    if(ok) ok = rename(tmp_path, cache_path) == 0;
+    if(!ok) unlink(tmp_path);
+    free(tmp_path);
+    return ok;
+}
@@ -0,0 +1,38 @@
+#ifndef _SCRIPT_H
+#define _SCRIPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//flags stored for every word of a compiled script
+#define WORD_EXPAND 1      //contains variable references or command substitutions
+#define WORD_TILDE 2       //starts with the home directory shortcut
+#define WORD_GLOB 4        //contains a wildcard
+#define WORD_OPERATOR 8    //pipe or redirection operator
+#define WORD_END 16        //end of a command line, the word text is empty
+
+/*
+ * Tokenized script: word i is strings + offsets[i] with flags[i]
+ * A loaded script points into a read-only mapping of its cache file, a compiled one owns malloc'd arrays
+ */
+typedef struct{
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t *offsets;
+    unsigned char *flags;
+    char *strings;
+    uint32_t strings_size;
+    uint32_t strings_capacity;
+    void *map;
+    size_t map_size;
+} compiled_script;
+
+int script_init(compiled_script *script);
+void script_free(compiled_script *script);
+int script_add(compiled_script *script, const char *word, int flags);
+const char *script_word(compiled_script *script, uint32_t index);
+char *script_cache_path(const char *source_path);
+int script_load(compiled_script *script, const char *cache_path, const char *source_path);
+int script_save(compiled_script *script, const char *cache_path, const char *source_path, const char *content, size_t size);
+
+#endif
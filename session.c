@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "session.h"
+#include "copy.h"
+
+#define SESSION_MAGIC "MYSHSES1"
+#ifndef SESSION_MAX_PAYLOAD
+#define SESSION_MAX_PAYLOAD (16 * 1024 * 1024)
+#endif
+#ifndef SESSION_TIMEOUT
+#define SESSION_TIMEOUT 5
+#endif
+
+typedef struct{
+    char magic[8];
+    uint32_t payload_size;
+    uint32_t env_count;
+} session_header;
+
+/*
+ * Fills in a Unix socket address
+ * Returns 1 on success or 0 if the path does not fit
+ */
+static int make_address(struct sockaddr_un *address, const char *path){
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address->sun_path)) {errno = ENAMETOOLONG; return 0;}
+    strcpy(address->sun_path, path);
+    return 1;
+}
+
+/*
+ * Creates the listening socket of a shell server, replacing a stale socket left at path
+ * The socket is only accessible to its owner
+ * Returns the socket or -1 on error
+ */
+int session_listen(const char *path){
+    struct sockaddr_un address;
+    struct stat st;
+    if(!make_address(&address, path)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1) return -1;
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)){
+        //only replace the socket if no server answers on it
+        int probe = session_connect(path);
+        if(probe != -1) {close(probe); close(sock); errno = EADDRINUSE; return -1;}
+        unlink(path);
+    }
+    mode_t mask = umask(0077);
+    int bound = bind(sock, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if(bound == -1 || listen(sock, SOMAXCONN) == -1) {close(sock); return -1;}
+    return sock;
+}
+
+/*
+ * Accepts a client of a shell server, reads from the client time out so the session of a stalled client gives up
+ * Returns the connection or -1 on error
+ */
+int session_accept(int sock){
+    int connection = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if(connection == -1) return -1;
+    struct timeval timeout = {SESSION_TIMEOUT, 0};
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return connection;
+}
+
+/*
+ * Connects to the shell server listening at path
+ * Returns the socket or -1 on error
+ */
+int session_connect(const char *path){
+    struct sockaddr_un address;
+    if(!make_address(&address, path)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1) return -1;
+    if(connect(sock, (struct sockaddr *)&address, sizeof(address)) == -1) {close(sock); return -1;}
+    return sock;
+}
+
+/*
+ * Sends a session request passing this process' stdin, stdout and stderr to the server
+ * Returns 1 on success or 0 on error
+ */
+int session_send(int sock, const char *cwd, const char *script, char **envp){
+    session_header header;
+    memcpy(header.magic, SESSION_MAGIC, 8);
+    size_t size = strlen(cwd) + strlen(script) + 2;
+    header.env_count = 0;
+    for(; envp[header.env_count] != NULL; header.env_count ++) size += strlen(envp[header.env_count]) + 1;
+    if(size > SESSION_MAX_PAYLOAD) {errno = E2BIG; return 0;}
+    header.payload_size = size;
+    char *payload = malloc(size), *p = payload;
+    if(payload == NULL) return 0;
+    p = stpcpy(p, cwd) + 1;
+    p = stpcpy(p, script) + 1;
+    for(uint32_t i = 0; i < header.env_count; i ++) p = stpcpy(p, envp[i]) + 1;
+
+    int fds[SESSION_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int ok = send_fds(sock, &header, sizeof(header), fds, SESSION_FDS) && send_all(sock, payload, size);
+    free(payload);
+    return ok;
+}
+
+/*
+ * Receives a session request, the received descriptors are close-on-exec
+ * Returns 1 on success or 0 if the request is missing or malformed (no descriptors are left open)
+ */
+int session_receive(int sock, session_request *request){
+    session_header header;
+    memset(request, 0, sizeof(*request));
+    int ok = recv_fds(sock, &header, sizeof(header), request->fds, SESSION_FDS)
+        && memcmp(header.magic, SESSION_MAGIC, 8) == 0 && header.payload_size >= 2 && header.payload_size <= SESSION_MAX_PAYLOAD
+        && header.env_count <= header.payload_size;
+    if(ok){
+        request->payload = malloc(header.payload_size);
+        request->envp = malloc(sizeof(char *) * ((size_t)header.env_count + 1));
+        ok = request->payload != NULL && request->envp != NULL && read_all(sock, request->payload, header.payload_size)
+            && request->payload[header.payload_size - 1] == '\0';
+    }
+    if(ok){
+        //split the payload at its NULs, which must match the counts in the header
+        char *p = request->payload, *end = request->payload + header.payload_size;
+        request->cwd = p;
+        p += strlen(p) + 1;
+        ok = p < end;
+        if(ok){
+            request->script = p;
+            p += strlen(p) + 1;
+        }
+        uint32_t i = 0;
+        for(; ok && i < header.env_count && p < end; i ++){
+            request->envp[i] = p;
+            p += strlen(p) + 1;
+        }
+        ok = ok && i == header.env_count && p == end;
+        if(ok) request->envp[i] = NULL;
+    }
+    if(!ok) session_request_free(request);
+    return ok;
+}
+
+/*
+ * Closes the descriptors of a request that are still open and frees its strings
+ */
+void session_request_free(session_request *request){
+    for(int i = 0; i < SESSION_FDS; i ++){
+        if(request->fds[i] != -1) close(request->fds[i]);
+        request->fds[i] = -1;
+    }
+    free(request->payload);
+    free(request->envp);
+    request->payload = NULL;
+    request->envp = NULL;
+}
+
+/*
+ * Sends the exit status of a finished session back to its client
+ * Returns 1 on success or 0 if the client went away
+ */
+int session_send_status(int sock, int status){
+    int32_t value = status;
+    return send_all(sock, &value, sizeof(value));
+}
+
+/*
+ * Waits for the server to report the exit status of this client's session
+ * Returns 1 on success or 0 if the connection closed first
+ */
+int session_wait_status(int sock, int *status){
+    int32_t value;
+    if(!read_all(sock, &value, sizeof(value))) return 0;
+    *status = value;
+    return 1;
+}
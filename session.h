@@ -0,0 +1,30 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdint.h>
+
+#define SESSION_FDS 3
+
+/*
+ * Request sent by a client when it connects to a shell server
+ * The client's stdin, stdout and stderr travel with it as SCM_RIGHTS ancillary data,
+ * the strings point into one payload buffer: working directory, script path ("" to read commands from stdin), environment
+ */
+typedef struct{
+    int fds[SESSION_FDS];
+    char *payload;
+    char *cwd;
+    char *script;
+    char **envp;
+} session_request;
+
+int session_listen(const char *path);
+int session_accept(int sock);
+int session_connect(const char *path);
+int session_send(int sock, const char *cwd, const char *script, char **envp);
+int session_receive(int sock, session_request *request);
+void session_request_free(session_request *request);
+int session_send_status(int sock, int status);
+int session_wait_status(int sock, int *status);
+
+#endif
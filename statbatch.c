@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "statbatch.h"
+
+#ifndef STATBATCH_MIN
+#define STATBATCH_MIN 8            //fewer remaining paths are checked one by one
+#endif
+#ifndef STATBATCH_SLOW_NS
+#define STATBATCH_SLOW_NS 50000    //a lookup taking longer than this switches to batches
+#endif
+#ifndef STATBATCH_RING
+#define STATBATCH_RING 256         //requests in flight at once
+#endif
+#ifndef STATBATCH_THREADS
+#define STATBATCH_THREADS 8
+#endif
+
+/*
+ * Submission and completion queues shared with the kernel, mapped from the io_uring descriptor
+ */
+typedef struct{
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_size, cq_size, sqes_size;
+} uring;
+
+typedef struct{
+    char **paths;
+    int *errors;
+    int count;
+    int first;
+    int step;
+} stat_job;
+
+static unsigned long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stat_one(const char *path){
+    struct stat st;
+    return fstatat(AT_FDCWD, path, &st, 0) == -1 ? errno : 0;
+}
+
+static void uring_close(uring *r){
+    if(r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if(r->cq_ring != NULL && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_size);
+    if(r->sq_ring != NULL && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_size);
+    close(r->fd);
+}
+
+/*
+ * Creates a ring with room for entries requests with io_uring_setup() and maps its queues
+ * Returns 1 on success or 0 if io_uring is not available (old kernel, seccomp, io_uring_disabled)
+ */
+static int uring_open(uring *r, unsigned entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(r->fd == -1) return 0;
+    fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+    r->entries = params.sq_entries;
+    r->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED) {uring_close(r); return 0;}
+    r->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? r->sq_ring
+        : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {uring_close(r); return 0;}
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + params.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + params.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + params.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + params.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + params.cq_off.cqes);
+    return 1;
+}
+
+/*
+ * Checks the paths with IORING_OP_STATX requests, up to a ring full at a time, and waits for all of them
+ * Returns 1 on success or 0 if io_uring cannot be used or fails part way, errors may then hold results for some of the paths
+ * and the caller checks all of them again
+ */
+static int stat_uring(char **paths, int count, int *errors){
+    uring r;
+    if(!uring_open(&r, count < STATBATCH_RING ? count : STATBATCH_RING)) return 0;
+    struct statx *results = malloc(sizeof(struct statx) * r.entries);
+    if(results == NULL) {uring_close(&r); return 0;}
+    for(int done = 0; done < count;){
+        unsigned n = count - done < (int)r.entries ? count - done : r.entries, tail = *r.sq_tail;
+        for(unsigned i = 0; i < n; i ++, tail ++){
+            unsigned slot = tail & *r.sq_mask;
+            struct io_uring_sqe *sqe = &r.sqes[slot];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)paths[done + i];
+            sqe->len = STATX_TYPE;
+            sqe->off = (unsigned long)&results[i];
+            sqe->user_data = done + i;
+            r.sq_array[slot] = slot;
+        }
+        __atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+        unsigned submitted = 0, completed = 0;
+        while(completed < n){
+            int ret = syscall(__NR_io_uring_enter, r.fd, n - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if(ret == -1 && errno == EINTR) continue;
+            if(ret == -1){
+                //requests may still be in flight on io-wq workers, which keep writing into results after the ring is
+                //closed (the kernel tears it down asynchronously), so results is not freed. The mappings are ours to release
+                uring_close(&r);
+                return 0;
+            }
+            submitted += ret;
+            unsigned head = *r.cq_head, cq_tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+            for(; head != cq_tail; head ++, completed ++){
+                struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+                errors[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+            }
+            __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+        }
+        done += n;
+    }
+    free(results);
+    uring_close(&r);
+    return 1;
+}
+
+static void *stat_worker(void *arg){
+    stat_job *job = arg;
+    for(int i = job->first; i < job->count; i += job->step) job->errors[i] = stat_one(job->paths[i]);
+    return NULL;
+}
+
+/*
+ * Checks the paths with fstatat() on several threads, each taking every STATBATCH_THREADS-th path
+ */
+static void stat_threads(char **paths, int count, int *errors){
+    pthread_t threads[STATBATCH_THREADS];
+    stat_job jobs[STATBATCH_THREADS];
+    int started[STATBATCH_THREADS];
+    for(int t = 0; t < STATBATCH_THREADS; t ++){
+        stat_job job = {paths, errors, count, t, STATBATCH_THREADS};
+        jobs[t] = job;
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, stat_worker, &jobs[t]) == 0;
+    }
+    //the calling thread does the first share, and the share of any thread that could not be created
+    for(int t = 0; t < STATBATCH_THREADS; t ++){
+        if(!started[t]) stat_worker(&jobs[t]);
+    }
+    for(int t = 1; t < STATBATCH_THREADS; t ++){
+        if(started[t]) pthread_join(threads[t], NULL);
+    }
+}
+
+/*
+ * Checks that each of count paths exists, following symbolic links like stat()
+ * errors[i] is set to 0 if paths[i] exists or to the errno value stat() would have given.
+ * Paths are checked one by one while lookups are fast (served from the dentry cache, io_uring would only add the cost of its
+ * worker threads). Once one takes longer than STATBATCH_SLOW_NS, as on a network filesystem, the remaining ones are submitted at
+ * once as io_uring statx requests so their round trips overlap, with a pool of threads calling fstatat() when io_uring is not
+ * available. All results are in errors when the function returns.
+ */
+void stat_batch(char **paths, int count, int *errors){
+    int i = 0;
+    while(i < count){
+        unsigned long long started = now_ns();
+        errors[i] = stat_one(paths[i]);
+        i ++;
+        if(now_ns() - started > STATBATCH_SLOW_NS && count - i >= STATBATCH_MIN) break;
+    }
+    if(i < count && !stat_uring(paths + i, count - i, errors + i)) stat_threads(paths + i, count - i, errors + i);
+}
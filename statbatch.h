@@ -0,0 +1,6 @@
+#ifndef _STATBATCH_H
+#define _STATBATCH_H
+
+void stat_batch(char **paths, int count, int *errors);
+
+#endif
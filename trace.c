@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "trace.h"
+
+#ifndef TRACE_BUFSIZE
+#define TRACE_BUFSIZE (256 * 1024)
+#endif
+#ifndef TRACE_TRACKS
+#define TRACE_TRACKS 256           //tracks that get a name in the viewer, later ones show their number
+#endif
+#define TRACE_EVENT_MAX 1024       //room kept for one event, names and details are cut to fit
+#define TRACE_OPEN_MAX 16          //spans begun and not yet ended, deeper ones are not recorded
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static pid_t trace_owner;          //forked copies of the shell keep the buffer but never write it
+static char *trace_buffer;
+static size_t trace_used;
+static int trace_events;
+static unsigned char trace_named[TRACE_TRACKS];
+
+typedef struct{
+    const char *name;
+    const char *detail;
+    int track;
+    unsigned long long start_ns;
+} open_span;
+
+static open_span trace_open_spans[TRACE_OPEN_MAX];
+static int trace_depth;
+
+static void trace_flush(){
+    if(getpid() != trace_owner) {trace_used = 0; return;}
+    for(size_t written = 0; written < trace_used;){
+        ssize_t n = write(trace_fd, trace_buffer + written, trace_used - written);
+        if(n == -1 && errno == EINTR) continue;
+        if(n == -1) {perror("trace"); break;}
+        written += n;
+    }
+    trace_used = 0;
+}
+
+/*
+ * Appends text to out as the contents of a JSON string, escaping quotes, backslashes and control characters
+ * At most limit bytes are written, text is cut at a character boundary of the escaped form
+ * Returns the end of the written text
+ */
+static char *json_escape(char *out, const char *text, size_t limit){
+    char *stop = out + limit;
+    for(; *text != '\0'; text ++){
+        unsigned char c = *text;
+        if(c >= 0x20 && c != '"' && c != '\\'){
+            if(out + 1 > stop) break;
+            *out ++ = c;
+        }
+        else{
+            if(out + 6 > stop) break;
+            if(c >= 0x20) {*out ++ = '\\'; *out ++ = c;}
+            else out += sprintf(out, "\\u%04x", c);
+        }
+    }
+    return out;
+}
+
+/*
+ * Appends a number to out, with a '.' before the last three digits when micro is set (nanoseconds as microseconds)
+ * Returns the end of the written text
+ */
+static char *append_number(char *out, unsigned long long number, int micro){
+    char digits[24];
+    int n = 0;
+    do {digits[n ++] = '0' + number % 10; number /= 10;} while(number > 0 || (micro && n < 4));
+    while(n > 0){
+        *out ++ = digits[-- n];
+        if(micro && n == 3) *out ++ = '.';
+    }
+    return out;
+}
+
+static char *append_text(char *out, const char *text){
+    size_t length = strlen(text);
+    memcpy(out, text, length);
+    return out + length;
+}
+
+/*
+ * Appends one event to the buffer, writing the buffer to the file first when it could not hold it
+ */
+static void trace_append(const char *event, int length){
+    if(trace_used + length + 2 > TRACE_BUFSIZE) trace_flush();
+    if(trace_events ++ > 0) trace_buffer[trace_used ++] = ',';
+    trace_buffer[trace_used ++] = '\n';
+    memcpy(trace_buffer + trace_used, event, length);
+    trace_used += length;
+}
+
+/*
+ * Starts writing trace events to path, in the JSON array format of the Chrome trace viewer (about:tracing) and Perfetto
+ * The events stay in a buffer that is written when it is full and by trace_close(), which runs at exit
+ * Only one trace can be open, a second one is refused
+ * Returns 1 on success or 0 with an error printed
+ */
+int trace_open(const char *path){
+    if(trace_fd != -1) {fprintf(stderr, "error: --trace given twice\n"); return 0;}
+    trace_buffer = malloc(TRACE_BUFSIZE);
+    if(trace_buffer == NULL) {perror("trace"); return 0;}
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if(trace_fd == -1) {perror(path); free(trace_buffer); trace_buffer = NULL; return 0;}
+    trace_owner = getpid();
+    trace_buffer[0] = '[';
+    trace_used = 1;
+    trace_events = 0;
+    trace_enabled = 1;
+    atexit(trace_close);
+    return 1;
+}
+
+/*
+ * Writes the remaining events and ends the array, only in the process that opened the trace
+ * Spans still open (see trace_begin()) end now, as when the shell execs its last command or exits in the middle of a script
+ */
+void trace_close(){
+    if(!trace_enabled || getpid() != trace_owner) return;
+    if(trace_depth > 0){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        unsigned long long now = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        while(trace_depth > 0) trace_end(now);
+    }
+    if(trace_used + 3 > TRACE_BUFSIZE) trace_flush();
+    memcpy(trace_buffer + trace_used, "\n]\n", 3);
+    trace_used += 3;
+    trace_flush();
+    close(trace_fd);
+    free(trace_buffer);
+    trace_enabled = 0;
+}
+
+/*
+ * Records a span of the shell from start_ns to end_ns (CLOCK_MONOTONIC) on a track, 0 for the shell itself and
+ * 1 and above for children (stage s of a pipeline on track s + 1), detail is shown with the span and may be NULL.
+ * Each track gets a name the first time it is used
+ */
+void trace_span(const char *name, int track, unsigned long long start_ns, unsigned long long end_ns, const char *detail){
+    if(!trace_enabled) return;
+    char event[TRACE_EVENT_MAX];
+    int length;
+    if(track >= 0 && track < TRACE_TRACKS && !trace_named[track]){
+        trace_named[track] = 1;
+        if(track == 0) length = snprintf(event, sizeof(event), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"shell\"}}", trace_owner);
+        else length = snprintf(event, sizeof(event), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"children %d\"}}", trace_owner, track, track);
+        trace_append(event, length);
+    }
+    //the event is formatted in place, which keeps the cost of a span to a few hundred nanoseconds
+    if(trace_used + TRACE_EVENT_MAX > TRACE_BUFSIZE) trace_flush();
+    char *out = trace_buffer + trace_used;
+    if(trace_events ++ > 0) *out ++ = ',';
+    out = append_text(out, "\n{\"name\":\"");
+    out = json_escape(out, name, TRACE_EVENT_MAX / 4);
+    out = append_text(out, "\",\"ph\":\"X\",\"ts\":");
+    out = append_number(out, start_ns, 1);
+    out = append_text(out, ",\"dur\":");
+    out = append_number(out, end_ns - start_ns, 1);
+    out = append_text(out, ",\"pid\":");
+    out = append_number(out, trace_owner, 0);
+    out = append_text(out, ",\"tid\":");
+    out = append_number(out, track, 0);
+    out = append_text(out, ",\"args\":{\"detail\":\"");
+    out = json_escape(out, detail != NULL ? detail : "", TRACE_EVENT_MAX / 2);
+    out = append_text(out, "\"}}");
+    trace_used = out - trace_buffer;
+}
+
+/*
+ * Begins a span that trace_end() records, for spans the shell may never get back to the end of.
+ * Spans nest, trace_end() ends the last one begun. name and detail must stay valid until then
+ */
+void trace_begin(const char *name, int track, unsigned long long start_ns, const char *detail){
+    if(!trace_enabled) return;
+    if(trace_depth < TRACE_OPEN_MAX){
+        open_span span = {name, detail, track, start_ns};
+        trace_open_spans[trace_depth] = span;
+    }
+    trace_depth ++;
+}
+
+void trace_end(unsigned long long end_ns){
+    if(!trace_enabled || trace_depth == 0) return;
+    trace_depth --;
+    if(trace_depth < TRACE_OPEN_MAX){
+        open_span *span = &trace_open_spans[trace_depth];
+        trace_span(span->name, span->track, span->start_ns, end_ns, span->detail);
+    }
+}
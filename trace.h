@@ -0,0 +1,12 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+extern int trace_enabled;
+
+int trace_open(const char *path);
+void trace_close();
+void trace_span(const char *name, int track, unsigned long long start_ns, unsigned long long end_ns, const char *detail);
+void trace_begin(const char *name, int track, unsigned long long start_ns, const char *detail);
+void trace_end(unsigned long long end_ns);
+
+#endif
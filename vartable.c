@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include "vartable.h"
+
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
+//marks a slot whose entry was unset, probing continues past it
+static char tombstone[] = "";
+
+/*
+ * FNV-1a hash of a name of known length
+ */
+static unsigned int hash_name(const char *name, unsigned int length){
+    unsigned int hash = 2166136261u;
+    for(unsigned int i = 0; i < length; i ++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Returns the slot holding name, or the slot it should be inserted into if it is not present
+ * The first tombstone seen on the probe path is reused for insertion
+ */
+static var_entry *find_slot(var_table *table, const char *name, unsigned int length, unsigned int hash){
+    unsigned int mask = table->capacity - 1;
+    var_entry *reuse = NULL;
+    for(unsigned int i = hash & mask;; i = (i + 1) & mask){
+        var_entry *slot = &table->slots[i];
+        if(slot->name == NULL) return reuse != NULL ? reuse : slot;
+        if(slot->name == tombstone){
+            if(reuse == NULL) reuse = slot;
+            continue;
+        }
+        if(slot->hash == hash && strncmp(slot->name, name, length) == 0 && slot->name[length] == '\0') return slot;
+    }
+}
+
+/*
+ * Rehashes every live entry into a table of the given capacity, dropping tombstones
+ * Returns 1 on success or 0 if not able to allocate storage
+ */
+static int resize(var_table *table, unsigned int capacity){
+    var_entry *slots = calloc(capacity, sizeof(var_entry));
+    if(slots == NULL) return 0;
+    if(DEBUG) fprintf(stderr, "Resize %p to %u\n", table, capacity);
+    var_entry *old = table->slots;
+    unsigned int old_capacity = table->capacity;
+    table->slots = slots;
+    table->capacity = capacity;
+    table->used = table->size;
+    for(unsigned int i = 0; i < old_capacity; i ++){
+        if(old[i].name == NULL || old[i].name == tombstone) continue;
+        unsigned int mask = capacity - 1, j = old[i].hash & mask;
+        while(slots[j].name != NULL) j = (j + 1) & mask;
+        slots[j] = old[i];
+    }
+    free(old);
+    return 1;
+}
+
+/* Initializes an empty table with at least the given capacity (must be greater than 0)
+ * Returns 1 on success or 0 if not able to allocate storage
+ */
+int vars_init(var_table *table, unsigned int capacity){
+    assert(capacity > 0);
+    unsigned int rounded = 8;
+    while(rounded < capacity) rounded *= 2;
+    table->size = 0;
+    table->used = 0;
+    table->capacity = rounded;
+    table->envp = NULL;
+    table->env_dirty = 1;
+    table->slots = calloc(rounded, sizeof(var_entry));
+    return table->slots != NULL;
+}
+
+/*
+ * Frees every entry, the slots and the cached environment
+ */
+void vars_destroy(var_table *table){
+    for(unsigned int i = 0; i < table->capacity; i ++){
+        if(table->slots[i].name == NULL || table->slots[i].name == tombstone) continue;
+        free(table->slots[i].name);
+        free(table->slots[i].value);
+    }
+    free(table->slots);
+    free(table->envp);
+    table->slots = NULL;
+    table->envp = NULL;
+}
+
+/* Adds every NAME=VALUE string of an environment array as an exported variable
+ * Returns 1 on success or 0 on failure
+ */
+int vars_import(var_table *table, char **env){
+    for(int i = 0; env[i] != NULL; i ++){
+        char *equals = strchr(env[i], '=');
+        if(equals == NULL) continue;
+        unsigned int length = equals - env[i];
+        char name[length + 1];
+        memcpy(name, env[i], length);
+        name[length] = '\0';
+        if(!vars_set(table, name, equals + 1, VAR_EXPORT)) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Looks up a variable by a name that does not need to be NUL terminated
+ * Returns the entry, or NULL if the variable is not set
+ */
+var_entry *vars_lookup(var_table *table, const char *name, unsigned int length){
+    var_entry *slot = find_slot(table, name, length, hash_name(name, length));
+    if(slot->name == NULL || slot->name == tombstone) return NULL;
+    return slot;
+}
+
+/*
+ * Returns the value of a variable, or NULL if it is not set
+ */
+char *vars_get(var_table *table, const char *name){
+    var_entry *entry = vars_lookup(table, name, strlen(name));
+    return entry == NULL ? NULL : entry->value;
+}
+
+/* Sets a variable, keeping its export flag unless VAR_EXPORT is passed in flags
+ * A NULL value only marks an existing variable (or a new empty one) as exported
+ * Returns 1 on success or 0 if not able to allocate storage
+ */
+int vars_set(var_table *table, const char *name, const char *value, int flags){
+    if((table->used + 1) * 10 > table->capacity * 7){
+        //grow when live entries dominate, otherwise rehashing in place clears tombstones
+        unsigned int capacity = (table->size + 1) * 10 > table->capacity * 5 ? table->capacity * 2 : table->capacity;
+        if(!resize(table, capacity)) return 0;
+    }
+    unsigned int length = strlen(name), hash = hash_name(name, length);
+    var_entry *slot = find_slot(table, name, length, hash);
+    if(slot->name == NULL || slot->name == tombstone){
+        char *copy = malloc(length + 1);
+        char *copy_value = strdup(value != NULL ? value : "");
+        if(copy == NULL || copy_value == NULL) {free(copy); free(copy_value); return 0;}
+        memcpy(copy, name, length + 1);
+        if(slot->name == NULL) table->used ++;
+        table->size ++;
+        slot->name = copy;
+        slot->value = copy_value;
+        slot->hash = hash;
+        slot->flags = flags;
+    }
+    else{
+        if(value != NULL){
+            char *copy_value = strdup(value);
+            if(copy_value == NULL) return 0;
+            free(slot->value);
+            slot->value = copy_value;
+        }
+        slot->flags |= flags;
+    }
+    if(slot->flags & VAR_EXPORT) table->env_dirty = 1;
+    return 1;
+}
+
+/* Removes a variable, leaving a tombstone so later entries on the probe path stay reachable
+ * Returns 1 if the variable was set or 0 otherwise
+ */
+int vars_unset(var_table *table, const char *name){
+    var_entry *slot = vars_lookup(table, name, strlen(name));
+    if(slot == NULL) return 0;
+    if(slot->flags & VAR_EXPORT) table->env_dirty = 1;
+    free(slot->name);
+    free(slot->value);
+    slot->name = tombstone;
+    slot->value = NULL;
+    table->size --;
+    return 1;
+}
+
+/*
+ * Returns a NULL terminated NAME=VALUE array of the exported variables for execve()
+ * The array is only rebuilt after an exported variable changed, strings share a single allocation with it
+ */
+char **vars_environ(var_table *table){
+    if(!table->env_dirty && table->envp != NULL) return table->envp;
+    unsigned int count = 0;
+    size_t bytes = 0;
+    for(unsigned int i = 0; i < table->capacity; i ++){
+        var_entry *slot = &table->slots[i];
+        if(slot->name == NULL || slot->name == tombstone || !(slot->flags & VAR_EXPORT)) continue;
+        count ++;
+        bytes += strlen(slot->name) + strlen(slot->value) + 2;
+    }
+    char **envp = malloc(sizeof(char *) * (count + 1) + bytes);
+    if(envp == NULL) return table->envp;
+    char *strings = (char *)(envp + count + 1);
+    unsigned int n = 0;
+    for(unsigned int i = 0; i < table->capacity; i ++){
+        var_entry *slot = &table->slots[i];
+        if(slot->name == NULL || slot->name == tombstone || !(slot->flags & VAR_EXPORT)) continue;
+        envp[n ++] = strings;
+        strings += sprintf(strings, "%s=%s", slot->name, slot->value) + 1;
+    }
+    envp[n] = NULL;
+    free(table->envp);
+    table->envp = envp;
+    table->env_dirty = 0;
+    return envp;
+}
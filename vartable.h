@@ -0,0 +1,35 @@
+#ifndef _VARTABLE_H
+#define _VARTABLE_H
+
+#define VAR_EXPORT 1
+
+typedef struct{
+    char *name;
+    char *value;
+    unsigned int hash;
+    int flags;
+} var_entry;
+
+/*
+ * Open addressing (linear probing) table of shell variables
+ * capacity is always a power of two, used counts live entries plus tombstones left by unset
+ */
+typedef struct{
+    unsigned int size;
+    unsigned int used;
+    unsigned int capacity;
+    var_entry *slots;
+    char **envp;
+    int env_dirty;
+} var_table;
+
+int vars_init(var_table *table, unsigned int capacity);
+void vars_destroy(var_table *table);
+int vars_import(var_table *table, char **env);
+var_entry *vars_lookup(var_table *table, const char *name, unsigned int length);
+char *vars_get(var_table *table, const char *name);
+int vars_set(var_table *table, const char *name, const char *value, int flags);
+int vars_unset(var_table *table, const char *name);
+char **vars_environ(var_table *table);
+
+#endif
@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <linux/limits.h>
+#include "watch.h"
+
+//changes that count: contents written or replaced, files created, removed or renamed, and the watched path going away
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*
+ * Adds the watch of path i, on the path itself or, if it does not exist, on its directory
+ * Returns 1 on success or 0 if neither can be watched
+ */
+static int watch_add(watch_set *w, int i){
+    w->wds[i] = inotify_add_watch(w->fd, w->paths[i], WATCH_EVENTS);
+    if(w->wds[i] != -1 || errno != ENOENT) return w->wds[i] != -1;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", w->paths[i]);
+    w->wds[i] = inotify_add_watch(w->fd, dirname(dir), IN_CREATE | IN_MOVED_TO);
+    return w->wds[i] != -1;
+}
+
+/*
+ * Creates the inotify descriptor and watches every path
+ * Returns 1 on success or 0 with an error printed to err
+ */
+int watch_open(watch_set *w, char **paths, int count, FILE *err){
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(w->fd == -1) {fprintf(err, "inotify: %s\n", strerror(errno)); return 0;}
+    w->count = count;
+    w->paths = paths;
+    w->wds = malloc(sizeof(int) * count);
+    for(int i = 0; i < count; i ++){
+        if(!watch_add(w, i)) {fprintf(err, "%s: %s\n", paths[i], strerror(errno)); watch_close(w); return 0;}
+    }
+    return 1;
+}
+
+/*
+ * Reads every pending event without blocking
+ * Returns the number of events read, the watches of removed or replaced paths are dropped (see watch_refresh())
+ */
+int watch_read(watch_set *w){
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int count = 0;
+    ssize_t n;
+    while((n = read(w->fd, events, sizeof(events))) > 0 || (n == -1 && errno == EINTR)){
+        for(char *p = events; n > 0 && p < events + n;){
+            struct inotify_event *event = (struct inotify_event *)p;
+            if(event->mask & IN_IGNORED){
+                for(int i = 0; i < w->count; i ++) if(w->wds[i] == event->wd) w->wds[i] = -1;
+            }
+            else count ++;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return count;
+}
+
+/*
+ * Watches again the paths whose watch was dropped, a file an editor replaced gets a new inode and needs a new watch,
+ * and paths watched through their directory once they exist
+ */
+void watch_refresh(watch_set *w){
+    for(int i = 0; i < w->count; i ++){
+        if(w->wds[i] != -1 && access(w->paths[i], F_OK) == -1) continue;
+        int wd = inotify_add_watch(w->fd, w->paths[i], WATCH_EVENTS);
+        //the same inode gives back the same watch, a new one leaves the directory watch in place for other paths
+        if(wd != -1) w->wds[i] = wd;
+        else if(w->wds[i] == -1) watch_add(w, i);
+    }
+}
+
+void watch_close(watch_set *w){
+    close(w->fd);
+    free(w->wds);
+}
@@ -0,0 +1,22 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#include <stdio.h>
+
+/*
+ * inotify watches for a list of paths, wds[i] is the watch of paths[i] or -1 while it has none
+ * A path that does not exist is watched through its directory until it appears
+ */
+typedef struct{
+    int fd;
+    int count;
+    char **paths;
+    int *wds;
+} watch_set;
+
+int watch_open(watch_set *w, char **paths, int count, FILE *err);
+int watch_read(watch_set *w);
+void watch_refresh(watch_set *w);
+void watch_close(watch_set *w);
+
+#endif
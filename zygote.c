@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "zygote.h"
+#include "copy.h"
+
+#define ZYGOTE_FDS 3
+
+/*
+ * Spawn request, followed by the path, the working directory, the arguments and the environment as NUL terminated strings
+ * The descriptors to use as stdin, stdout and stderr travel with it as SCM_RIGHTS ancillary data
+ */
+typedef struct{
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t size;
+} zygote_request;
+
+/*
+ * Receives a request and its descriptors
+ * Returns the payload, which the caller frees, or NULL once the shell has closed its end
+ */
+static char *receive_request(int sock, zygote_request *request, int fds[ZYGOTE_FDS]){
+    if(!recv_fds(sock, request, sizeof(*request), fds, ZYGOTE_FDS)) return NULL;
+    char *payload = NULL;
+    if((payload = malloc(request->size)) != NULL && read_all(sock, payload, request->size)) return payload;
+    free(payload);
+    for(int i = 0; i < ZYGOTE_FDS; i ++) close(fds[i]);
+    return NULL;
+}
+
+/*
+ * Main loop of the zygote, serves spawn requests until the shell closes the socket
+ * Children are created with CLONE_PARENT so they are children of the shell, which waits for them as usual
+ */
+static void zygote_main(int sock){
+    zygote_request request;
+    int fds[ZYGOTE_FDS];
+    char *payload;
+    //the zygote is in the shell's process group, Ctrl-C for a command must not end it, its children get the actions it had
+    struct sigaction ignore = {0}, interrupt, quit;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGINT, &ignore, &interrupt);
+    sigaction(SIGQUIT, &ignore, &quit);
+    while((payload = receive_request(sock, &request, fds)) != NULL){
+        char **argv = malloc(sizeof(char *) * ((size_t)request.argc + request.envc + 2));
+        char *p = payload, *end = payload + request.size, *path = NULL, *cwd = NULL;
+        int32_t reply = -EINVAL;
+        //path, cwd, then argc arguments and envc environment strings, all inside the payload
+        uint32_t strings = 0, total = request.argc + request.envc + 2;
+        for(; argv != NULL && strings < total && p < end && memchr(p, '\0', end - p) != NULL; strings ++){
+            if(strings == 0) path = p;
+            else if(strings == 1) cwd = p;
+            else argv[strings - 2 + (strings - 2 >= request.argc)] = p;
+            p += strlen(p) + 1;
+        }
+        if(strings == total){
+            argv[request.argc] = NULL;
+            argv[request.argc + request.envc + 1] = NULL;
+            pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+            if(pid == 0){
+                sigaction(SIGINT, &interrupt, NULL);
+                sigaction(SIGQUIT, &quit, NULL);
+                for(int i = 0; i < ZYGOTE_FDS; i ++) dup2(fds[i], i);
+                if(chdir(cwd) == -1) {perror(cwd); _exit(126);}
+                execve(path, argv, argv + request.argc + 1);
+                perror(path);
+                _exit(127);
+            }
+            reply = pid == -1 ? -errno : pid;
+        }
+        for(int i = 0; i < ZYGOTE_FDS; i ++) close(fds[i]);
+        free(argv);
+        free(payload);
+        if(!send_all(sock, &reply, sizeof(reply))) break;
+    }
+    _exit(0);
+}
+
+/*
+ * Forks the zygote, to be called as early as possible so its memory stays small
+ * Returns 1 on success or 0 on error
+ */
+int zygote_start(zygote *z){
+    int fds[2];
+    z->sock = -1;
+    z->pid = -1;
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) return 0;
+    fflush(NULL);
+    pid_t pid = fork();
+    if(pid == -1) {close(fds[0]); close(fds[1]); return 0;}
+    if(pid == 0){
+        close(fds[0]);
+        zygote_main(fds[1]);
+    }
+    close(fds[1]);
+    z->sock = fds[0];
+    z->pid = pid;
+    return 1;
+}
+
+/*
+ * Asks the zygote to start path with the given arguments and environment in directory cwd,
+ * with fds[0], fds[1] and fds[2] as its stdin, stdout and stderr
+ * Returns the pid of the new child of the shell, or -1 with errno set if the zygote could not start it
+ */
+pid_t zygote_spawn(zygote *z, const char *path, char **argv, char **envp, const char *cwd, const int fds[3]){
+    zygote_request request;
+    size_t size = strlen(path) + strlen(cwd) + 2;
+    request.argc = 0;
+    request.envc = 0;
+    for(; argv[request.argc] != NULL; request.argc ++) size += strlen(argv[request.argc]) + 1;
+    for(; envp[request.envc] != NULL; request.envc ++) size += strlen(envp[request.envc]) + 1;
+    if(size > UINT32_MAX) {errno = E2BIG; return -1;}
+    request.size = size;
+    char *payload = malloc(size), *p = payload;
+    if(payload == NULL) return -1;
+    p = stpcpy(p, path) + 1;
+    p = stpcpy(p, cwd) + 1;
+    for(uint32_t i = 0; i < request.argc; i ++) p = stpcpy(p, argv[i]) + 1;
+    for(uint32_t i = 0; i < request.envc; i ++) p = stpcpy(p, envp[i]) + 1;
+
+    int32_t reply;
+    int ok = send_fds(z->sock, &request, sizeof(request), fds, ZYGOTE_FDS) && send_all(z->sock, payload, size)
+        && read_all(z->sock, &reply, sizeof(reply));
+    free(payload);
+    if(!ok) {errno = EPIPE; return -1;}
+    if(reply < 0) {errno = -reply; return -1;}
+    return reply;
+}
+
+/*
+ * Closes the connection to the zygote, which makes it exit, and waits for it
+ */
+void zygote_stop(zygote *z){
+    if(z->sock == -1) return;
+    close(z->sock);
+    waitpid(z->pid, NULL, 0);
+    z->sock = -1;
+    z->pid = -1;
+}
@@ -0,0 +1,19 @@
+#ifndef _ZYGOTE_H
+#define _ZYGOTE_H
+
+#include <sys/types.h>
+
+/*
+ * Helper process forked while the shell is still small, it starts commands on the shell's behalf
+ * so their start cost does not grow with the shell's memory
+ */
+typedef struct{
+    int sock;
+    pid_t pid;
+} zygote;
+
+int zygote_start(zygote *z);
+pid_t zygote_spawn(zygote *z, const char *path, char **argv, char **envp, const char *cwd, const int fds[3]);
+void zygote_stop(zygote *z);
+
+#endif